@@ -0,0 +1,366 @@
+#include "aof.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buf.h"
+#include "utils.h"
+
+// Once the rewrite child is done, the diff is copied to its file without
+// holding the lock until no more than this is left; the rest is copied with
+// appends blocked, right before the switch.
+#define AOF_REWRITE_FINAL_MAX (64 * 1024)
+
+static struct {
+    int fd;
+    char path[300];
+    enum aof_fsync policy;
+    void (*on_sync)(void);
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued;      // records were appended, or the child exited
+    pthread_cond_t synced_cond; // `synced` advanced
+    struct buf queue;           // appended, not yet taken by the writer
+    uint64_t appended;          // offset just past `queue`
+
+    // Rewrite state, guarded by `lock`.
+    int rewriting;
+    pid_t child;
+    int tmp_fd;
+    struct buf diff;            // everything appended since the fork
+    int child_done;
+    int child_status;
+
+    // Owned by the writer thread.
+    uint64_t written;
+    uint64_t file_size;
+    uint64_t base_size;         // file size after startup or the last rewrite
+
+    int auto_percent;
+    uint64_t auto_min_size;
+    atomic_int rewrite_due;
+    _Atomic uint64_t synced;
+} aof = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .synced_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void rewrite_path(char *out, size_t len) {
+    snprintf(out, len, "%s.rewrite", aof.path);
+}
+
+static void publish_synced(uint64_t offset) {
+    pthread_mutex_lock(&aof.lock);
+    atomic_store_explicit(&aof.synced, offset, memory_order_release);
+    pthread_cond_broadcast(&aof.synced_cond);
+    pthread_mutex_unlock(&aof.lock);
+    if (aof.on_sync) {
+        aof.on_sync();
+    }
+}
+
+static void rewrite_abort(const char *what) {
+    char tmp[sizeof(aof.path) + 16];
+    rewrite_path(tmp, sizeof(tmp));
+    if (what) {
+        perror(what);
+    }
+    fprintf(stderr, "Background AOF rewrite failed\n");
+    close(aof.tmp_fd);
+    unlink(tmp);
+    pthread_mutex_lock(&aof.lock);
+    aof.rewriting = 0;
+    buf_consume(&aof.diff, buf_len(&aof.diff));
+    pthread_mutex_unlock(&aof.lock);
+}
+
+// Appends what was logged during the rewrite to the child's file and swaps
+// it in. Runs on the writer thread; returns 1 if the log was replaced.
+static int rewrite_finish(int status) {
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        rewrite_abort(NULL);
+        return 0;
+    }
+    struct buf chunk;
+    buf_init(&chunk, 0);
+    for (;;) {
+        pthread_mutex_lock(&aof.lock);
+        if (buf_len(&aof.diff) <= AOF_REWRITE_FINAL_MAX) {
+            break;
+        }
+        struct buf tmp = aof.diff;
+        aof.diff = chunk;
+        chunk = tmp;
+        pthread_mutex_unlock(&aof.lock);
+        if (write_all(aof.tmp_fd, buf_head(&chunk), buf_len(&chunk)) < 0) {
+            buf_free(&chunk);
+            rewrite_abort("aof rewrite");
+            return 0;
+        }
+        buf_consume(&chunk, buf_len(&chunk));
+    }
+    buf_free(&chunk);
+
+    // Still locked: nothing is appended until the new file is in place, and
+    // whatever is queued for the old one is already part of the diff.
+    char tmp[sizeof(aof.path) + 16];
+    rewrite_path(tmp, sizeof(tmp));
+    if (write_all(aof.tmp_fd, buf_head(&aof.diff), buf_len(&aof.diff)) < 0 ||
+        fdatasync(aof.tmp_fd) < 0 || rename(tmp, aof.path) < 0) {
+        pthread_mutex_unlock(&aof.lock);
+        rewrite_abort("aof rewrite");
+        return 0;
+    }
+    buf_consume(&aof.diff, buf_len(&aof.diff));
+    buf_consume(&aof.queue, buf_len(&aof.queue));
+    close(aof.fd);
+    aof.fd = aof.tmp_fd;
+    aof.rewriting = 0;
+    aof.written = aof.appended;
+    pthread_mutex_unlock(&aof.lock);
+
+    if (fsync_dir(aof.path) < 0) {
+        perror("aof rewrite: fsync directory");
+    }
+    uint64_t old_size = aof.file_size;
+    struct stat st;
+    aof.file_size = fstat(aof.fd, &st) == 0 ? (uint64_t) st.st_size : 0;
+    aof.base_size = aof.file_size;
+    printf("Background AOF rewrite done: %llu -> %llu bytes\n", (unsigned long long) old_size,
+           (unsigned long long) aof.file_size);
+    return 1;
+}
+
+static void check_auto_rewrite(int rewriting) {
+    if (aof.auto_percent == 0 || aof.file_size < aof.auto_min_size || rewriting) {
+        return;
+    }
+    if (aof.file_size >= aof.base_size + aof.base_size * aof.auto_percent / 100) {
+        atomic_store_explicit(&aof.rewrite_due, 1, memory_order_relaxed);
+    }
+}
+
+static void *writer_loop(void *arg) {
+    (void) arg;
+    struct buf out;
+    buf_init(&out, 0);
+    uint64_t last_fsync_ms = now_ms();
+    int dirty = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&aof.lock);
+        while (buf_len(&aof.queue) == 0 && !aof.child_done) {
+            if (aof.policy != AOF_FSYNC_EVERYSEC || !dirty) {
+                pthread_cond_wait(&aof.queued, &aof.lock);
+                continue;
+            }
+            uint64_t due = last_fsync_ms + 1000;
+            uint64_t now = now_ms();
+            if (now >= due) {
+                break;
+            }
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            uint64_t ns = ts.tv_nsec + (due - now) * 1000000;
+            ts.tv_sec += ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+            pthread_cond_timedwait(&aof.queued, &aof.lock, &ts);
+        }
+        struct buf tmp = aof.queue;
+        aof.queue = out;
+        out = tmp;
+        uint64_t end = aof.appended;
+        int child_done = aof.child_done;
+        int child_status = aof.child_status;
+        int rewriting = aof.rewriting;
+        aof.child_done = 0;
+        pthread_mutex_unlock(&aof.lock);
+
+        if (buf_len(&out) > 0) {
+            // Acknowledged writes could otherwise be lost without notice.
+            if (write_all(aof.fd, buf_head(&out), buf_len(&out)) < 0) {
+                perror_die("aof write");
+            }
+            aof.file_size += buf_len(&out);
+            buf_consume(&out, buf_len(&out));
+            aof.written = end;
+            dirty = 1;
+        }
+        if (child_done && rewrite_finish(child_status)) {
+            // The new file was synced as a whole.
+            last_fsync_ms = now_ms();
+            dirty = 0;
+            publish_synced(aof.written);
+            rewriting = 0;
+        }
+        check_auto_rewrite(rewriting);
+
+        switch (aof.policy) {
+        case AOF_FSYNC_ALWAYS:
+        case AOF_FSYNC_EVERYSEC:
+            if (!dirty || (aof.policy == AOF_FSYNC_EVERYSEC && now_ms() - last_fsync_ms < 1000)) {
+                break;
+            }
+            if (fdatasync(aof.fd) < 0) {
+                perror_die("aof fdatasync");
+            }
+            last_fsync_ms = now_ms();
+            dirty = 0;
+            publish_synced(aof.written);
+            break;
+        case AOF_FSYNC_NO:
+            publish_synced(aof.written);
+            break;
+        }
+    }
+    return NULL;
+}
+
+void aof_start(const char *path, enum aof_fsync policy, void (*on_sync)(void)) {
+    if (strlen(path) >= sizeof(aof.path)) {
+        die("append-only file path too long: '%s'", path);
+    }
+    strcpy(aof.path, path);
+    aof.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (aof.fd < 0) {
+        perror_die(path);
+    }
+    struct stat st;
+    if (fstat(aof.fd, &st) < 0) {
+        perror_die(path);
+    }
+    aof.file_size = aof.base_size = st.st_size;
+    aof.policy = policy;
+    aof.on_sync = on_sync;
+    buf_init(&aof.queue, 0);
+    buf_init(&aof.diff, 0);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&aof.queued, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, writer_loop, NULL);
+    if (rc != 0) {
+        die("pthread_create: %s", strerror(rc));
+    }
+    pthread_detach(thread);
+}
+
+void aof_set_auto_rewrite(int percent, uint64_t min_size) {
+    aof.auto_percent = percent;
+    aof.auto_min_size = min_size;
+}
+
+uint64_t aof_append(const void *data, size_t len) {
+    pthread_mutex_lock(&aof.lock);
+    int was_empty = buf_len(&aof.queue) == 0;
+    buf_append(&aof.queue, data, len);
+    if (aof.rewriting) {
+        buf_append(&aof.diff, data, len);
+    }
+    aof.appended += len;
+    uint64_t end = aof.appended;
+    if (was_empty) {
+        pthread_cond_signal(&aof.queued);
+    }
+    pthread_mutex_unlock(&aof.lock);
+    return end;
+}
+
+uint64_t aof_synced(void) {
+    return atomic_load_explicit(&aof.synced, memory_order_acquire);
+}
+
+void aof_wait(uint64_t offset) {
+    pthread_mutex_lock(&aof.lock);
+    while (atomic_load_explicit(&aof.synced, memory_order_relaxed) < offset) {
+        pthread_cond_wait(&aof.synced_cond, &aof.lock);
+    }
+    pthread_mutex_unlock(&aof.lock);
+}
+
+static void *reap_child(void *arg) {
+    pid_t pid = (pid_t) (intptr_t) arg;
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            status = -1;
+            break;
+        }
+    }
+    pthread_mutex_lock(&aof.lock);
+    aof.child_status = status;
+    aof.child_done = 1;
+    pthread_cond_signal(&aof.queued);
+    pthread_mutex_unlock(&aof.lock);
+    return NULL;
+}
+
+int aof_rewrite_start(int (*dump)(int fd)) {
+    char tmp[sizeof(aof.path) + 16];
+    rewrite_path(tmp, sizeof(tmp));
+
+    pthread_mutex_lock(&aof.lock);
+    if (aof.rewriting) {
+        pthread_mutex_unlock(&aof.lock);
+        errno = EBUSY;
+        return -1;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        pthread_mutex_unlock(&aof.lock);
+        return -1;
+    }
+    uint64_t start = now_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(dump(fd) == 0 && fdatasync(fd) == 0 ? 0 : 1);
+    }
+    if (pid < 0) {
+        int err = errno;
+        pthread_mutex_unlock(&aof.lock);
+        close(fd);
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    // Everything appended from here on is newer than the child's snapshot.
+    aof.rewriting = 1;
+    aof.child = pid;
+    aof.tmp_fd = fd;
+    atomic_store_explicit(&aof.rewrite_due, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&aof.lock);
+
+    printf("Background AOF rewrite started by pid %d (fork took %.3f ms)\n", (int) pid,
+           (now_ns() - start) / 1e6);
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, reap_child, (void *) (intptr_t) pid);
+    if (rc != 0) {
+        die("pthread_create: %s", strerror(rc));
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+int aof_rewrite_in_progress(void) {
+    pthread_mutex_lock(&aof.lock);
+    int rewriting = aof.rewriting;
+    pthread_mutex_unlock(&aof.lock);
+    return rewriting;
+}
+
+int aof_rewrite_due(void) {
+    return atomic_load_explicit(&aof.rewrite_due, memory_order_relaxed);
+}
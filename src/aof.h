@@ -0,0 +1,46 @@
+#ifndef AOF_H
+#define AOF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+// Append-only log writer. Producers hand over encoded records with
+// aof_append(); a dedicated thread writes whatever has accumulated in one go
+// and then, depending on the policy, fsyncs once per such batch (always),
+// once a second (everysec) or never (no). Commands appended while an fsync is
+// in progress share the next one, so a busy server pays far fewer fsyncs than
+// it executes writes. Offsets count bytes appended since aof_start().
+
+// Opens `path` for appending (creating it if needed) and starts the writer.
+// `on_sync` is called on the writer thread each time aof_synced() advances.
+void aof_start(const char *path, enum aof_fsync policy, void (*on_sync)(void));
+
+// Queues `len` bytes and returns the offset just past them.
+uint64_t aof_append(const void *data, size_t len);
+
+// Offset up to which the log is on stable storage (as far as the policy
+// guarantees; with "no" this is just what has been written).
+uint64_t aof_synced(void);
+
+// Blocks the calling thread until aof_synced() reaches `offset`.
+void aof_wait(uint64_t offset);
+
+// Rewrites the log in the background: a forked child calls `dump` to write a
+// minimal log reproducing the current state to FILE.rewrite, while records
+// appended from now on also go to a diff buffer. When the child succeeds the
+// writer appends the diff to its file, syncs it and renames it over the log.
+// The caller must keep the state it dumps from being modified, and nothing
+// else from being appended, during the call. Returns -1 (EBUSY if a rewrite
+// is already running) on failure.
+int aof_rewrite_start(int (*dump)(int fd));
+int aof_rewrite_in_progress(void);
+
+// Automatic rewrites: once the log is at least `min_size` bytes and has grown
+// by `percent` since startup or the last rewrite, aof_rewrite_due() turns
+// true until the next rewrite starts. A percent of 0 disables this.
+void aof_set_auto_rewrite(int percent, uint64_t min_size);
+int aof_rewrite_due(void);
+
+#endif
@@ -0,0 +1,56 @@
+#include "buf.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+void buf_init(struct buf *b, size_t cap) {
+    b->data = cap ? xmalloc(cap) : NULL;
+    b->start = 0;
+    b->end = 0;
+    b->cap = cap;
+}
+
+void buf_free(struct buf *b) {
+    free(b->data);
+    b->data = NULL;
+    b->start = b->end = b->cap = 0;
+}
+
+char *buf_reserve(struct buf *b, size_t n) {
+    if (b->cap - b->end >= n) {
+        return b->data + b->end;
+    }
+    size_t len = buf_len(b);
+    if (b->start > 0) {
+        memmove(b->data, b->data + b->start, len);
+        b->start = 0;
+        b->end = len;
+    }
+    if (b->cap - b->end < n) {
+        size_t cap = b->cap ? b->cap : 64;
+        while (cap - len < n) {
+            cap *= 2;
+        }
+        b->data = xrealloc(b->data, cap);
+        b->cap = cap;
+    }
+    return b->data + b->end;
+}
+
+void buf_commit(struct buf *b, size_t n) {
+    b->end += n;
+}
+
+void buf_append(struct buf *b, const void *data, size_t n) {
+    memcpy(buf_reserve(b, n), data, n);
+    b->end += n;
+}
+
+void buf_consume(struct buf *b, size_t n) {
+    b->start += n;
+    if (b->start == b->end) {
+        b->start = b->end = 0;
+    }
+}
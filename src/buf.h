@@ -0,0 +1,35 @@
+#ifndef BUF_H
+#define BUF_H
+
+#include <stddef.h>
+
+// A growable byte buffer with a consumed prefix. Readable bytes live in
+// [data + start, data + end); free space lives in [data + end, data + cap).
+struct buf {
+    char *data;
+    size_t start;
+    size_t end;
+    size_t cap;
+};
+
+void buf_init(struct buf *b, size_t cap);
+void buf_free(struct buf *b);
+
+static inline size_t buf_len(const struct buf *b) {
+    return b->end - b->start;
+}
+
+static inline char *buf_head(const struct buf *b) {
+    return b->data + b->start;
+}
+
+// Makes room for at least `n` more bytes (compacting or growing) and returns
+// a pointer to the free tail. Call buf_commit() with the number of bytes
+// actually written.
+char *buf_reserve(struct buf *b, size_t n);
+void buf_commit(struct buf *b, size_t n);
+
+void buf_append(struct buf *b, const void *data, size_t n);
+void buf_consume(struct buf *b, size_t n);
+
+#endif
@@ -0,0 +1,737 @@
+#include "config.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "utils.h"
+
+enum {
+    OPT_REUSEPORT = 256,
+    OPT_TRANSPORT,
+    OPT_UNIX,
+    OPT_UNIX_SEQPACKET,
+    OPT_SHM,
+    OPT_UPGRADE_SOCKET,
+    OPT_BUFFER_SIZES,
+    OPT_DRAIN_TIMEOUT,
+    OPT_CPUS,
+    OPT_STEER_CPU,
+    OPT_BATCH,
+    OPT_BUSY_POLL,
+    OPT_UDP_OFFLOAD,
+    OPT_APPENDONLY,
+    OPT_APPENDFSYNC,
+    OPT_AOF_REWRITE_PERCENT,
+    OPT_AOF_REWRITE_MIN_SIZE,
+    OPT_DBFILENAME,
+    OPT_MAXMEMORY,
+    OPT_MAXMEMORY_POLICY,
+    OPT_MAXMEMORY_SAMPLES,
+    OPT_HTTP_ROOT,
+    OPT_HTTP_FILE_CACHE,
+    OPT_HTTP_CACHE_SIZE,
+    OPT_HTTP_CACHE_TTL,
+    OPT_PRINT_CONFIG,
+};
+
+static const struct option long_options[] = {
+    {"config", required_argument, NULL, 'c'},
+    {"engine", required_argument, NULL, 'e'},
+    {"transport", required_argument, NULL, OPT_TRANSPORT},
+    {"mode", required_argument, NULL, 'm'},
+    {"workers", required_argument, NULL, 'w'},
+    {"host", required_argument, NULL, 'H'},
+    {"port", required_argument, NULL, 'p'},
+    {"unix", required_argument, NULL, OPT_UNIX},
+    {"unix-seqpacket", required_argument, NULL, OPT_UNIX_SEQPACKET},
+    {"shm", required_argument, NULL, OPT_SHM},
+    {"upgrade-socket", required_argument, NULL, OPT_UPGRADE_SOCKET},
+    {"backlog", required_argument, NULL, 'b'},
+    {"reuseport", no_argument, NULL, OPT_REUSEPORT},
+    {"buffer-sizes", required_argument, NULL, OPT_BUFFER_SIZES},
+    {"idle-timeout", required_argument, NULL, 't'},
+    {"drain-timeout", required_argument, NULL, OPT_DRAIN_TIMEOUT},
+    {"cpus", required_argument, NULL, OPT_CPUS},
+    {"steer-cpu", no_argument, NULL, OPT_STEER_CPU},
+    {"batch", required_argument, NULL, OPT_BATCH},
+    {"busy-poll", required_argument, NULL, OPT_BUSY_POLL},
+    {"udp-offload", no_argument, NULL, OPT_UDP_OFFLOAD},
+    {"appendonly", required_argument, NULL, OPT_APPENDONLY},
+    {"appendfsync", required_argument, NULL, OPT_APPENDFSYNC},
+    {"auto-aof-rewrite-percentage", required_argument, NULL, OPT_AOF_REWRITE_PERCENT},
+    {"auto-aof-rewrite-min-size", required_argument, NULL, OPT_AOF_REWRITE_MIN_SIZE},
+    {"dbfilename", required_argument, NULL, OPT_DBFILENAME},
+    {"maxmemory", required_argument, NULL, OPT_MAXMEMORY},
+    {"maxmemory-policy", required_argument, NULL, OPT_MAXMEMORY_POLICY},
+    {"maxmemory-samples", required_argument, NULL, OPT_MAXMEMORY_SAMPLES},
+    {"http-root", required_argument, NULL, OPT_HTTP_ROOT},
+    {"http-file-cache", required_argument, NULL, OPT_HTTP_FILE_CACHE},
+    {"http-cache-size", required_argument, NULL, OPT_HTTP_CACHE_SIZE},
+    {"http-cache-ttl", required_argument, NULL, OPT_HTTP_CACHE_TTL},
+    {"print-config", no_argument, NULL, OPT_PRINT_CONFIG},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+static const char short_options[] = "c:e:m:w:H:p:b:t:h";
+
+static void usage(FILE *out, const char *prog) {
+    fprintf(out,
+            "Usage: %s [options]\n"
+            "\n"
+            "  -c, --config FILE          read `key = value` settings (long option names)\n"
+            "  -e, --engine NAME          sequential | threads | epoll (default: epoll)\n"
+            "      --transport NAME       tcp | udp (default: tcp)\n"
+            "  -m, --mode NAME            transform | kv (Redis protocol) | http\n"
+            "                             (default: transform)\n"
+            "  -w, --workers N            reactor threads for the epoll engine (default: 1)\n"
+            "  -H, --host ADDR            listen address (default: any)\n"
+            "  -p, --port P[,P...]        listen port(s), or 'none' (default: 9090)\n"
+            "      --unix PATH            also listen on a Unix stream socket (repeatable)\n"
+            "      --unix-seqpacket PATH  also listen on a Unix seqpacket socket (repeatable)\n"
+            "      --shm PATH             accept shared-memory ring clients at PATH (epoll)\n"
+            "      --upgrade-socket PATH  take over the listeners of the server at PATH, if\n"
+            "                             any, and hand ours to the next one started with it\n"
+            "  -b, --backlog N            listen backlog (default: 128)\n"
+            "      --reuseport            give every worker its own SO_REUSEPORT listener\n"
+            "      --buffer-sizes S,L     initial and maximum per-connection buffer (default: 4k,1m)\n"
+            "  -t, --idle-timeout MS      close connections idle for MS milliseconds (0 = never)\n"
+            "      --drain-timeout MS     on SIGTERM or an upgrade, give clients up to MS\n"
+            "                             milliseconds to finish (default: 25000)\n"
+            "      --cpus LIST            pin workers to CPUs, e.g. 0-3,8 (default: no pinning)\n"
+            "      --steer-cpu            with --reuseport and --cpus, hand each connection to\n"
+            "                             the worker on the CPU that received it\n"
+            "      --batch N              events per epoll_wait, accepts per wakeup and\n"
+            "                             datagrams per recvmmsg/sendmmsg (default: 64)\n"
+            "      --busy-poll US         spin up to US microseconds for events before blocking,\n"
+            "                             and set SO_BUSY_POLL on sockets (default: 0 = off)\n"
+            "      --udp-offload          coalesce datagrams with UDP_GRO / UDP_SEGMENT\n"
+            "      --appendonly FILE      kv: log writes to FILE and replay it at startup\n"
+            "      --appendfsync POLICY   always | everysec | no (default: everysec)\n"
+            "      --auto-aof-rewrite-percentage N\n"
+            "                             compact the log once it grew by N%% (default: 100,\n"
+            "                             0 = never)\n"
+            "      --auto-aof-rewrite-min-size S\n"
+            "                             ... but not below S bytes (default: 64m)\n"
+            "      --dbfilename FILE      kv: SAVE/BGSAVE snapshot, loaded at startup unless\n"
+            "                             --appendonly is given (default: dump.snap)\n"
+            "      --maxmemory S          kv: limit the data to S bytes (default: 0 = none)\n"
+            "      --maxmemory-policy P   what to do at the limit: noeviction (refuse writes),\n"
+            "                             allkeys-lru | allkeys-lfu | allkeys-random, or\n"
+            "                             volatile-lru | volatile-lfu | volatile-random to\n"
+            "                             evict only keys with a TTL (default: noeviction)\n"
+            "      --maxmemory-samples N  keys sampled per eviction (default: 5)\n"
+            "      --http-root DIR        http: serve the files under DIR (default: none)\n"
+            "      --http-file-cache N    http: open files to keep cached (default: 1024)\n"
+            "      --http-cache-size S    http: keep rendered responses in up to S bytes\n"
+            "                             (default: 0 = no response cache)\n"
+            "      --http-cache-ttl MS    http: how long a response stays cached (default: 1000)\n"
+            "      --print-config         print the effective configuration and exit\n"
+            "  -h, --help                 show this help\n"
+            "\n"
+            "Settings are applied in order: defaults, config file, command line.\n",
+            prog);
+}
+
+const char *engine_name(enum engine_kind engine) {
+    switch (engine) {
+    case ENGINE_SEQUENTIAL:
+        return "sequential";
+    case ENGINE_THREADS:
+        return "threads";
+    case ENGINE_EPOLL:
+        return "epoll";
+    }
+    return "unknown";
+}
+
+const char *transport_name(enum transport_kind transport) {
+    switch (transport) {
+    case TRANSPORT_TCP:
+        return "tcp";
+    case TRANSPORT_UDP:
+        return "udp";
+    }
+    return "unknown";
+}
+
+const char *aof_fsync_name(enum aof_fsync policy) {
+    switch (policy) {
+    case AOF_FSYNC_NO:
+        return "no";
+    case AOF_FSYNC_EVERYSEC:
+        return "everysec";
+    case AOF_FSYNC_ALWAYS:
+        return "always";
+    }
+    return "unknown";
+}
+
+static const char *const maxmemory_policy_names[] = {
+    [MAXMEMORY_NOEVICTION] = "noeviction",
+    [MAXMEMORY_ALLKEYS_LRU] = "allkeys-lru",
+    [MAXMEMORY_VOLATILE_LRU] = "volatile-lru",
+    [MAXMEMORY_ALLKEYS_LFU] = "allkeys-lfu",
+    [MAXMEMORY_VOLATILE_LFU] = "volatile-lfu",
+    [MAXMEMORY_ALLKEYS_RANDOM] = "allkeys-random",
+    [MAXMEMORY_VOLATILE_RANDOM] = "volatile-random",
+};
+
+const char *maxmemory_policy_name(enum maxmemory_policy policy) {
+    return (size_t) policy < sizeof(maxmemory_policy_names) / sizeof(maxmemory_policy_names[0])
+               ? maxmemory_policy_names[policy]
+               : "unknown";
+}
+
+static void config_defaults(struct server_config *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->engine = ENGINE_EPOLL;
+    cfg->mode = "transform";
+    cfg->workers = 1;
+    cfg->ports[0] = 9090;
+    cfg->nports = 1;
+    cfg->backlog = 128;
+    cfg->buf_small = 4096;
+    cfg->buf_large = 1 << 20;
+    cfg->batch = 64;
+    cfg->drain_timeout_ms = 25000;
+    cfg->aof_fsync = AOF_FSYNC_EVERYSEC;
+    cfg->aof_rewrite_percent = 100;
+    cfg->aof_rewrite_min_size = 64 << 20;
+    strcpy(cfg->snapshot_path, "dump.snap");
+    cfg->maxmemory_policy = MAXMEMORY_NOEVICTION;
+    cfg->maxmemory_samples = 5;
+    cfg->http_file_cache = 1024;
+    cfg->http_cache_ttl_ms = 1000;
+}
+
+static int parse_long(const char *key, const char *value, long min, long max, long *out) {
+    char *end;
+    errno = 0;
+    long v = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || v < min || v > max) {
+        fprintf(stderr, "invalid value for %s: '%s' (expected %ld..%ld)\n", key, value, min, max);
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+static int parse_int(const char *key, const char *value, int min, int max, int *out) {
+    long v;
+    if (parse_long(key, value, min, max, &v) < 0) {
+        return -1;
+    }
+    *out = (int) v;
+    return 0;
+}
+
+// Parses a byte size with an optional k/m/g suffix.
+static int parse_size(const char *key, const char *value, size_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(value, &end, 10);
+    if (errno != 0 || end == value || value[0] == '-') {
+        fprintf(stderr, "invalid size for %s: '%s'\n", key, value);
+        return -1;
+    }
+    int shift = 0;
+    switch (tolower((unsigned char) *end)) {
+    case 'g':
+        shift += 10;
+        /* fallthrough */
+    case 'm':
+        shift += 10;
+        /* fallthrough */
+    case 'k':
+        shift += 10;
+        end++;
+        break;
+    }
+    if (*end != '\0' || v == 0) {
+        fprintf(stderr, "invalid size for %s: '%s'\n", key, value);
+        return -1;
+    }
+    if (v > SIZE_MAX >> shift) {
+        fprintf(stderr, "size for %s too large: '%s'\n", key, value);
+        return -1;
+    }
+    *out = (size_t) v << shift;
+    return 0;
+}
+
+static int parse_bool(const char *key, const char *value, int *out) {
+    if (!strcasecmp(value, "yes") || !strcasecmp(value, "true") || !strcasecmp(value, "on") ||
+        !strcmp(value, "1")) {
+        *out = 1;
+    } else if (!strcasecmp(value, "no") || !strcasecmp(value, "false") ||
+               !strcasecmp(value, "off") || !strcmp(value, "0")) {
+        *out = 0;
+    } else {
+        fprintf(stderr, "invalid boolean for %s: '%s'\n", key, value);
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_ports(struct server_config *cfg, const char *key, const char *value) {
+    if (!strcmp(value, "none")) {
+        cfg->nports = 0;
+        return 0;
+    }
+    char *copy = xstrdup(value);
+    int n = 0;
+    int rc = 0;
+    for (char *save, *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (n == CONFIG_MAX_PORTS) {
+            fprintf(stderr, "too many ports for %s (max %d)\n", key, CONFIG_MAX_PORTS);
+            rc = -1;
+            break;
+        }
+        if (parse_int(key, tok, 1, 65535, &cfg->ports[n]) < 0) {
+            rc = -1;
+            break;
+        }
+        n++;
+    }
+    free(copy);
+    if (rc == 0 && n == 0) {
+        fprintf(stderr, "%s needs at least one port\n", key);
+        rc = -1;
+    }
+    if (rc == 0) {
+        cfg->nports = n;
+    }
+    return rc;
+}
+
+// Parses a CPU list such as "0-3,8,10-11".
+static int parse_cpus(struct server_config *cfg, const char *key, const char *value) {
+    char *copy = xstrdup(value);
+    int n = 0;
+    int rc = 0;
+    for (char *save, *tok = strtok_r(copy, ",", &save); tok && rc == 0;
+         tok = strtok_r(NULL, ",", &save)) {
+        int lo, hi;
+        char *dash = strchr(tok, '-');
+        if (dash) {
+            *dash = '\0';
+            rc = parse_int(key, tok, 0, CPU_SETSIZE - 1, &lo);
+            if (rc == 0) {
+                rc = parse_int(key, dash + 1, lo, CPU_SETSIZE - 1, &hi);
+            }
+        } else {
+            rc = parse_int(key, tok, 0, CPU_SETSIZE - 1, &lo);
+            hi = lo;
+        }
+        for (int cpu = lo; rc == 0 && cpu <= hi; cpu++) {
+            if (n == CONFIG_MAX_CPUS) {
+                fprintf(stderr, "too many CPUs for %s (max %d)\n", key, CONFIG_MAX_CPUS);
+                rc = -1;
+                break;
+            }
+            cfg->cpus[n++] = cpu;
+        }
+    }
+    free(copy);
+    if (rc == 0) {
+        cfg->ncpus = n;
+    }
+    return rc;
+}
+
+static int parse_buffer_sizes(struct server_config *cfg, const char *key, const char *value) {
+    char *copy = xstrdup(value);
+    char *comma = strchr(copy, ',');
+    size_t small, large;
+    int rc = -1;
+    if (comma == NULL) {
+        fprintf(stderr, "%s expects SMALL,LARGE\n", key);
+    } else {
+        *comma = '\0';
+        if (parse_size(key, copy, &small) == 0 && parse_size(key, comma + 1, &large) == 0) {
+            if (small > large) {
+                fprintf(stderr, "%s: small size must not exceed large size\n", key);
+            } else {
+                cfg->buf_small = small;
+                cfg->buf_large = large;
+                rc = 0;
+            }
+        }
+    }
+    free(copy);
+    return rc;
+}
+
+int config_set(struct server_config *cfg, const char *key, const char *value) {
+    if (!strcmp(key, "engine")) {
+        if (!strcmp(value, "sequential")) {
+            cfg->engine = ENGINE_SEQUENTIAL;
+        } else if (!strcmp(value, "threads")) {
+            cfg->engine = ENGINE_THREADS;
+        } else if (!strcmp(value, "epoll")) {
+            cfg->engine = ENGINE_EPOLL;
+        } else {
+            fprintf(stderr, "unknown engine '%s'\n", value);
+            return -1;
+        }
+        return 0;
+    }
+    if (!strcmp(key, "transport")) {
+        if (!strcmp(value, "tcp")) {
+            cfg->transport = TRANSPORT_TCP;
+        } else if (!strcmp(value, "udp")) {
+            cfg->transport = TRANSPORT_UDP;
+        } else {
+            fprintf(stderr, "unknown transport '%s'\n", value);
+            return -1;
+        }
+        return 0;
+    }
+    if (!strcmp(key, "mode")) {
+        cfg->mode = xstrdup(value);
+        return 0;
+    }
+    if (!strcmp(key, "workers")) {
+        return parse_int(key, value, 1, 1024, &cfg->workers);
+    }
+    if (!strcmp(key, "host")) {
+        if (strlen(value) >= sizeof(cfg->host)) {
+            fprintf(stderr, "host too long: '%s'\n", value);
+            return -1;
+        }
+        strcpy(cfg->host, value);
+        return 0;
+    }
+    if (!strcmp(key, "port")) {
+        return parse_ports(cfg, key, value);
+    }
+    if (!strcmp(key, "unix") || !strcmp(key, "unix-seqpacket")) {
+        if (cfg->nunix == CONFIG_MAX_UNIX) {
+            fprintf(stderr, "too many Unix sockets (max %d)\n", CONFIG_MAX_UNIX);
+            return -1;
+        }
+        struct unix_listener *ul = &cfg->unix_listeners[cfg->nunix];
+        if (value[0] == '\0' || strlen(value) >= sizeof(ul->path)) {
+            fprintf(stderr, "invalid Unix socket path '%s'\n", value);
+            return -1;
+        }
+        strcpy(ul->path, value);
+        ul->seqpacket = !strcmp(key, "unix-seqpacket");
+        cfg->nunix++;
+        return 0;
+    }
+    if (!strcmp(key, "shm")) {
+        if (strlen(value) >= sizeof(cfg->shm_path)) {
+            fprintf(stderr, "invalid shm rendezvous path '%s'\n", value);
+            return -1;
+        }
+        strcpy(cfg->shm_path, value);
+        return 0;
+    }
+    if (!strcmp(key, "upgrade-socket")) {
+        if (strlen(value) >= sizeof(cfg->upgrade_path)) {
+            fprintf(stderr, "invalid upgrade socket path '%s'\n", value);
+            return -1;
+        }
+        strcpy(cfg->upgrade_path, value);
+        return 0;
+    }
+    if (!strcmp(key, "backlog")) {
+        return parse_int(key, value, 1, INT_MAX, &cfg->backlog);
+    }
+    if (!strcmp(key, "reuseport")) {
+        return parse_bool(key, value, &cfg->reuseport);
+    }
+    if (!strcmp(key, "buffer-sizes")) {
+        return parse_buffer_sizes(cfg, key, value);
+    }
+    if (!strcmp(key, "idle-timeout")) {
+        return parse_int(key, value, 0, INT_MAX, &cfg->idle_timeout_ms);
+    }
+    if (!strcmp(key, "drain-timeout")) {
+        return parse_int(key, value, 0, INT_MAX, &cfg->drain_timeout_ms);
+    }
+    if (!strcmp(key, "cpus")) {
+        return parse_cpus(cfg, key, value);
+    }
+    if (!strcmp(key, "steer-cpu")) {
+        return parse_bool(key, value, &cfg->steer_cpu);
+    }
+    if (!strcmp(key, "batch")) {
+        return parse_int(key, value, 1, 4096, &cfg->batch);
+    }
+    if (!strcmp(key, "busy-poll")) {
+        return parse_int(key, value, 0, 1000000, &cfg->busy_poll_us);
+    }
+    if (!strcmp(key, "udp-offload")) {
+        return parse_bool(key, value, &cfg->udp_offload);
+    }
+    if (!strcmp(key, "appendonly")) {
+        if (strlen(value) >= sizeof(cfg->aof_path)) {
+            fprintf(stderr, "append-only file path too long: '%s'\n", value);
+            return -1;
+        }
+        strcpy(cfg->aof_path, value);
+        return 0;
+    }
+    if (!strcmp(key, "appendfsync")) {
+        if (!strcmp(value, "always")) {
+            cfg->aof_fsync = AOF_FSYNC_ALWAYS;
+        } else if (!strcmp(value, "everysec")) {
+            cfg->aof_fsync = AOF_FSYNC_EVERYSEC;
+        } else if (!strcmp(value, "no")) {
+            cfg->aof_fsync = AOF_FSYNC_NO;
+        } else {
+            fprintf(stderr, "unknown appendfsync policy '%s'\n", value);
+            return -1;
+        }
+        return 0;
+    }
+    if (!strcmp(key, "auto-aof-rewrite-percentage")) {
+        return parse_int(key, value, 0, INT_MAX, &cfg->aof_rewrite_percent);
+    }
+    if (!strcmp(key, "auto-aof-rewrite-min-size")) {
+        return parse_size(key, value, &cfg->aof_rewrite_min_size);
+    }
+    if (!strcmp(key, "dbfilename")) {
+        if (value[0] == '\0' || strlen(value) >= sizeof(cfg->snapshot_path)) {
+            fprintf(stderr, "invalid snapshot path '%s'\n", value);
+            return -1;
+        }
+        strcpy(cfg->snapshot_path, value);
+        return 0;
+    }
+    if (!strcmp(key, "maxmemory")) {
+        if (!strcmp(value, "0")) {
+            cfg->maxmemory = 0;
+            return 0;
+        }
+        return parse_size(key, value, &cfg->maxmemory);
+    }
+    if (!strcmp(key, "maxmemory-policy")) {
+        for (size_t i = 0; i < sizeof(maxmemory_policy_names) / sizeof(maxmemory_policy_names[0]);
+             i++) {
+            if (!strcmp(value, maxmemory_policy_names[i])) {
+                cfg->maxmemory_policy = i;
+                return 0;
+            }
+        }
+        fprintf(stderr, "unknown maxmemory policy '%s'\n", value);
+        return -1;
+    }
+    if (!strcmp(key, "maxmemory-samples")) {
+        return parse_int(key, value, 1, 64, &cfg->maxmemory_samples);
+    }
+    if (!strcmp(key, "http-root")) {
+        if (strlen(value) >= sizeof(cfg->http_root)) {
+            fprintf(stderr, "http root path too long: '%s'\n", value);
+            return -1;
+        }
+        strcpy(cfg->http_root, value);
+        return 0;
+    }
+    if (!strcmp(key, "http-file-cache")) {
+        return parse_int(key, value, 0, 1 << 20, &cfg->http_file_cache);
+    }
+    if (!strcmp(key, "http-cache-size")) {
+        if (!strcmp(value, "0")) {
+            cfg->http_cache_size = 0;
+            return 0;
+        }
+        return parse_size(key, value, &cfg->http_cache_size);
+    }
+    if (!strcmp(key, "http-cache-ttl")) {
+        return parse_int(key, value, 1, INT_MAX, &cfg->http_cache_ttl_ms);
+    }
+    fprintf(stderr, "unknown setting '%s'\n", key);
+    return -1;
+}
+
+static char *trim(char *s) {
+    while (isspace((unsigned char) *s)) {
+        s++;
+    }
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char) end[-1])) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+int config_load_file(struct server_config *cfg, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    char line[1024];
+    int lineno = 0;
+    int rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) {
+            *hash = '\0';
+        }
+        char *key = trim(line);
+        if (*key == '\0') {
+            continue;
+        }
+
+        // Accept both `key = value` and `key value`; a bare key is a flag.
+        char *value = key + strcspn(key, "= \t");
+        if (*value != '\0') {
+            *value++ = '\0';
+            value = trim(value);
+            if (*value == '=') {
+                value = trim(value + 1);
+            }
+        }
+        if (*value == '\0') {
+            value = "yes";
+        }
+        if (config_set(cfg, key, value) < 0) {
+            fprintf(stderr, "%s:%d: invalid setting\n", path, lineno);
+            rc = -1;
+        }
+    }
+    fclose(f);
+    return rc;
+}
+
+void config_print(const struct server_config *cfg, FILE *out) {
+    fprintf(out, "engine = %s\n", engine_name(cfg->engine));
+    fprintf(out, "transport = %s\n", transport_name(cfg->transport));
+    fprintf(out, "mode = %s\n", cfg->mode);
+    fprintf(out, "workers = %d\n", cfg->workers);
+    if (cfg->host[0]) {
+        fprintf(out, "host = %s\n", cfg->host);
+    }
+    fprintf(out, "port = ");
+    for (int i = 0; i < cfg->nports; i++) {
+        fprintf(out, "%s%d", i ? "," : "", cfg->ports[i]);
+    }
+    fprintf(out, "%s\n", cfg->nports ? "" : "none");
+    for (int i = 0; i < cfg->nunix; i++) {
+        fprintf(out, "%s = %s\n", cfg->unix_listeners[i].seqpacket ? "unix-seqpacket" : "unix",
+                cfg->unix_listeners[i].path);
+    }
+    if (cfg->shm_path[0]) {
+        fprintf(out, "shm = %s\n", cfg->shm_path);
+    }
+    if (cfg->upgrade_path[0]) {
+        fprintf(out, "upgrade-socket = %s\n", cfg->upgrade_path);
+    }
+    fprintf(out, "backlog = %d\n", cfg->backlog);
+    fprintf(out, "reuseport = %s\n", cfg->reuseport ? "yes" : "no");
+    fprintf(out, "buffer-sizes = %zu,%zu\n", cfg->buf_small, cfg->buf_large);
+    fprintf(out, "idle-timeout = %d\n", cfg->idle_timeout_ms);
+    fprintf(out, "drain-timeout = %d\n", cfg->drain_timeout_ms);
+    if (cfg->ncpus) {
+        fprintf(out, "cpus = ");
+        for (int i = 0; i < cfg->ncpus; i++) {
+            fprintf(out, "%s%d", i ? "," : "", cfg->cpus[i]);
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "steer-cpu = %s\n", cfg->steer_cpu ? "yes" : "no");
+    fprintf(out, "batch = %d\n", cfg->batch);
+    fprintf(out, "busy-poll = %d\n", cfg->busy_poll_us);
+    fprintf(out, "udp-offload = %s\n", cfg->udp_offload ? "yes" : "no");
+    if (cfg->aof_path[0]) {
+        fprintf(out, "appendonly = %s\n", cfg->aof_path);
+    }
+    fprintf(out, "appendfsync = %s\n", aof_fsync_name(cfg->aof_fsync));
+    fprintf(out, "auto-aof-rewrite-percentage = %d\n", cfg->aof_rewrite_percent);
+    fprintf(out, "auto-aof-rewrite-min-size = %zu\n", cfg->aof_rewrite_min_size);
+    fprintf(out, "dbfilename = %s\n", cfg->snapshot_path);
+    fprintf(out, "maxmemory = %zu\n", cfg->maxmemory);
+    fprintf(out, "maxmemory-policy = %s\n", maxmemory_policy_name(cfg->maxmemory_policy));
+    fprintf(out, "maxmemory-samples = %d\n", cfg->maxmemory_samples);
+    if (cfg->http_root[0]) {
+        fprintf(out, "http-root = %s\n", cfg->http_root);
+    }
+    fprintf(out, "http-file-cache = %d\n", cfg->http_file_cache);
+    fprintf(out, "http-cache-size = %zu\n", cfg->http_cache_size);
+    fprintf(out, "http-cache-ttl = %d\n", cfg->http_cache_ttl_ms);
+}
+
+void config_parse(struct server_config *cfg, int argc, char **argv) {
+    config_defaults(cfg);
+
+    // First pass: only look for the config file so that it is applied before
+    // any other command-line option regardless of argument order.
+    int opt;
+    opterr = 0;
+    while ((opt = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+        if (opt == 'c' && config_load_file(cfg, optarg) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int print_only = 0;
+    int unix_given = 0;
+    opterr = 1;
+    optind = 1;
+    while ((opt = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+        const char *key = NULL;
+        const char *value = optarg;
+        switch (opt) {
+        case 'c':
+            continue;
+        case 'h':
+            usage(stdout, argv[0]);
+            exit(EXIT_SUCCESS);
+        case OPT_PRINT_CONFIG:
+            print_only = 1;
+            continue;
+        case '?':
+            usage(stderr, argv[0]);
+            exit(EXIT_FAILURE);
+        case OPT_UNIX:
+        case OPT_UNIX_SEQPACKET:
+            // Repeatable options add up, but the command line's list replaces the file's.
+            if (!unix_given) {
+                cfg->nunix = 0;
+                unix_given = 1;
+            }
+            break;
+        }
+        for (const struct option *o = long_options; o->name; o++) {
+            if (o->val == opt) {
+                key = o->name;
+                break;
+            }
+        }
+        if (value == NULL) {
+            value = "yes";
+        }
+        if (key == NULL || config_set(cfg, key, value) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc) {
+        fprintf(stderr, "unexpected argument '%s'\n", argv[optind]);
+        usage(stderr, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (cfg->nports == 0 && cfg->nunix == 0 && cfg->shm_path[0] == '\0') {
+        fprintf(stderr, "nothing to listen on: give a port or a Unix socket path\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (print_only) {
+        config_print(cfg, stdout);
+        exit(EXIT_SUCCESS);
+    }
+}
@@ -0,0 +1,106 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define CONFIG_MAX_PORTS 16
+#define CONFIG_MAX_UNIX 4
+#define CONFIG_MAX_LISTENERS (CONFIG_MAX_PORTS + CONFIG_MAX_UNIX)
+#define CONFIG_MAX_CPUS 256
+
+enum engine_kind {
+    ENGINE_SEQUENTIAL,
+    ENGINE_THREADS,
+    ENGINE_EPOLL,
+};
+
+enum transport_kind {
+    TRANSPORT_TCP,
+    TRANSPORT_UDP,
+};
+
+enum aof_fsync {
+    AOF_FSYNC_NO,
+    AOF_FSYNC_EVERYSEC,
+    AOF_FSYNC_ALWAYS,
+};
+
+enum maxmemory_policy {
+    MAXMEMORY_NOEVICTION,
+    MAXMEMORY_ALLKEYS_LRU,
+    MAXMEMORY_VOLATILE_LRU,
+    MAXMEMORY_ALLKEYS_LFU,
+    MAXMEMORY_VOLATILE_LFU,
+    MAXMEMORY_ALLKEYS_RANDOM,
+    MAXMEMORY_VOLATILE_RANDOM,
+};
+
+struct unix_listener {
+    char path[108];             // sizeof(sun_path)
+    int seqpacket;              // SOCK_SEQPACKET instead of SOCK_STREAM
+};
+
+struct server_config {
+    enum engine_kind engine;
+    enum transport_kind transport;
+    const char *mode;           // protocol name, see protocol_lookup()
+    int workers;                // reactor threads for the epoll engine
+
+    char host[256];             // listen address, empty means any
+    int ports[CONFIG_MAX_PORTS];
+    int nports;                 // may be 0 when only Unix sockets are served
+    struct unix_listener unix_listeners[CONFIG_MAX_UNIX];
+    int nunix;
+    char shm_path[108];         // shared-memory rendezvous socket, see shm.h
+    int backlog;
+    int reuseport;              // one listener per worker via SO_REUSEPORT
+    char upgrade_path[108];     // hot-upgrade control socket, see upgrade.h
+
+    size_t buf_small;           // initial per-connection buffer size
+    size_t buf_large;           // buffered-input limit before a client is dropped
+
+    int idle_timeout_ms;        // 0 disables idle connection reaping
+    int drain_timeout_ms;       // longest wait for clients after SIGTERM or an upgrade
+
+    int cpus[CONFIG_MAX_CPUS];  // worker i is pinned to cpus[i % ncpus]
+    int ncpus;
+    int steer_cpu;              // reuseport groups pick the worker by receiving CPU
+
+    int batch;                  // events per epoll_wait / accepts per wakeup
+    int busy_poll_us;           // spin before blocking in epoll_wait, 0 = never
+    int udp_offload;            // UDP_GRO on receive, UDP_SEGMENT on send
+
+    char aof_path[256];         // kv append-only file, empty disables it
+    enum aof_fsync aof_fsync;
+    int aof_rewrite_percent;    // auto rewrite after this much growth, 0 = off
+    size_t aof_rewrite_min_size;
+    char snapshot_path[256];    // kv SAVE/BGSAVE target, loaded without an AOF
+    size_t maxmemory;           // kv data size limit, 0 = none
+    enum maxmemory_policy maxmemory_policy;
+    int maxmemory_samples;      // keys compared per eviction
+    char http_root[256];        // http static files, empty disables them
+    int http_file_cache;        // open files kept by the http mode, 0 = none
+    size_t http_cache_size;     // http response cache limit, 0 disables it
+    int http_cache_ttl_ms;
+};
+
+// Fills `cfg` with defaults, then applies a config file given with -c/--config
+// (if any) and finally the remaining command-line options, so that the command
+// line always wins. Exits with a usage message on invalid input.
+void config_parse(struct server_config *cfg, int argc, char **argv);
+
+// Applies a single `key = value` setting using the long option names. Returns
+// 0 on success and -1 (with a message on stderr) on failure.
+int config_set(struct server_config *cfg, const char *key, const char *value);
+
+int config_load_file(struct server_config *cfg, const char *path);
+
+void config_print(const struct server_config *cfg, FILE *out);
+
+const char *engine_name(enum engine_kind engine);
+const char *transport_name(enum transport_kind transport);
+const char *aof_fsync_name(enum aof_fsync policy);
+const char *maxmemory_policy_name(enum maxmemory_policy policy);
+
+#endif
@@ -0,0 +1,272 @@
+// Helpers shared by the engines.
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "net.h"
+#include "stats.h"
+#include "upgrade.h"
+#include "utils.h"
+
+// How often a blocked client thread wakes up to look for a drain, and then
+// for the drain deadline.
+#define BLOCKING_TICK_MS 1000
+#define BLOCKING_DRAIN_TICK_MS 100
+
+static pthread_once_t drain_once = PTHREAD_ONCE_INIT;
+static int drain_fd = -1;
+static atomic_ullong drain_start_ms;   // 0 until draining
+static atomic_ullong last_report_ms;
+
+static void set_timeouts(int fd, int ms) {
+    struct timeval tv = {.tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static void drain_fd_init(void) {
+    drain_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (drain_fd < 0) {
+        perror_die("eventfd");
+    }
+}
+
+int engine_drain_fd(void) {
+    pthread_once(&drain_once, drain_fd_init);
+    return drain_fd;
+}
+
+void engine_drain(void) {
+    unsigned long long zero = 0;
+    atomic_compare_exchange_strong(&drain_start_ms, &zero, now_ms());
+    uint64_t one = 1;
+    if (write(engine_drain_fd(), &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("write drain");
+    }
+}
+
+int engine_draining(void) {
+    return atomic_load(&drain_start_ms) != 0;
+}
+
+uint64_t engine_drain_deadline(const struct server_config *cfg) {
+    return atomic_load(&drain_start_ms) + cfg->drain_timeout_ms;
+}
+
+void engine_drain_report(const struct server_config *cfg, int done) {
+    uint64_t now = now_ms();
+    uint64_t start = atomic_load(&drain_start_ms);
+    if (done) {
+        printf("Drained in %.1f s: %lld idle connections half-closed, %lld closed at the "
+               "deadline\n", (now - start) / 1000.0, stats_get(STAT_DRAIN_HALF_CLOSED),
+               stats_get(STAT_DRAIN_FORCED));
+        return;
+    }
+    unsigned long long last = atomic_load(&last_report_ms);
+    if (now - last < 1000 || !atomic_compare_exchange_strong(&last_report_ms, &last, now)) {
+        return;
+    }
+    uint64_t deadline = engine_drain_deadline(cfg);
+    printf("Draining: %lld connections open, %lld half-closed, %.1f s to the deadline\n",
+           stats_get(STAT_CONNS_OPEN), stats_get(STAT_DRAIN_HALF_CLOSED),
+           now < deadline ? (deadline - now) / 1000.0 : 0.0);
+}
+
+int engine_worker_node(const struct server_config *cfg, int id) {
+    return cfg->ncpus > 0 ? net_cpu_node(cfg->cpus[id % cfg->ncpus]) : -1;
+}
+
+void engine_listening(const struct server_config *cfg) {
+    // The previous server still holds them and carries on once we are gone.
+    if (net_unclaimed_inherited() > 0) {
+        die("upgrade: refusing to take over, since closing those sockets would drop the "
+            "connections queued in them; start with the previous server's listeners");
+    }
+    if (cfg->upgrade_path[0]) {
+        upgrade_serve(cfg->upgrade_path);
+    }
+}
+
+// Spin hits are added to the stats in batches of this many.
+#define POLL_SPUN_FLUSH 1024
+
+void engine_poller_init(struct engine_poller *p, int epfd, const struct server_config *cfg) {
+    p->epfd = epfd;
+    p->busy_poll_us = cfg->busy_poll_us;
+    p->spun = 0;
+}
+
+int engine_epoll_wait(struct engine_poller *p, struct epoll_event *events, int max,
+                      int timeout) {
+    if (p->busy_poll_us > 0 && timeout != 0) {
+        uint64_t until = now_ns() + p->busy_poll_us * 1000ull;
+        int spinning = 0;
+        do {
+            int n = epoll_wait(p->epfd, events, max, 0);
+            if (n != 0) {
+                // Events already pending on the first poll owe nothing to the spin.
+                if (n > 0 && spinning && ++p->spun == POLL_SPUN_FLUSH) {
+                    stats_add(STAT_POLL_SPUN, p->spun);
+                    p->spun = 0;
+                }
+                return n;
+            }
+            spinning = 1;
+        } while (now_ns() < until);
+        stats_add(STAT_POLL_SPUN, p->spun);
+        stats_add(STAT_POLL_BLOCKED, 1);
+        p->spun = 0;
+    }
+    return epoll_wait(p->epfd, events, max, timeout);
+}
+
+void engine_busy_poll_socket(const struct server_config *cfg, int fd) {
+    static atomic_int warned;
+    int us = cfg->busy_poll_us;
+    if (us > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) < 0 &&
+        !atomic_exchange(&warned, 1)) {
+        perror("setsockopt SO_BUSY_POLL (spinning in the event loop only)");
+    }
+}
+
+int engine_open_tcp_listeners(const struct server_config *cfg, int *fds, int nonblock) {
+    for (int i = 0; i < cfg->nports; i++) {
+        fds[i] = net_listen_tcp(cfg->host, cfg->ports[i], cfg->backlog, cfg->reuseport, nonblock);
+        engine_busy_poll_socket(cfg, fds[i]);
+    }
+    return cfg->nports;
+}
+
+int engine_open_unix_listeners(const struct server_config *cfg, int *fds, int nonblock) {
+    for (int i = 0; i < cfg->nunix; i++) {
+        const struct unix_listener *ul = &cfg->unix_listeners[i];
+        fds[i] = net_listen_unix(ul->path, ul->seqpacket ? SOCK_SEQPACKET : SOCK_STREAM,
+                                 cfg->backlog, nonblock);
+    }
+    return cfg->nunix;
+}
+
+int engine_open_listeners(const struct server_config *cfg, int *fds, int nonblock) {
+    int n = engine_open_tcp_listeners(cfg, fds, nonblock);
+    return n + engine_open_unix_listeners(cfg, fds + n, nonblock);
+}
+
+int engine_flush(int fd, struct session *s) {
+    while (session_out_len(s) > 0) {
+        ssize_t n;
+        int file_fd;
+        uint64_t off;
+        size_t len;
+        if (session_out_next_file(s, &file_fd, &off, &len)) {
+            off_t pos = off;
+            n = sendfile(fd, file_fd, &pos, len);
+            if (n == 0) {
+                return -1;      // the file shrank under us
+            }
+        } else {
+            struct iovec iov[SESSION_IOV_MAX];
+            struct msghdr msg = {.msg_iov = iov};
+            msg.msg_iovlen = session_out_iov(s, iov, SESSION_IOV_MAX);
+            size_t total = 0;
+            for (size_t i = 0; i < msg.msg_iovlen; i++) {
+                total += iov[i].iov_len;
+            }
+            // More is queued, e.g. headers ahead of a file: let them share packets.
+            int more = total < session_out_len(s) ? MSG_MORE : 0;
+            n = sendmsg(fd, &msg, MSG_NOSIGNAL | more);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        session_out_consume(s, n);
+    }
+    return 0;
+}
+
+// Blocking calls time out every tick, so that a thread waiting on a quiet
+// client notices a drain and the idle and drain deadlines.
+void engine_serve_blocking(int fd, const struct server_config *cfg, const struct protocol *proto) {
+    int tick = BLOCKING_TICK_MS;
+    if (cfg->idle_timeout_ms > 0 && cfg->idle_timeout_ms < tick) {
+        tick = cfg->idle_timeout_ms;
+    }
+    set_timeouts(fd, tick);
+    stats_add(STAT_CONNS_ACCEPTED, 1);
+    stats_add(STAT_CONNS_OPEN, 1);
+
+    struct session s;
+    session_init(&s, proto, cfg);
+    int half_closed = 0;
+    uint64_t last_active_ms = now_ms();
+    for (;;) {
+        if (engine_flush(fd, &s) < 0) {
+            break;
+        }
+        if (s.draining && now_ms() >= engine_drain_deadline(cfg)) {
+            stats_add(STAT_DRAIN_FORCED, 1);
+            break;
+        }
+        if (session_out_len(&s) > 0) {
+            continue;           // the send timed out
+        }
+        if (s.closing) {
+            break;
+        }
+        if (!s.draining && engine_draining()) {
+            s.draining = 1;
+            set_timeouts(fd, BLOCKING_DRAIN_TICK_MS);
+        }
+        if (s.draining) {
+            engine_drain_report(cfg, 0);
+        }
+        if (s.draining && !half_closed && session_idle(&s)) {
+            // Tell the client we are done, but read on until it closes so
+            // that a request already on its way gets no reset.
+            shutdown(fd, SHUT_WR);
+            half_closed = 1;
+            stats_add(STAT_DRAIN_HALF_CLOSED, 1);
+        }
+
+        size_t avail;
+        char *p = session_read_ptr(&s, &avail);
+        ssize_t n = recv(fd, p, avail, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (cfg->idle_timeout_ms > 0 &&
+                now_ms() - last_active_ms >= (uint64_t) cfg->idle_timeout_ms) {
+                break;
+            }
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        last_active_ms = now_ms();
+        if (half_closed) {
+            continue;           // discarded: nobody would see the reply
+        }
+        if (session_process(&s, n) < 0) {
+            fprintf(stderr, "fd %d: input buffer limit exceeded, dropping\n", fd);
+            break;
+        }
+    }
+    session_destroy(&s);
+    close(fd);
+    stats_add(STAT_CONNS_OPEN, -1);
+}
@@ -0,0 +1,107 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <sys/epoll.h>
+
+#include "config.h"
+#include "protocol.h"
+
+// Each engine runs until a fatal error or until it has drained; they return 0
+// after draining and -1 on failure.
+int engine_sequential_run(const struct server_config *cfg, const struct protocol *proto);
+int engine_threads_run(const struct server_config *cfg, const struct protocol *proto);
+int engine_epoll_run(const struct server_config *cfg, const struct protocol *proto);
+int engine_udp_run(const struct server_config *cfg, const struct protocol *proto);
+
+// Draining: the engine stops accepting, lets requests in progress finish and
+// half-closes idle connections, then returns once every client has gone or
+// cfg->drain_timeout_ms has passed, closing what is left. It starts on SIGTERM
+// or after the listeners were handed to a new process (see upgrade.h).
+// engine_drain() is callable from any thread or a signal handler, more than
+// once; so is engine_draining().
+void engine_drain(void);
+int engine_draining(void);
+
+// An eventfd that becomes readable, and stays so, once draining starts.
+int engine_drain_fd(void);
+
+// When the connections left are closed; only meaningful while draining.
+uint64_t engine_drain_deadline(const struct server_config *cfg);
+
+// Prints the drain's progress from the stats (see stats.h), at most once a
+// second whoever calls it; with `done`, prints the summary instead.
+void engine_drain_report(const struct server_config *cfg, int done);
+
+// The NUMA node of the CPU worker `id` is pinned to by --cpus, or -1.
+int engine_worker_node(const struct server_config *cfg, int id);
+
+// Busy polling (--busy-poll): before blocking, an event loop spins on
+// epoll_wait() with a zero timeout for up to busy_poll_us, so that an event
+// arriving soon after the last one costs no sleep and wakeup. Waits whose
+// events arrived after an empty poll, while spinning, and those that went on
+// to block are counted in the stats; the former locally first, to keep the
+// spin off shared lines.
+struct engine_poller {
+    int epfd;
+    int busy_poll_us;
+    long long spun;             // not yet added to STAT_POLL_SPUN
+};
+
+void engine_poller_init(struct engine_poller *p, int epfd, const struct server_config *cfg);
+
+// epoll_wait() on p->epfd, spinning first unless `timeout` is 0.
+int engine_epoll_wait(struct engine_poller *p, struct epoll_event *events, int max,
+                      int timeout);
+
+// Sets SO_BUSY_POLL on a listening or bound socket when --busy-poll is given,
+// so the kernel polls the device queue in place of waiting for an interrupt;
+// accepted sockets inherit it. Without CAP_NET_ADMIN the kernel refuses
+// values above net.core.busy_read, which is reported once and otherwise
+// ignored.
+void engine_busy_poll_socket(const struct server_config *cfg, int fd);
+
+// Called by every engine once its listeners are open, right before it starts
+// serving: refuses an upgrade that leaves inherited sockets unclaimed, and
+// runs the upgrade socket.
+void engine_listening(const struct server_config *cfg);
+
+// Serves one connected client over blocking I/O until it disconnects.
+// Shared by the sequential and thread-per-client engines.
+void engine_serve_blocking(int fd, const struct server_config *cfg, const struct protocol *proto);
+
+// Writes pending session output with as few sendmsg() calls as possible.
+// Returns 0 once everything is sent or the socket would block, -1 on error.
+int engine_flush(int fd, struct session *s);
+
+// Cross-reactor messaging. Every epoll worker is a reactor with a lock-free
+// inbox; a message posted to a reactor has its handler run on that reactor's
+// thread, in the order each poster sent them. The engine owns `next`.
+struct reactor_msg {
+    struct reactor_msg *next;
+    void (*handler)(struct reactor_msg *msg);
+};
+
+// Index of the calling reactor (0 .. workers-1), or -1 off the reactors.
+extern __thread int reactor_self;
+
+// Queues `msg` for reactor `target`, waking it if its inbox was empty.
+// Callable from any thread once the epoll engine is running.
+void reactor_post(int target, struct reactor_msg *msg);
+
+// Parks every other reactor between events until reactor_resume_others(),
+// giving the caller a consistent view of all reactors' state (e.g. to fork).
+// Returns -1 if another reactor is already doing so. Call from a reactor.
+int reactor_pause_others(void);
+void reactor_resume_others(void);
+
+// Opens one TCP listener per configured port into `fds`; returns the count.
+int engine_open_tcp_listeners(const struct server_config *cfg, int *fds, int nonblock);
+
+// Opens the configured Unix stream/seqpacket listeners into `fds`. These
+// cannot use SO_REUSEPORT and are always shared between workers.
+int engine_open_unix_listeners(const struct server_config *cfg, int *fds, int nonblock);
+
+// Opens every TCP and Unix listener; `fds` needs CONFIG_MAX_LISTENERS slots.
+int engine_open_listeners(const struct server_config *cfg, int *fds, int nonblock);
+
+#endif
@@ -0,0 +1,908 @@
+// Event-driven engine: each worker thread runs its own epoll reactor over
+// non-blocking sockets; part 3 of the concurrent servers series, extended to
+// several reactors. Workers either share the listening sockets (woken with
+// EPOLLEXCLUSIVE) or, with --reuseport, own a SO_REUSEPORT listener each.
+// The same reactors also serve shared-memory clients (see shm.h), and each
+// has an inbox through which protocols pass work between them. Once draining
+// starts, every worker stops watching the listeners and half-closes each
+// connection as soon as it is idle; all of them return when none has clients
+// left, closing any that remain at the drain deadline.
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "net.h"
+#include "shm.h"
+#include "stats.h"
+#include "utils.h"
+
+enum item_kind {
+    ITEM_LISTENER,
+    ITEM_CONN,
+    ITEM_SHM_LISTENER,
+    ITEM_SHM_CONTROL,
+    ITEM_SHM_DOORBELL,
+    ITEM_INBOX,
+    ITEM_DRAIN,
+    ITEM_CLOSED,                // freed once the current batch of events is done
+};
+
+// Every registered fd is an item; epoll_event.data.ptr points at it.
+struct item {
+    enum item_kind kind;
+    int fd;
+};
+
+struct conn {
+    struct item item;
+    struct session session;
+    uint32_t events;            // currently registered epoll events
+    uint64_t last_active_ms;
+    struct conn *prev, *next;   // worker's list, most recently active first
+    int half_closed;            // draining: we sent FIN and discard input
+};
+
+// A shared-memory client. The rendezvous connection carries the handshake and
+// afterwards only signals hangup; all data moves through the rings.
+struct shm_conn {
+    struct item control;
+    struct item doorbell;       // our eventfd, rung by the client
+    int peer_doorbell;
+    int ready;                  // handshake done, rings mapped
+    void *base;
+    size_t maplen;
+    struct shm_ring rx;         // client -> server
+    struct shm_ring tx;         // server -> client
+    struct session session;
+    struct shm_conn *prev, *next;
+    int half_closed;
+    struct shm_conn *woken_next;    // see worker.shm_woken
+    int woken;
+};
+
+struct worker {
+    int id;
+    int cpu;                    // pinned to, or -1
+    int epfd;
+    pthread_t thread;
+    const struct server_config *cfg;
+    const struct protocol *proto;
+    struct item listeners[CONFIG_MAX_LISTENERS + 1];
+    int nlisteners;
+    struct conn *head, *tail;
+    struct shm_conn *shm_head;
+    // Shared-memory clients woken by a protocol. Servicing one runs its
+    // on_data, which must not happen inside another session's, so they are
+    // serviced once the current batch of events has been handled.
+    struct shm_conn *shm_woken;
+    int nconns;                 // socket and shared-memory clients
+    struct item drain;          // see engine_drain_fd()
+    int draining;
+    int drained;                // no clients left, counted off drain_busy
+    uint64_t drain_deadline_ms;
+    uint64_t last_sweep_ms;
+    uint64_t last_idle_ms;
+    // Posted messages, newest first; an eventfd signals the empty -> non-empty
+    // transition so posting to a busy reactor costs no syscall.
+    struct item inbox;
+    _Atomic(struct reactor_msg *) inbox_head;
+    struct reactor_msg park_msg;
+    // Connections closed since the last epoll_wait. A wakeup from another
+    // connection or the inbox can close one whose event is still further down
+    // the batch, so their memory is kept until the batch has been handled.
+    void **closed;
+    int nclosed;
+    int closed_cap;
+};
+
+__thread int reactor_self = -1;
+static __thread struct worker *self;
+static struct worker **reactors;
+static int nreactors;
+
+// How long a draining worker waits before checking whether the others are done.
+#define DRAIN_POLL_MS 100
+
+// Workers that still have clients, and those still watching the listeners;
+// both set when the engine starts.
+static atomic_int drain_busy;
+static atomic_int drain_listening;
+
+static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pause_cond = PTHREAD_COND_INITIALIZER;
+static int pausing;
+static int parked;
+
+void reactor_post(int target, struct reactor_msg *msg) {
+    struct worker *w = reactors[target];
+    struct reactor_msg *head = atomic_load_explicit(&w->inbox_head, memory_order_relaxed);
+    do {
+        msg->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&w->inbox_head, &head, msg,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(w->inbox.fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("write inbox");
+        }
+    }
+}
+
+// Takes the whole inbox at once and runs it oldest first. The eventfd is
+// reset before the swap, so a post racing with us rings it again.
+static void inbox_drain(struct worker *w) {
+    uint64_t count;
+    if (read(w->inbox.fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read inbox");
+    }
+    struct reactor_msg *m = atomic_exchange_explicit(&w->inbox_head, NULL, memory_order_acquire);
+    struct reactor_msg *fifo = NULL;
+    while (m) {
+        struct reactor_msg *next = m->next;
+        m->next = fifo;
+        fifo = m;
+        m = next;
+    }
+    while (fifo) {
+        struct reactor_msg *next = fifo->next;
+        fifo->handler(fifo);
+        fifo = next;
+    }
+}
+
+static void park(struct reactor_msg *msg) {
+    (void) msg;
+    pthread_mutex_lock(&pause_lock);
+    parked++;
+    pthread_cond_broadcast(&pause_cond);
+    while (pausing) {
+        pthread_cond_wait(&pause_cond, &pause_lock);
+    }
+    parked--;
+    pthread_cond_broadcast(&pause_cond);
+    pthread_mutex_unlock(&pause_lock);
+}
+
+int reactor_pause_others(void) {
+    pthread_mutex_lock(&pause_lock);
+    if (pausing) {
+        pthread_mutex_unlock(&pause_lock);
+        return -1;
+    }
+    pausing = 1;
+    pthread_mutex_unlock(&pause_lock);
+    for (int i = 0; i < nreactors; i++) {
+        if (i != reactor_self) {
+            reactor_post(i, &reactors[i]->park_msg);
+        }
+    }
+    pthread_mutex_lock(&pause_lock);
+    while (parked < nreactors - 1) {
+        pthread_cond_wait(&pause_cond, &pause_lock);
+    }
+    pthread_mutex_unlock(&pause_lock);
+    return 0;
+}
+
+// Waits for everyone to leave park() so the messages can be posted again.
+void reactor_resume_others(void) {
+    pthread_mutex_lock(&pause_lock);
+    pausing = 0;
+    pthread_cond_broadcast(&pause_cond);
+    while (parked > 0) {
+        pthread_cond_wait(&pause_cond, &pause_lock);
+    }
+    pthread_mutex_unlock(&pause_lock);
+}
+
+static void conn_unlink(struct worker *w, struct conn *c) {
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        w->head = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    } else {
+        w->tail = c->prev;
+    }
+    c->prev = c->next = NULL;
+}
+
+static void conn_push_front(struct worker *w, struct conn *c) {
+    c->prev = NULL;
+    c->next = w->head;
+    if (w->head) {
+        w->head->prev = c;
+    } else {
+        w->tail = c;
+    }
+    w->head = c;
+}
+
+static void conn_touch(struct worker *w, struct conn *c) {
+    c->last_active_ms = now_ms();
+    if (w->head != c) {
+        conn_unlink(w, c);
+        conn_push_front(w, c);
+    }
+}
+
+static void free_later(struct worker *w, void *p) {
+    if (w->nclosed == w->closed_cap) {
+        w->closed_cap = w->closed_cap ? w->closed_cap * 2 : 16;
+        w->closed = xrealloc(w->closed, w->closed_cap * sizeof(*w->closed));
+    }
+    w->closed[w->nclosed++] = p;
+}
+
+static void conn_close(struct worker *w, struct conn *c) {
+    conn_unlink(w, c);
+    session_destroy(&c->session);
+    close(c->item.fd);
+    c->item.kind = ITEM_CLOSED;
+    w->nconns--;
+    stats_add(STAT_CONNS_OPEN, -1);
+    free_later(w, c);
+}
+
+static int conn_set_events(struct worker *w, struct conn *c, uint32_t events) {
+    if (c->events == events) {
+        return 0;
+    }
+    struct epoll_event ev = {.events = events, .data.ptr = &c->item};
+    if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->item.fd, &ev) < 0) {
+        return -1;
+    }
+    c->events = events;
+    return 0;
+}
+
+// Sends FIN but keeps reading, so that a request the client sent before it
+// saw the FIN is discarded rather than answered with a reset.
+static void conn_half_close(struct conn *c) {
+    shutdown(c->item.fd, SHUT_WR);
+    c->half_closed = 1;
+    stats_add(STAT_DRAIN_HALF_CLOSED, 1);
+}
+
+// Flushes output and re-arms the connection; closes it when it is done.
+static void conn_update(struct worker *w, struct conn *c) {
+    if (engine_flush(c->item.fd, &c->session) < 0) {
+        conn_close(w, c);
+        return;
+    }
+    if (session_done(&c->session)) {
+        conn_close(w, c);
+        return;
+    }
+    // Stop reading while output is backed up so a client that never reads
+    // cannot make us buffer without bound. A closing session that still
+    // awaits replies from other reactors listens for nothing until woken.
+    uint32_t events = EPOLLIN;
+    if (session_out_len(&c->session) > 0) {
+        events = EPOLLOUT;
+    } else if (c->session.closing) {
+        events = 0;
+    } else if (c->session.draining && !c->half_closed && session_idle(&c->session)) {
+        conn_half_close(c);
+    }
+    if (conn_set_events(w, c, events) < 0) {
+        perror("epoll_ctl");
+        conn_close(w, c);
+    }
+}
+
+// Reads everything the socket has before flushing, so a pipelined batch of
+// requests costs one pass of reads and a single gathered write.
+static void conn_on_readable(struct worker *w, struct conn *c) {
+    while (c->half_closed) {
+        size_t avail;
+        char *p = session_read_ptr(&c->session, &avail);
+        ssize_t n = recv(c->item.fd, p, avail, 0);
+        if (n > 0 || (n < 0 && errno == EINTR)) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        conn_close(w, c);
+        return;
+    }
+    for (;;) {
+        size_t avail;
+        char *p = session_read_ptr(&c->session, &avail);
+        ssize_t n = recv(c->item.fd, p, avail, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            conn_close(w, c);
+            return;
+        }
+        if (n == 0) {
+            // Peer closed; deliver what is still buffered and go away.
+            c->session.closing = 1;
+            break;
+        }
+        if (session_process(&c->session, n) < 0) {
+            fprintf(stderr, "fd %d: input buffer limit exceeded, dropping\n", c->item.fd);
+            conn_close(w, c);
+            return;
+        }
+        if ((size_t) n < avail || session_out_len(&c->session) > w->cfg->buf_large) {
+            break;
+        }
+    }
+    conn_touch(w, c);
+    conn_update(w, c);
+}
+
+static void conn_wake(struct session *s) {
+    conn_update(self, (struct conn *) ((char *) s - offsetof(struct conn, session)));
+}
+
+static void conn_new(struct worker *w, int fd) {
+    struct conn *c = xcalloc(1, sizeof(*c));
+    c->item.kind = ITEM_CONN;
+    c->item.fd = fd;
+    c->events = EPOLLIN;
+    session_init(&c->session, w->proto, w->cfg);
+    c->session.wake = conn_wake;
+
+    struct epoll_event ev = {.events = c->events, .data.ptr = &c->item};
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        session_destroy(&c->session);
+        close(fd);
+        free(c);
+        return;
+    }
+    c->last_active_ms = now_ms();
+    c->session.draining = w->draining;
+    conn_push_front(w, c);
+    w->nconns++;
+    stats_add(STAT_CONNS_ACCEPTED, 1);
+    stats_add(STAT_CONNS_OPEN, 1);
+    conn_update(w, c);
+}
+
+static void shm_conn_close(struct worker *w, struct shm_conn *sc) {
+    if (sc->ready) {
+        session_destroy(&sc->session);
+        munmap(sc->base, sc->maplen);
+        close(sc->doorbell.fd);
+        close(sc->peer_doorbell);
+    }
+    close(sc->control.fd);
+    sc->control.kind = sc->doorbell.kind = ITEM_CLOSED;
+    *(sc->prev ? &sc->prev->next : &w->shm_head) = sc->next;
+    if (sc->next) {
+        sc->next->prev = sc->prev;
+    }
+    w->nconns--;
+    stats_add(STAT_CONNS_OPEN, -1);
+    free_later(w, sc);
+}
+
+static void shm_ring_peer(struct shm_conn *sc) {
+    uint64_t one = 1;
+    if (write(sc->peer_doorbell, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("write doorbell");
+    }
+}
+
+// Copies a queued file range into the ring; there is no sendfile() for it.
+static size_t shm_flush_file(struct shm_conn *sc, int fd, uint64_t off, size_t len) {
+    char chunk[16384];
+    size_t total = 0;
+    while (total < len) {
+        size_t want = len - total < sizeof(chunk) ? len - total : sizeof(chunk);
+        ssize_t n = pread(fd, chunk, want, off + total);
+        if (n <= 0) {
+            // Unreadable or truncated: the reply can no longer be completed,
+            // so drop the rest of the range and the connection with it.
+            sc->session.closing = 1;
+            return len;
+        }
+        size_t w = shm_ring_write(&sc->tx, chunk, n);
+        total += w;
+        if (w < (size_t) n) {
+            break;
+        }
+    }
+    return total;
+}
+
+// Moves as much pending output as fits into the server->client ring.
+static void shm_flush(struct shm_conn *sc) {
+    struct iovec iov[SESSION_IOV_MAX];
+    size_t total = 0;
+    int file_fd;
+    uint64_t off;
+    size_t len;
+    for (;;) {
+        size_t sent = 0, want = 0;
+        if (session_out_next_file(&sc->session, &file_fd, &off, &len)) {
+            want = len;
+            sent = shm_flush_file(sc, file_fd, off, len);
+        } else {
+            int cnt = session_out_iov(&sc->session, iov, SESSION_IOV_MAX);
+            for (int i = 0; i < cnt; i++) {
+                size_t n = shm_ring_write(&sc->tx, iov[i].iov_base, iov[i].iov_len);
+                sent += n;
+                want += iov[i].iov_len;
+                if (n < iov[i].iov_len) {
+                    break;
+                }
+            }
+        }
+        session_out_consume(&sc->session, sent);
+        total += sent;
+        // Stop once the ring is full or the output is drained.
+        if (sent == 0 || sent < want) {
+            break;
+        }
+    }
+    if (total > 0 && shm_ring_should_wake_consumer(&sc->tx)) {
+        shm_ring_peer(sc);
+    }
+}
+
+// The shared-memory flavour of conn_half_close(): the client sees EOF on the
+// rendezvous connection once it has nothing in flight.
+static void shm_half_close_idle(struct shm_conn *sc) {
+    if (sc->session.draining && sc->ready && !sc->half_closed &&
+        session_idle(&sc->session) && shm_ring_readable(&sc->rx) == 0) {
+        shutdown(sc->control.fd, SHUT_WR);
+        sc->half_closed = 1;
+        stats_add(STAT_DRAIN_HALF_CLOSED, 1);
+    }
+}
+
+// Runs the session until there is nothing left to do, then announces what we
+// are waiting for (input, or ring space while output is backed up) so the
+// client knows to ring our doorbell.
+static void shm_service(struct worker *w, struct shm_conn *sc) {
+    for (;;) {
+        shm_flush(sc);
+        while (session_out_len(&sc->session) == 0 && !sc->session.closing) {
+            uint64_t avail = shm_ring_readable(&sc->rx);
+            if (avail == UINT64_MAX) {
+                fprintf(stderr, "shm fd %d: corrupt ring indices, dropping\n", sc->control.fd);
+                shm_conn_close(w, sc);
+                return;
+            }
+            if (avail == 0) {
+                break;
+            }
+            size_t room;
+            char *p = session_read_ptr(&sc->session, &room);
+            size_t n = shm_ring_read(&sc->rx, p, room);
+            if (shm_ring_should_wake_producer(&sc->rx)) {
+                shm_ring_peer(sc);
+            }
+            if (session_process(&sc->session, n) < 0) {
+                fprintf(stderr, "shm fd %d: input buffer limit exceeded, dropping\n",
+                        sc->control.fd);
+                shm_conn_close(w, sc);
+                return;
+            }
+            shm_flush(sc);
+        }
+
+        if (session_out_len(&sc->session) > 0) {
+            if (shm_ring_prepare_wait_space(&sc->tx)) {
+                continue;
+            }
+        } else if (session_done(&sc->session)) {
+            shm_conn_close(w, sc);
+            return;
+        } else if (sc->session.closing) {
+            return;
+        } else if (shm_ring_prepare_wait_data(&sc->rx)) {
+            continue;
+        }
+        shm_half_close_idle(sc);
+        return;
+    }
+}
+
+static void shm_wake(struct session *s) {
+    struct shm_conn *sc = (struct shm_conn *) ((char *) s - offsetof(struct shm_conn, session));
+    if (!sc->woken) {
+        sc->woken = 1;
+        sc->woken_next = self->shm_woken;
+        self->shm_woken = sc;
+    }
+}
+
+// Services the woken clients, including those woken meanwhile. Closed ones
+// are still allocated until the batch's memory is freed.
+static void shm_run_woken(struct worker *w) {
+    while (w->shm_woken) {
+        struct shm_conn *sc = w->shm_woken;
+        w->shm_woken = sc->woken_next;
+        sc->woken = 0;
+        if (sc->control.kind != ITEM_CLOSED) {
+            shm_service(w, sc);
+        }
+    }
+}
+
+static void shm_conn_new(struct worker *w, int fd) {
+    struct shm_conn *sc = xcalloc(1, sizeof(*sc));
+    sc->control.kind = ITEM_SHM_CONTROL;
+    sc->control.fd = fd;
+    sc->doorbell.kind = ITEM_SHM_DOORBELL;
+    sc->doorbell.fd = -1;
+    sc->next = w->shm_head;
+    if (w->shm_head) {
+        w->shm_head->prev = sc;
+    }
+    w->shm_head = sc;
+    w->nconns++;
+    stats_add(STAT_CONNS_ACCEPTED, 1);
+    stats_add(STAT_CONNS_OPEN, 1);
+
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = &sc->control};
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        shm_conn_close(w, sc);
+    }
+}
+
+static void shm_handshake(struct worker *w, struct shm_conn *sc) {
+    uint64_t ring_size;
+    int peer_doorbell;
+    if (shm_accept_segment(sc->control.fd, &sc->base, &sc->maplen, &ring_size,
+                           &sc->doorbell.fd, &peer_doorbell) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("shm handshake");
+            shm_conn_close(w, sc);
+        }
+        return;
+    }
+    sc->peer_doorbell = peer_doorbell;
+    sc->ready = 1;
+    shm_ring_attach(&sc->rx, sc->base, ring_size, SHM_RING_C2S);
+    shm_ring_attach(&sc->tx, sc->base, ring_size, SHM_RING_S2C);
+    session_init(&sc->session, w->proto, w->cfg);
+    sc->session.wake = shm_wake;
+    sc->session.draining = w->draining;
+    net_set_nonblocking(sc->doorbell.fd);
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &sc->doorbell};
+    struct epoll_event ctl = {.events = EPOLLRDHUP, .data.ptr = &sc->control};
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, sc->doorbell.fd, &ev) < 0 ||
+        epoll_ctl(w->epfd, EPOLL_CTL_MOD, sc->control.fd, &ctl) < 0) {
+        perror("epoll_ctl");
+        shm_conn_close(w, sc);
+        return;
+    }
+    shm_service(w, sc);
+}
+
+static void shm_on_doorbell(struct worker *w, struct shm_conn *sc) {
+    uint64_t count;
+    if (read(sc->doorbell.fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read doorbell");
+    }
+    shm_service(w, sc);
+}
+
+static void accept_batch(struct worker *w, struct item *listener) {
+    for (int i = 0; i < w->cfg->batch; i++) {
+        int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept4");
+            }
+            return;
+        }
+        if (listener->kind == ITEM_SHM_LISTENER) {
+            shm_conn_new(w, fd);
+            continue;
+        }
+        // Unix sockets report no CPU.
+        int cpu = w->cpu >= 0 ? net_incoming_cpu(fd) : -1;
+        if (cpu >= 0) {
+            stats_add(cpu == w->cpu ? STAT_CONNS_CPU_LOCAL : STAT_CONNS_CPU_REMOTE, 1);
+        }
+        conn_new(w, fd);
+    }
+}
+
+// Takes the listeners out of this worker's epoll set, closing them once no
+// worker watches them any more, then half-closes the idle clients; the others
+// follow once their work in hand is done.
+static void drain_start(struct worker *w) {
+    for (int i = 0; i < w->nlisteners; i++) {
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->listeners[i].fd, NULL);
+    }
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->drain.fd, NULL);
+    if (atomic_fetch_sub(&drain_listening, 1) == 1) {
+        net_close_listeners();
+    }
+    w->draining = 1;
+    w->drain_deadline_ms = engine_drain_deadline(w->cfg);
+    for (struct conn *c = w->head; c; c = c->next) {
+        c->session.draining = 1;
+        if (!c->session.closing && session_idle(&c->session)) {
+            conn_half_close(c);
+        }
+    }
+    for (struct shm_conn *sc = w->shm_head; sc; sc = sc->next) {
+        sc->session.draining = 1;
+        shm_half_close_idle(sc);
+    }
+}
+
+// Closes every client still open at the drain deadline.
+static void drain_expire(struct worker *w) {
+    while (w->head) {
+        stats_add(STAT_DRAIN_FORCED, 1);
+        conn_close(w, w->head);
+    }
+    while (w->shm_head) {
+        stats_add(STAT_DRAIN_FORCED, 1);
+        shm_conn_close(w, w->shm_head);
+    }
+}
+
+// Returns 1 once no worker has clients left. Workers that finish first keep
+// running their inboxes for the others until then.
+static int drain_done(struct worker *w) {
+    if (w->nconns == 0 && !w->drained) {
+        w->drained = 1;
+        atomic_fetch_sub(&drain_busy, 1);
+    }
+    return atomic_load(&drain_busy) == 0;
+}
+
+// Closes connections that have been idle longer than the configured timeout.
+// The list is kept in activity order, so only expired entries are visited.
+static void sweep_idle(struct worker *w, uint64_t now) {
+    while (w->tail && now - w->tail->last_active_ms >= (uint64_t) w->cfg->idle_timeout_ms) {
+        conn_close(w, w->tail);
+    }
+    w->last_sweep_ms = now;
+}
+
+static void *worker_loop(void *arg) {
+    struct worker *w = arg;
+    const struct server_config *cfg = w->cfg;
+    reactor_self = w->id;
+    self = w;
+
+    if (w->cpu >= 0) {
+        net_pin_thread(w->cpu);
+    }
+
+    struct epoll_event *events = xcalloc(cfg->batch, sizeof(*events));
+    struct engine_poller poller;
+    engine_poller_init(&poller, w->epfd, cfg);
+    int timeout = -1;
+    if (cfg->idle_timeout_ms > 0) {
+        timeout = cfg->idle_timeout_ms < 2000 ? cfg->idle_timeout_ms / 2 + 1 : 1000;
+    }
+
+    int tick = w->proto->on_idle ? w->proto->idle_tick_ms : 0;
+    int wait_ms = timeout;
+    if (tick > 0 && (wait_ms < 0 || tick < wait_ms)) {
+        wait_ms = tick;
+    }
+
+    int idle_pending = 0;
+    for (;;) {
+        int wait = wait_ms;
+        if (w->draining && (wait < 0 || wait > DRAIN_POLL_MS)) {
+            wait = DRAIN_POLL_MS;
+        }
+        int n = engine_epoll_wait(&poller, events, cfg->batch,
+                                  idle_pending || w->shm_woken ? 0 : wait);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror_die("epoll_wait");
+        }
+        for (int i = 0; i < n; i++) {
+            struct item *item = events[i].data.ptr;
+            switch (item->kind) {
+            case ITEM_LISTENER:
+            case ITEM_SHM_LISTENER:
+                accept_batch(w, item);
+                continue;
+            case ITEM_SHM_CONTROL: {
+                struct shm_conn *sc = (struct shm_conn *) item;
+                if (!sc->ready && !(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                    shm_handshake(w, sc);
+                } else {
+                    shm_conn_close(w, sc);
+                }
+                continue;
+            }
+            case ITEM_SHM_DOORBELL:
+                shm_on_doorbell(w, (struct shm_conn *) ((char *) item -
+                                                        offsetof(struct shm_conn, doorbell)));
+                continue;
+            case ITEM_INBOX:
+                inbox_drain(w);
+                continue;
+            case ITEM_DRAIN:
+                drain_start(w);
+                continue;
+            case ITEM_CLOSED:
+                continue;
+            case ITEM_CONN:
+                break;
+            }
+            struct conn *c = (struct conn *) item;
+            if (events[i].events & EPOLLIN) {
+                conn_on_readable(w, c);
+            } else if (events[i].events & EPOLLOUT) {
+                conn_touch(w, c);
+                conn_update(w, c);
+            } else {
+                conn_close(w, c);
+            }
+        }
+        shm_run_woken(w);
+        for (int i = 0; i < w->nclosed; i++) {
+            free(w->closed[i]);
+        }
+        w->nclosed = 0;
+        // A partial batch means the loop has slack for background work; the
+        // tick keeps it going when there is none.
+        if (w->proto->on_idle &&
+            (n < cfg->batch || (tick > 0 && now_ms() - w->last_idle_ms >= (uint64_t) tick))) {
+            idle_pending = w->proto->on_idle();
+            if (tick > 0) {
+                w->last_idle_ms = now_ms();
+            }
+        }
+        if (timeout >= 0) {
+            uint64_t now = now_ms();
+            if (now - w->last_sweep_ms >= (uint64_t) timeout) {
+                sweep_idle(w, now);
+            }
+        }
+        if (w->draining) {
+            if (now_ms() >= w->drain_deadline_ms) {
+                drain_expire(w);
+            }
+            if (drain_done(w)) {
+                break;
+            }
+            if (w->id == 0) {
+                engine_drain_report(cfg, 0);
+            }
+        }
+    }
+    // Closed at the deadline just before leaving.
+    for (int i = 0; i < w->nclosed; i++) {
+        free(w->closed[i]);
+    }
+    free(w->closed);
+    free(events);
+    return NULL;
+}
+
+int engine_epoll_run(const struct server_config *cfg, const struct protocol *proto) {
+    // Unix sockets are always shared; TCP ones only without --reuseport.
+    int shared[CONFIG_MAX_LISTENERS];
+    int nshared = engine_open_unix_listeners(cfg, shared, 1);
+    if (!cfg->reuseport) {
+        nshared += engine_open_tcp_listeners(cfg, shared + nshared, 1);
+    }
+    int shm_fd = -1;
+    if (cfg->shm_path[0]) {
+        shm_fd = net_listen_unix(cfg->shm_path, SOCK_STREAM, cfg->backlog, 1);
+    }
+
+    // Each worker on its CPU's node, and on pages of its own; the connections
+    // and buffers are allocated later by the (pinned) worker itself.
+    struct worker **workers = xcalloc(cfg->workers, sizeof(*workers));
+    reactors = workers;
+    nreactors = cfg->workers;
+    for (int i = 0; i < cfg->workers; i++) {
+        struct worker *w = workers[i] = xcalloc_node(sizeof(*w), engine_worker_node(cfg, i));
+        w->id = i;
+        w->cpu = cfg->ncpus > 0 ? cfg->cpus[i % cfg->ncpus] : -1;
+        w->cfg = cfg;
+        w->proto = proto;
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (w->epfd < 0) {
+            perror_die("epoll_create1");
+        }
+
+        int fds[CONFIG_MAX_LISTENERS];
+        memcpy(fds, shared, nshared * sizeof(int));
+        int nowned = cfg->reuseport ? engine_open_tcp_listeners(cfg, fds + nshared, 1) : 0;
+        w->nlisteners = nshared + nowned;
+        for (int j = 0; j < w->nlisteners; j++) {
+            w->listeners[j].kind = ITEM_LISTENER;
+            w->listeners[j].fd = fds[j];
+            struct epoll_event ev = {
+                .events = EPOLLIN | (j < nshared ? EPOLLEXCLUSIVE : 0),
+                .data.ptr = &w->listeners[j],
+            };
+            if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listeners[j].fd, &ev) < 0) {
+                perror_die("epoll_ctl listener");
+            }
+        }
+        if (shm_fd >= 0) {
+            struct item *it = &w->listeners[w->nlisteners++];
+            it->kind = ITEM_SHM_LISTENER;
+            it->fd = shm_fd;
+            struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = it};
+            if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, shm_fd, &ev) < 0) {
+                perror_die("epoll_ctl shm listener");
+            }
+        }
+        w->park_msg.handler = park;
+        w->inbox.kind = ITEM_INBOX;
+        w->inbox.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w->inbox.fd < 0) {
+            perror_die("eventfd");
+        }
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &w->inbox};
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->inbox.fd, &ev) < 0) {
+            perror_die("epoll_ctl inbox");
+        }
+        w->drain.kind = ITEM_DRAIN;
+        w->drain.fd = engine_drain_fd();
+        ev.data.ptr = &w->drain;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->drain.fd, &ev) < 0) {
+            perror_die("epoll_ctl drain");
+        }
+    }
+    if (cfg->steer_cpu) {
+        // Every port's group holds the workers' listeners in worker order,
+        // also when inherited: they are claimed in the order they joined it.
+        for (int j = nshared; j < nshared + cfg->nports; j++) {
+            if (net_steer_by_cpu(workers[0]->listeners[j].fd, cfg->cpus, cfg->workers) < 0) {
+                perror_die("setsockopt SO_ATTACH_REUSEPORT_CBPF");
+            }
+        }
+    } else if (cfg->reuseport) {
+        // A group taken over from a server run with --steer-cpu keeps its program.
+        for (int j = nshared; j < nshared + cfg->nports; j++) {
+            if (net_steer_clear(workers[0]->listeners[j].fd) < 0) {
+                perror("setsockopt SO_DETACH_REUSEPORT_BPF");
+            }
+        }
+    }
+    atomic_store(&drain_busy, cfg->workers);
+    atomic_store(&drain_listening, cfg->workers);
+    engine_listening(cfg);
+
+    for (int i = 0; i < cfg->workers; i++) {
+        int rc = pthread_create(&workers[i]->thread, NULL, worker_loop, workers[i]);
+        if (rc != 0) {
+            die("pthread_create: %s", strerror(rc));
+        }
+    }
+    for (int i = 0; i < cfg->workers; i++) {
+        pthread_join(workers[i]->thread, NULL);
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+// Serves one client at a time; part 1 of the concurrent servers series.
+#include <errno.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "engine.h"
+#include "net.h"
+
+int engine_sequential_run(const struct server_config *cfg, const struct protocol *proto) {
+    int listeners[CONFIG_MAX_LISTENERS];
+    int n = engine_open_listeners(cfg, listeners, 0);
+    int drain_fd = engine_drain_fd();
+    engine_listening(cfg);
+
+    if (cfg->ncpus > 0) {
+        net_pin_thread(cfg->cpus[0]);
+    }
+
+    for (;;) {
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        int fd = net_accept_any(listeners, n, drain_fd, (struct sockaddr *) &peer, &peer_len);
+        if (fd < 0) {
+            if (errno == ECANCELED) {
+                net_close_listeners();
+                return 0;
+            }
+            // EAGAIN: another process sharing the listener took the client.
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) {
+                continue;
+            }
+            perror("accept");
+            return -1;
+        }
+        engine_serve_blocking(fd, cfg, proto);
+    }
+}
@@ -0,0 +1,102 @@
+// Spawns a detached thread per client; part 2 of the concurrent servers series.
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "net.h"
+#include "utils.h"
+
+// Clients being served, so that draining can wait for them.
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t active_cond = PTHREAD_COND_INITIALIZER;
+static int active;
+
+struct client_args {
+    int fd;
+    int cpu;
+    const struct server_config *cfg;
+    const struct protocol *proto;
+};
+
+static void *client_thread(void *arg) {
+    struct client_args *args = arg;
+    if (args->cpu >= 0) {
+        net_pin_thread(args->cpu);
+    }
+    engine_serve_blocking(args->fd, args->cfg, args->proto);
+    free(args);
+    pthread_mutex_lock(&active_lock);
+    if (--active == 0) {
+        pthread_cond_signal(&active_cond);
+    }
+    pthread_mutex_unlock(&active_lock);
+    return NULL;
+}
+
+int engine_threads_run(const struct server_config *cfg, const struct protocol *proto) {
+    int listeners[CONFIG_MAX_LISTENERS];
+    int n = engine_open_listeners(cfg, listeners, 0);
+    int drain_fd = engine_drain_fd();
+    engine_listening(cfg);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    unsigned long next_cpu = 0;
+    for (;;) {
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        int fd = net_accept_any(listeners, n, drain_fd, (struct sockaddr *) &peer, &peer_len);
+        if (fd < 0) {
+            if (errno == ECANCELED) {
+                break;
+            }
+            // EAGAIN: another process sharing the listener took the client.
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) {
+                continue;
+            }
+            perror("accept");
+            return -1;
+        }
+
+        struct client_args *args = xmalloc(sizeof(*args));
+        args->fd = fd;
+        args->cpu = cfg->ncpus > 0 ? cfg->cpus[next_cpu++ % cfg->ncpus] : -1;
+        args->cfg = cfg;
+        args->proto = proto;
+
+        pthread_mutex_lock(&active_lock);
+        active++;
+        pthread_mutex_unlock(&active_lock);
+        pthread_t thread;
+        int rc = pthread_create(&thread, &attr, client_thread, args);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            close(fd);
+            free(args);
+            pthread_mutex_lock(&active_lock);
+            active--;
+            pthread_mutex_unlock(&active_lock);
+        }
+    }
+
+    // Each client thread enforces the deadline itself.
+    net_close_listeners();
+    pthread_mutex_lock(&active_lock);
+    while (active > 0) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec++;
+        pthread_cond_timedwait(&active_cond, &active_lock, &until);
+        engine_drain_report(cfg, 0);
+    }
+    pthread_mutex_unlock(&active_lock);
+    return 0;
+}
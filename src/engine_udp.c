@@ -0,0 +1,398 @@
+// Datagram engine for --transport udp: each worker drains its sockets with
+// recvmmsg(), answers every datagram through the protocol's on_datagram hook
+// and sends the replies back with one sendmmsg(), so a full batch costs two
+// syscalls instead of two per packet. Socket sharing across workers follows
+// the TCP engines: shared sockets by default, one per worker with --reuseport.
+//
+// With --udp-offload the socket also enables UDP_GRO, so one received buffer
+// may carry many same-sized datagrams from one peer, and consecutive replies
+// to the same peer are coalesced into a single UDP_SEGMENT (GSO) message.
+#include <errno.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "net.h"
+#include "stats.h"
+#include "utils.h"
+
+#define UDP_BATCH_MAX 64
+#define UDP_GSO_MAX_SEGMENTS 64
+#define UDP_GSO_MAX_BYTES 65000
+#define UDP_GRO_SLOT_SIZE 65536
+// Largest GSO segment: an Ethernet MTU less the IP and UDP headers. The
+// sockets are not connected, so the path MTU to each peer (IP_MTU) is not
+// known; a message the route still rejects is resent segment by segment.
+#define UDP_GSO_MTU 1500
+#define UDP_GSO_HEADERS_V4 28
+#define UDP_GSO_HEADERS_V6 48
+
+struct udp_tx_meta {
+    size_t seg_size;            // size of every segment but a short last one
+    int segs;
+    int short_tail;             // last segment is shorter; nothing may follow
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+};
+
+struct udp_worker {
+    int id;
+    int epfd;
+    pthread_t thread;
+    const struct server_config *cfg;
+    const struct protocol *proto;
+    int fds[CONFIG_MAX_PORTS];
+    int nfds;
+    int gro;
+    int gso;
+    size_t gso_seg_max;
+
+    // Preallocated once per worker and reused for every batch.
+    int batch;
+    size_t slot_size;
+    struct mmsghdr rx[UDP_BATCH_MAX];
+    struct iovec rx_iov[UDP_BATCH_MAX];
+    char rx_control[UDP_BATCH_MAX][CMSG_SPACE(sizeof(int))];
+    struct sockaddr_storage peers[UDP_BATCH_MAX];
+    char *rx_data;
+
+    struct mmsghdr tx[UDP_BATCH_MAX];
+    struct iovec tx_iov[UDP_BATCH_MAX];
+    struct udp_tx_meta tx_meta[UDP_BATCH_MAX];
+    char *tx_data;
+    size_t tx_cap;
+    size_t tx_used;
+    int ntx;
+};
+
+static void udp_worker_init_batch(struct udp_worker *w) {
+    w->batch = w->cfg->batch < UDP_BATCH_MAX ? w->cfg->batch : UDP_BATCH_MAX;
+    w->slot_size = w->gro ? UDP_GRO_SLOT_SIZE : w->cfg->buf_small;
+    w->rx_data = xmalloc(w->slot_size * w->batch);
+    w->tx_cap = w->slot_size * w->batch;
+    w->tx_data = xmalloc(w->tx_cap);
+
+    for (int i = 0; i < w->batch; i++) {
+        w->rx_iov[i].iov_base = w->rx_data + i * w->slot_size;
+        w->rx_iov[i].iov_len = w->slot_size;
+        w->rx[i].msg_hdr.msg_iov = &w->rx_iov[i];
+        w->rx[i].msg_hdr.msg_iovlen = 1;
+        w->rx[i].msg_hdr.msg_name = &w->peers[i];
+
+        w->tx[i].msg_hdr.msg_iov = &w->tx_iov[i];
+        w->tx[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+// Enables GRO on `fd` and checks that the kernel knows UDP_SEGMENT; either
+// offload is turned off for the worker when it is not available.
+static void udp_setup_offload(struct udp_worker *w, int fd) {
+    int on = 1;
+    if (w->gro && setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+        perror("setsockopt UDP_GRO (disabled)");
+        w->gro = 0;
+    }
+    int seg;
+    socklen_t len = sizeof(seg);
+    if (w->gso && getsockopt(fd, SOL_UDP, UDP_SEGMENT, &seg, &len) < 0) {
+        perror("getsockopt UDP_SEGMENT (disabled)");
+        w->gso = 0;
+    }
+    struct sockaddr_storage addr;
+    len = sizeof(addr);
+    int v6 = getsockname(fd, (struct sockaddr *) &addr, &len) == 0 && addr.ss_family == AF_INET6;
+    w->gso_seg_max = UDP_GSO_MTU - (v6 ? UDP_GSO_HEADERS_V6 : UDP_GSO_HEADERS_V4);
+}
+
+static void udp_wait_writable(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    poll(&pfd, 1, -1);
+}
+
+// Sends the segments of a coalesced message as datagrams of their own, for a
+// route that refused the GSO message (an MTU below the segment size fails
+// with EINVAL or EMSGSIZE).
+static void udp_send_segments(struct udp_worker *w, int fd, int i) {
+    const struct msghdr *hdr = &w->tx[i].msg_hdr;
+    const char *data = hdr->msg_iov->iov_base;
+    size_t total = hdr->msg_iov->iov_len;
+    size_t seg = w->tx_meta[i].seg_size;
+    for (size_t off = 0; off < total;) {
+        struct iovec iov = {
+            .iov_base = (char *) data + off,
+            .iov_len = total - off < seg ? total - off : seg,
+        };
+        struct msghdr msg = {
+            .msg_name = hdr->msg_name,
+            .msg_namelen = hdr->msg_namelen,
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+        };
+        if (sendmsg(fd, &msg, 0) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                udp_wait_writable(fd);
+                continue;
+            }
+        }
+        off += iov.iov_len;
+    }
+}
+
+// Sends tx[0..count), waiting for buffer space rather than dropping replies.
+static void udp_send_batch(struct udp_worker *w, int fd, int count) {
+    int sent = 0;
+    while (sent < count) {
+        int n = sendmmsg(fd, w->tx + sent, count - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                udp_wait_writable(fd);
+                continue;
+            }
+            // The reply at `sent` is undeliverable (e.g. ICMP unreachable);
+            // skip it and keep the rest of the batch. A coalesced one the
+            // route cannot segment still goes out piece by piece.
+            if ((errno == EINVAL || errno == EMSGSIZE) && w->tx_meta[sent].segs > 1) {
+                udp_send_segments(w, fd, sent);
+            }
+            sent++;
+            continue;
+        }
+        sent += n;
+    }
+}
+
+static void udp_flush(struct udp_worker *w, int fd) {
+    for (int i = 0; i < w->ntx; i++) {
+        struct msghdr *hdr = &w->tx[i].msg_hdr;
+        struct udp_tx_meta *meta = &w->tx_meta[i];
+        if (meta->segs > 1) {
+            hdr->msg_control = meta->control;
+            hdr->msg_controllen = sizeof(meta->control);
+            struct cmsghdr *cm = CMSG_FIRSTHDR(hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t seg_size = meta->seg_size;
+            memcpy(CMSG_DATA(cm), &seg_size, sizeof(seg_size));
+        } else {
+            hdr->msg_control = NULL;
+            hdr->msg_controllen = 0;
+        }
+    }
+    if (w->ntx > 0) {
+        udp_send_batch(w, fd, w->ntx);
+    }
+    w->ntx = 0;
+    w->tx_used = 0;
+}
+
+// Queues the reply just written at tx_data + tx_used. It joins the previous
+// message as another GSO segment when the peer matches, the sizes line up
+// and the segments fit in an MTU; otherwise it starts a new message.
+static void udp_queue_reply(struct udp_worker *w, int fd, int peer, size_t len) {
+    char *data = w->tx_data + w->tx_used;
+    w->tx_used += len;
+
+    if (w->gso && w->ntx > 0) {
+        struct mmsghdr *last = &w->tx[w->ntx - 1];
+        struct udp_tx_meta *meta = &w->tx_meta[w->ntx - 1];
+        if (last->msg_hdr.msg_name == &w->peers[peer] && !meta->short_tail &&
+            len <= meta->seg_size && meta->seg_size <= w->gso_seg_max &&
+            meta->segs < UDP_GSO_MAX_SEGMENTS &&
+            last->msg_hdr.msg_iov->iov_len + len <= UDP_GSO_MAX_BYTES) {
+            last->msg_hdr.msg_iov->iov_len += len;
+            meta->segs++;
+            meta->short_tail = len < meta->seg_size;
+            return;
+        }
+    }
+
+    struct mmsghdr *msg = &w->tx[w->ntx];
+    msg->msg_hdr.msg_name = &w->peers[peer];
+    msg->msg_hdr.msg_namelen = w->rx[peer].msg_hdr.msg_namelen;
+    msg->msg_hdr.msg_iov->iov_base = data;
+    msg->msg_hdr.msg_iov->iov_len = len;
+    w->tx_meta[w->ntx].seg_size = len;
+    w->tx_meta[w->ntx].segs = 1;
+    w->tx_meta[w->ntx].short_tail = 0;
+    if (++w->ntx == w->batch) {
+        udp_flush(w, fd);
+    }
+}
+
+// Returns the GRO segment size of a received message, or 0 if it holds a
+// single datagram.
+static size_t udp_gro_size(struct msghdr *hdr) {
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(hdr); cm; cm = CMSG_NXTHDR(hdr, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(cm), sizeof(size));
+            return size > 0 ? (size_t) size : 0;
+        }
+    }
+    return 0;
+}
+
+static void udp_handle_datagram(struct udp_worker *w, int fd, int peer, const char *data,
+                                size_t len) {
+    size_t room = w->tx_cap - w->tx_used;
+    if (room < w->slot_size) {
+        udp_flush(w, fd);
+        room = w->tx_cap;
+    }
+    size_t cap = room < UDP_GSO_MAX_BYTES ? room : UDP_GSO_MAX_BYTES;
+    size_t n = w->proto->on_datagram(data, len, w->tx_data + w->tx_used, cap);
+    if (n > 0) {
+        udp_queue_reply(w, fd, peer, n);
+    }
+}
+
+static void udp_drain(struct udp_worker *w, int fd) {
+    for (;;) {
+        for (int i = 0; i < w->batch; i++) {
+            struct msghdr *hdr = &w->rx[i].msg_hdr;
+            hdr->msg_namelen = sizeof(w->peers[i]);
+            hdr->msg_flags = 0;
+            hdr->msg_control = w->gro ? w->rx_control[i] : NULL;
+            hdr->msg_controllen = w->gro ? sizeof(w->rx_control[i]) : 0;
+        }
+        int n = recvmmsg(fd, w->rx, w->batch, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("recvmmsg");
+            }
+            return;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct msghdr *hdr = &w->rx[i].msg_hdr;
+            // Larger than a slot (--buffer-sizes small, 64 KiB with GRO): the
+            // tail is gone, so answering would be wrong; count and drop it.
+            if (hdr->msg_flags & MSG_TRUNC) {
+                stats_add(STAT_UDP_TRUNCATED, 1);
+                continue;
+            }
+            const char *data = w->rx_iov[i].iov_base;
+            size_t len = w->rx[i].msg_len;
+            size_t seg = w->gro ? udp_gro_size(hdr) : 0;
+            if (seg == 0) {
+                seg = len;
+            }
+            for (size_t off = 0; off < len; off += seg) {
+                size_t part = len - off < seg ? len - off : seg;
+                udp_handle_datagram(w, fd, i, data + off, part);
+            }
+        }
+        // Replies point at this batch's peer addresses; send before reusing.
+        udp_flush(w, fd);
+        if (n < w->batch) {
+            return;
+        }
+    }
+}
+
+static void *udp_worker_loop(void *arg) {
+    struct udp_worker *w = arg;
+    if (w->cfg->ncpus > 0) {
+        net_pin_thread(w->cfg->cpus[w->id % w->cfg->ncpus]);
+    }
+    // Allocated here, once pinned, so the batch buffers are local to the worker.
+    udp_worker_init_batch(w);
+
+    int drain_fd = engine_drain_fd();
+    struct epoll_event events[CONFIG_MAX_PORTS + 1];
+    struct engine_poller poller;
+    engine_poller_init(&poller, w->epfd, w->cfg);
+    for (;;) {
+        int n = engine_epoll_wait(&poller, events, CONFIG_MAX_PORTS + 1, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror_die("epoll_wait");
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == drain_fd) {
+                // Datagrams still queued stay with the sockets' new owner.
+                free(w->rx_data);
+                free(w->tx_data);
+                return NULL;
+            }
+            udp_drain(w, events[i].data.fd);
+        }
+    }
+}
+
+int engine_udp_run(const struct server_config *cfg, const struct protocol *proto) {
+    int shared[CONFIG_MAX_PORTS];
+    if (!cfg->reuseport) {
+        for (int i = 0; i < cfg->nports; i++) {
+            shared[i] = net_bind_udp(cfg->host, cfg->ports[i], 0, 1);
+        }
+    }
+
+    struct udp_worker **workers = xcalloc(cfg->workers, sizeof(*workers));
+    for (int i = 0; i < cfg->workers; i++) {
+        struct udp_worker *w = workers[i] = xcalloc_node(sizeof(*w), engine_worker_node(cfg, i));
+        w->id = i;
+        w->cfg = cfg;
+        w->proto = proto;
+        w->gro = w->gso = cfg->udp_offload;
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (w->epfd < 0) {
+            perror_die("epoll_create1");
+        }
+
+        w->nfds = cfg->nports;
+        for (int j = 0; j < w->nfds; j++) {
+            w->fds[j] = cfg->reuseport ? net_bind_udp(cfg->host, cfg->ports[j], 1, 1) : shared[j];
+            engine_busy_poll_socket(cfg, w->fds[j]);
+            udp_setup_offload(w, w->fds[j]);
+            struct epoll_event ev = {
+                .events = EPOLLIN | (cfg->reuseport ? 0 : EPOLLEXCLUSIVE),
+                .data.fd = w->fds[j],
+            };
+            if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->fds[j], &ev) < 0) {
+                perror_die("epoll_ctl");
+            }
+        }
+        struct epoll_event ev = {.events = EPOLLIN, .data.fd = engine_drain_fd()};
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0) {
+            perror_die("epoll_ctl");
+        }
+    }
+    engine_listening(cfg);
+
+    for (int i = 0; i < cfg->workers; i++) {
+        int rc = pthread_create(&workers[i]->thread, NULL, udp_worker_loop, workers[i]);
+        if (rc != 0) {
+            die("pthread_create: %s", strerror(rc));
+        }
+    }
+    for (int i = 0; i < cfg->workers; i++) {
+        pthread_join(workers[i]->thread, NULL);
+    }
+    // No /info outside the http mode, so say it here rather than not at all.
+    if (stats_get(STAT_UDP_TRUNCATED) > 0) {
+        printf("Dropped %lld datagrams larger than the %zu-byte receive slots\n",
+               stats_get(STAT_UDP_TRUNCATED), workers[0]->slot_size);
+    }
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include "evict.h"
+
+#include <time.h>
+
+#include "utils.h"
+
+#define ACCESS_MASK 0xffffffu
+#define LFU_INIT 5              // a new key's counter, so it is not the first to go
+#define LFU_LOG_FACTOR 10
+// Random slots probed at most per sampled key, for sparse tables.
+#define PICK_TRIES 16
+
+static int is_lru(enum maxmemory_policy policy) {
+    return policy == MAXMEMORY_ALLKEYS_LRU || policy == MAXMEMORY_VOLATILE_LRU;
+}
+
+static int is_lfu(enum maxmemory_policy policy) {
+    return policy == MAXMEMORY_ALLKEYS_LFU || policy == MAXMEMORY_VOLATILE_LFU;
+}
+
+static int is_volatile(enum maxmemory_policy policy) {
+    return policy == MAXMEMORY_VOLATILE_LRU || policy == MAXMEMORY_VOLATILE_LFU ||
+           policy == MAXMEMORY_VOLATILE_RANDOM;
+}
+
+// Wall-clock seconds, which stay meaningful for entries loaded from a
+// snapshot. The coarse clock is read without a syscall or a TSC read.
+static uint32_t clock_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return (uint32_t) ts.tv_sec;
+}
+
+static uint32_t lfu_minutes(uint32_t access) {
+    return access >> 8;
+}
+
+static uint32_t lfu_counter(uint32_t access) {
+    return access & 0xff;
+}
+
+// The counter after decaying it to `now` (in minutes, mod 2^16).
+static uint32_t lfu_decayed(uint32_t access, uint32_t now) {
+    uint32_t idle = (now - lfu_minutes(access)) & 0xffff;
+    uint32_t counter = lfu_counter(access);
+    return counter > idle ? counter - idle : 0;
+}
+
+void evict_touch(struct kv_entry *e, enum maxmemory_policy policy, uint64_t *rng) {
+    if (is_lru(policy)) {
+        e->access = clock_seconds() & ACCESS_MASK;
+        return;
+    }
+    if (!is_lfu(policy)) {
+        return;
+    }
+    uint32_t now = (clock_seconds() / 60) & 0xffff;
+    uint32_t counter = LFU_INIT;
+    if (e->access != 0) {
+        counter = lfu_decayed(e->access, now);
+        if (counter < 255) {
+            uint32_t base = counter > LFU_INIT ? counter - LFU_INIT : 0;
+            // Compares against 32 random bits instead of computing a double.
+            if ((next_random(rng) >> 32) * (base * LFU_LOG_FACTOR + 1) < (1ull << 32)) {
+                counter++;
+            }
+        }
+    }
+    e->access = now << 8 | counter;
+}
+
+// Higher means evict sooner.
+static uint32_t score(const struct kv_entry *e, enum maxmemory_policy policy, uint32_t now) {
+    if (is_lru(policy)) {
+        return (now - e->access) & ACCESS_MASK;
+    }
+    return 255 - lfu_decayed(e->access, (now / 60) & 0xffff);
+}
+
+struct kv_entry *evict_pick(const struct kv_store *st, enum maxmemory_policy policy, int samples,
+                            uint64_t *rng) {
+    uint32_t now = clock_seconds();
+    struct kv_entry *best = NULL;
+    uint32_t best_score = 0;
+    size_t nslots = kv_slots(st);
+    for (int tries = 0, sampled = 0; sampled < samples && tries < samples * PICK_TRIES; tries++) {
+        struct kv_entry *e = kv_slot(st, next_random(rng) % nslots);
+        if (e == NULL || (is_volatile(policy) && e->expire_at == 0)) {
+            continue;
+        }
+        if (!is_lru(policy) && !is_lfu(policy)) {
+            return e;
+        }
+        sampled++;
+        uint32_t s = score(e, policy, now);
+        if (best == NULL || s > best_score) {
+            best = e;
+            best_score = s;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,30 @@
+#ifndef EVICT_H
+#define EVICT_H
+
+#include <stdint.h>
+
+#include "config.h"
+#include "kv.h"
+
+// Approximate LRU and LFU for --maxmemory, as in Redis: instead of keeping
+// keys on lists, which costs two pointers per key and a few cache misses per
+// access, each entry carries 24 bits in kv_entry.access, and eviction picks
+// the best of a few keys sampled at random.
+//
+// Under LRU the bits hold the time of the last access in seconds (wrapping
+// after 194 days). Under LFU the low 8 bits are a logarithmic (Morris)
+// counter, incremented with probability 1 / ((c - 5) * 10 + 1) so that it
+// takes about a million accesses to saturate, and the upper 16 bits the time
+// in minutes it was last decayed; it loses one for every minute without an
+// access, so it reflects recent rather than lifetime popularity.
+
+// Records an access to `e`, or its creation if e->access is still 0. Does
+// nothing under policies that do not look at access.
+void evict_touch(struct kv_entry *e, enum maxmemory_policy policy, uint64_t *rng);
+
+// Samples `samples` keys of `st` (under the volatile policies, keys with a
+// TTL) and returns the one to evict first, or NULL if it found none.
+struct kv_entry *evict_pick(const struct kv_store *st, enum maxmemory_policy policy, int samples,
+                            uint64_t *rng);
+
+#endif
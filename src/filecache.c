@@ -0,0 +1,295 @@
+#include "filecache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/openat2.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "kv.h"
+#include "utils.h"
+
+// Anything that can change what a path in the directory refers to, or the
+// size of the file behind it.
+#define WATCH_MASK                                                                       \
+    (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE |   \
+     IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct entry {
+    struct entry *next;         // hash chain
+    struct entry *name_next;    // chain of the (wd, name) index
+    struct entry *newer, *older;
+    uint64_t hash;
+    uint64_t name_hash;         // of wd and the last path component
+    struct file_info info;      // holds the cache's own reference
+    int wd;                     // watch on the containing directory
+    size_t name_off;            // where the last path component starts
+    size_t len;
+    char path[];
+};
+
+static struct {
+    char root[PATH_MAX];
+    int root_fd;
+    int inotify_fd;
+    int max_entries;
+
+    pthread_mutex_t lock;
+    struct entry **buckets;
+    // The same entries by watch and file name, as inotify reports them.
+    struct entry **name_buckets;
+    size_t nbuckets;
+    struct entry *newest, *oldest;
+    int count;
+    // Bumped by every invalidation; a miss only caches what it opened if no
+    // event arrived since it started watching.
+    uint64_t generation;
+    uint64_t last_version;
+} cache = {
+    .root_fd = -1,
+    .inotify_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct entry **find(const char *path, size_t len, uint64_t hash) {
+    struct entry **p = &cache.buckets[hash & (cache.nbuckets - 1)];
+    while (*p && !((*p)->hash == hash && (*p)->len == len && !memcmp((*p)->path, path, len))) {
+        p = &(*p)->next;
+    }
+    return p;
+}
+
+static uint64_t name_hash(int wd, const char *name, size_t len) {
+    return kv_hash(name, len) ^ (uint64_t) wd * 0x9e3779b97f4a7c15ull;
+}
+
+static struct entry **name_bucket(uint64_t hash) {
+    return &cache.name_buckets[hash & (cache.nbuckets - 1)];
+}
+
+static void lru_unlink(struct entry *e) {
+    *(e->newer ? &e->newer->older : &cache.newest) = e->older;
+    *(e->older ? &e->older->newer : &cache.oldest) = e->newer;
+}
+
+static void lru_push(struct entry *e) {
+    e->newer = NULL;
+    e->older = cache.newest;
+    *(cache.newest ? &cache.newest->newer : &cache.oldest) = e;
+    cache.newest = e;
+}
+
+static void entry_drop(struct entry *e) {
+    *find(e->path, e->len, e->hash) = e->next;
+    struct entry **p = name_bucket(e->name_hash);
+    while (*p != e) {
+        p = &(*p)->name_next;
+    }
+    *p = e->name_next;
+    lru_unlink(e);
+    rcfile_unref(e->info.file);
+    free(e);
+    cache.count--;
+}
+
+static int open_beneath(const char *path) {
+    struct open_how how = {
+        .flags = O_RDONLY | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS,
+    };
+    return syscall(SYS_openat2, cache.root_fd, path, &how, sizeof(how));
+}
+
+// Opens and stats `path` without touching the cache.
+static int open_file(const char *path, struct file_info *out) {
+    int fd = open_beneath(path);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = S_ISDIR(st.st_mode) ? EISDIR : EACCES;
+        return -1;
+    }
+    out->file = rcfile_new(fd);
+    out->size = st.st_size;
+    out->mtime = st.st_mtim.tv_sec;
+    out->version = 0;
+    return 0;
+}
+
+// Watches the directory holding `path`; the same directory always yields the
+// same watch descriptor.
+static int watch_dir(const char *path, size_t name_off) {
+    char dir[PATH_MAX];
+    int n = snprintf(dir, sizeof(dir), "%s/%.*s", cache.root, (int) name_off, path);
+    if (n < 0 || (size_t) n >= sizeof(dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return inotify_add_watch(cache.inotify_fd, dir, WATCH_MASK);
+}
+
+static void invalidate(const struct inotify_event *ev) {
+    pthread_mutex_lock(&cache.lock);
+    cache.generation++;
+    if (ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        // Events were lost, or the directory itself is gone (IN_IGNORED: and
+        // its watch with it); rare enough to scan for.
+        struct entry *e = cache.newest;
+        while (e) {
+            struct entry *older = e->older;
+            if ((ev->mask & IN_Q_OVERFLOW) || e->wd == ev->wd) {
+                entry_drop(e);
+            }
+            e = older;
+        }
+    } else if (ev->len) {
+        size_t nlen = strlen(ev->name);
+        uint64_t hash = name_hash(ev->wd, ev->name, nlen);
+        struct entry *e = *name_bucket(hash);
+        while (e) {
+            struct entry *next = e->name_next;
+            if (e->name_hash == hash && e->wd == ev->wd && e->len - e->name_off == nlen &&
+                !memcmp(e->path + e->name_off, ev->name, nlen)) {
+                entry_drop(e);
+            }
+            e = next;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+static void *watch_loop(void *arg) {
+    (void) arg;
+    char events[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(cache.inotify_fd, events, sizeof(events));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror_die("inotify read");
+        }
+        for (char *p = events; p < events + n;) {
+            const struct inotify_event *ev = (const struct inotify_event *) p;
+            invalidate(ev);
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+    return NULL;
+}
+
+void filecache_init(const char *root, int max_entries) {
+    if (realpath(root, cache.root) == NULL) {
+        perror_die(root);
+    }
+    cache.root_fd = open(cache.root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cache.root_fd < 0) {
+        perror_die(root);
+    }
+    cache.max_entries = max_entries;
+    if (max_entries == 0) {
+        return;
+    }
+    cache.nbuckets = 16;
+    while (cache.nbuckets < (size_t) max_entries) {
+        cache.nbuckets *= 2;
+    }
+    cache.buckets = xcalloc(cache.nbuckets, sizeof(*cache.buckets));
+    cache.name_buckets = xcalloc(cache.nbuckets, sizeof(*cache.name_buckets));
+    cache.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (cache.inotify_fd < 0) {
+        perror_die("inotify_init1");
+    }
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, watch_loop, NULL);
+    if (rc != 0) {
+        die("pthread_create: %s", strerror(rc));
+    }
+    pthread_detach(thread);
+}
+
+int filecache_get(const char *path, struct file_info *out) {
+    if (cache.max_entries == 0) {
+        return open_file(path, out);
+    }
+    size_t len = strlen(path);
+    uint64_t hash = kv_hash(path, len);
+
+    pthread_mutex_lock(&cache.lock);
+    struct entry *e = *find(path, len, hash);
+    if (e) {
+        lru_unlink(e);
+        lru_push(e);
+        *out = e->info;
+        rcfile_ref(out->file);
+        pthread_mutex_unlock(&cache.lock);
+        return 0;
+    }
+    uint64_t generation = cache.generation;
+    pthread_mutex_unlock(&cache.lock);
+
+    // Watch before opening, so a change made after the open is always seen.
+    const char *slash = strrchr(path, '/');
+    size_t name_off = slash ? (size_t) (slash - path) + 1 : 0;
+    int wd = watch_dir(path, name_off);
+    if (open_file(path, out) < 0) {
+        return -1;
+    }
+    if (wd < 0) {
+        return 0;               // e.g. out of watches: serve it uncached
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    struct entry **slot = find(path, len, hash);
+    if (*slot == NULL && cache.generation == generation) {
+        e = xmalloc(sizeof(*e) + len);
+        e->next = NULL;
+        e->hash = hash;
+        out->version = ++cache.last_version;
+        e->info = *out;
+        rcfile_ref(out->file);
+        e->wd = wd;
+        e->name_off = name_off;
+        e->len = len;
+        memcpy(e->path, path, len);
+        *slot = e;
+        e->name_hash = name_hash(wd, path + name_off, len - name_off);
+        e->name_next = *name_bucket(e->name_hash);
+        *name_bucket(e->name_hash) = e;
+        lru_push(e);
+        if (++cache.count > cache.max_entries) {
+            entry_drop(cache.oldest);
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return 0;
+}
+
+uint64_t filecache_version(const char *path) {
+    if (cache.max_entries == 0) {
+        return 0;
+    }
+    size_t len = strlen(path);
+    uint64_t hash = kv_hash(path, len);
+    pthread_mutex_lock(&cache.lock);
+    struct entry *e = *find(path, len, hash);
+    uint64_t version = e ? e->info.version : 0;
+    pthread_mutex_unlock(&cache.lock);
+    return version;
+}
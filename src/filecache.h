@@ -0,0 +1,40 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rcbuf.h"
+
+// Open files under a document root, kept with their size and modification
+// time so that serving a hot file needs no open(), fstat() or close(). The
+// cache is shared by all threads and bounded by an entry count, evicting the
+// least recently used file. An inotify watch on the directory of every cached
+// file drops its entry as soon as the file is modified, replaced, renamed or
+// deleted; a background thread applies the events. Paths are resolved with
+// openat2(RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS): ".." cannot lead outside the
+// root, and symlinks are refused (ELOOP), since a change to a link's target
+// would not be seen by the watch on the link's directory.
+
+struct file_info {
+    struct rcfile *file;        // the caller owns this reference
+    uint64_t size;
+    int64_t mtime;              // Unix time in seconds
+    uint64_t version;           // identifies the cached open, 0 if uncached
+};
+
+// Opens `root` and starts the invalidation thread. With `max_entries` 0,
+// nothing is cached and every lookup opens the file. Dies on failure.
+void filecache_init(const char *root, int max_entries);
+
+// Looks up `path`, relative to the root and NUL-terminated. Returns 0 and
+// fills `out` for a regular file, or -1 with errno set (EISDIR or EACCES
+// for anything else).
+int filecache_get(const char *path, struct file_info *out);
+
+// Returns the version of the cached open of `path`, or 0 if it is not cached.
+// Anything derived from a file_info stays current while this still matches
+// its version. Makes no system calls.
+uint64_t filecache_version(const char *path);
+
+#endif
@@ -0,0 +1,214 @@
+#include "http.h"
+
+#include <string.h>
+#include <strings.h>
+
+enum {
+    PS_REQUEST_LINE,
+    PS_HEADERS,
+    PS_BODY,
+};
+
+void http_parser_init(struct http_parser *p, size_t max_body) {
+    memset(p, 0, sizeof(*p));
+    p->max_body = max_body;
+}
+
+void http_parser_reset(struct http_parser *p) {
+    p->state = PS_REQUEST_LINE;
+    p->pos = 0;
+    p->nheaders = 0;
+    p->content_length = 0;
+    p->has_length = 0;
+    p->body.off = p->body.len = 0;
+    p->error_status = 0;
+    p->error = NULL;
+}
+
+static enum http_status fail(struct http_parser *p, int status, const char *msg) {
+    p->error_status = status;
+    p->error = msg;
+    return HTTP_ERROR;
+}
+
+// tchar from RFC 9110: the characters allowed in methods and header names.
+static int is_token_char(unsigned char c) {
+    static const char extra[] = "!#$%&'*+-.^_`|~";
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c != '\0' && strchr(extra, c) != NULL);
+}
+
+// "METHOD target HTTP/1.x"
+static int parse_request_line(struct http_parser *p, const char *data, size_t start,
+                              size_t end) {
+    size_t i = start;
+    while (i < end && is_token_char(data[i])) {
+        i++;
+    }
+    if (i == start || i == end || data[i] != ' ') {
+        return -1;
+    }
+    p->method = (struct http_slice){start, i - start};
+    size_t t = ++i;
+    while (i < end && data[i] != ' ') {
+        i++;
+    }
+    if (i == t || i == end) {
+        return -1;
+    }
+    p->target = (struct http_slice){t, i - t};
+    const char *q = memchr(data + t, '?', i - t);
+    p->path = (struct http_slice){t, q ? (size_t) (q - data) - t : i - t};
+    i++;
+    if (end - i != 8 || memcmp(data + i, "HTTP/1.", 7) != 0 || data[i + 7] < '0' ||
+        data[i + 7] > '9') {
+        return -2;
+    }
+    p->minor = data[i + 7] - '0';
+    p->keep_alive = p->minor >= 1;
+    return 0;
+}
+
+static int has_token(const char *s, size_t len, const char *token) {
+    size_t tlen = strlen(token);
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (s[i] == ' ' || s[i] == '\t' || s[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < len && s[i] != ',') {
+            i++;
+        }
+        size_t e = i;
+        while (e > start && (s[e - 1] == ' ' || s[e - 1] == '\t')) {
+            e--;
+        }
+        if (e - start == tlen && !strncasecmp(s + start, token, tlen)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// "Name: value"; the headers the parser itself acts on are interpreted here.
+static enum http_status parse_header(struct http_parser *p, const char *data, size_t start,
+                                     size_t end) {
+    size_t i = start;
+    while (i < end && is_token_char(data[i])) {
+        i++;
+    }
+    if (i == start || i == end || data[i] != ':') {
+        // Also rejects obsolete line folding, which starts with whitespace.
+        return fail(p, 400, "malformed header");
+    }
+    if (p->nheaders == HTTP_MAX_HEADERS) {
+        return fail(p, 431, "too many headers");
+    }
+    size_t v = i + 1, e = end;
+    while (v < e && (data[v] == ' ' || data[v] == '\t')) {
+        v++;
+    }
+    while (e > v && (data[e - 1] == ' ' || data[e - 1] == '\t')) {
+        e--;
+    }
+    struct http_header *h = &p->headers[p->nheaders++];
+    h->name = (struct http_slice){start, i - start};
+    h->value = (struct http_slice){v, e - v};
+
+    const char *name = data + start;
+    size_t nlen = i - start;
+    if (nlen == 14 && !strncasecmp(name, "content-length", nlen)) {
+        size_t n = 0;
+        int too_large = 0;
+        if (v == e) {
+            return fail(p, 400, "invalid Content-Length");
+        }
+        for (size_t k = v; k < e; k++) {
+            if (data[k] < '0' || data[k] > '9') {
+                return fail(p, 400, "invalid Content-Length");
+            }
+            n = n * 10 + (data[k] - '0');
+            if (n > p->max_body) {
+                too_large = 1;      // keeps checking the digits, without overflowing
+                n = p->max_body + 1;
+            }
+        }
+        if (too_large) {
+            return fail(p, 413, "request body too large");
+        }
+        // Repeated values must agree, or the request could be framed two ways.
+        if (p->has_length && n != p->content_length) {
+            return fail(p, 400, "conflicting Content-Length");
+        }
+        p->content_length = n;
+        p->has_length = 1;
+    } else if (nlen == 17 && !strncasecmp(name, "transfer-encoding", nlen)) {
+        return fail(p, 501, "Transfer-Encoding is not supported");
+    } else if (nlen == 10 && !strncasecmp(name, "connection", nlen)) {
+        if (has_token(data + v, e - v, "close")) {
+            p->keep_alive = 0;
+        } else if (has_token(data + v, e - v, "keep-alive")) {
+            p->keep_alive = 1;
+        }
+    }
+    return HTTP_INCOMPLETE;
+}
+
+enum http_status http_parse(struct http_parser *p, const char *data, size_t len) {
+    for (;;) {
+        if (p->state == PS_BODY) {
+            if (len - p->pos < p->content_length) {
+                return HTTP_INCOMPLETE;
+            }
+            p->body = (struct http_slice){p->pos, p->content_length};
+            p->pos += p->content_length;
+            return HTTP_REQUEST;
+        }
+
+        const char *nl = memchr(data + p->pos, '\n', len - p->pos);
+        if (nl == NULL) {
+            return len > HTTP_MAX_HEAD ? fail(p, 431, "request header too large")
+                                       : HTTP_INCOMPLETE;
+        }
+        size_t start = p->pos, end = nl - data;
+        if (end > HTTP_MAX_HEAD) {
+            return fail(p, 431, "request header too large");
+        }
+        if (end > start && data[end - 1] == '\r') {
+            end--;
+        }
+        p->pos = nl + 1 - data;
+
+        if (p->state == PS_REQUEST_LINE) {
+            // Empty lines before a request are tolerated (RFC 9112, 2.2).
+            if (end == start) {
+                continue;
+            }
+            int rc = parse_request_line(p, data, start, end);
+            if (rc < 0) {
+                return rc == -2 ? fail(p, 505, "unsupported HTTP version")
+                                : fail(p, 400, "malformed request line");
+            }
+            p->state = PS_HEADERS;
+        } else if (end > start) {
+            if (parse_header(p, data, start, end) == HTTP_ERROR) {
+                return HTTP_ERROR;
+            }
+        } else {
+            p->state = PS_BODY;
+        }
+    }
+}
+
+const struct http_slice *http_find_header(const struct http_parser *p, const char *data,
+                                          const char *name) {
+    size_t nlen = strlen(name);
+    for (int i = 0; i < p->nheaders; i++) {
+        const struct http_header *h = &p->headers[i];
+        if (h->name.len == nlen && !strncasecmp(data + h->name.off, name, nlen)) {
+            return &h->value;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,67 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+
+// Incremental parser for HTTP/1.0 and HTTP/1.1 requests. Like the RESP
+// parser, it never copies: the request line and headers are recorded as
+// offset/length slices into the caller's input, so they stay valid when the
+// input buffer is moved or grown between calls. Each line is examined once;
+// an unfinished line is the only thing looked at again when more bytes
+// arrive. Request bodies must carry a Content-Length; chunked uploads are
+// refused with 501.
+
+#define HTTP_MAX_HEADERS 64
+#define HTTP_MAX_HEAD (64 * 1024)   // request line plus headers
+
+enum http_status { HTTP_INCOMPLETE, HTTP_REQUEST, HTTP_ERROR };
+
+struct http_slice {
+    size_t off;
+    size_t len;
+};
+
+struct http_header {
+    struct http_slice name;
+    struct http_slice value;        // without surrounding whitespace
+};
+
+struct http_parser {
+    int state;
+    size_t pos;                     // bytes of the current request parsed so far
+    size_t max_body;                // larger bodies fail with 413
+    struct http_slice method;
+    struct http_slice target;       // as sent, e.g. "/path?query"
+    struct http_slice path;         // the target up to '?'
+    int minor;                      // HTTP/1.<minor>
+    int keep_alive;                 // from the version and Connection headers
+    struct http_header headers[HTTP_MAX_HEADERS];
+    int nheaders;
+    size_t content_length;
+    int has_length;                 // a Content-Length header was seen
+    struct http_slice body;
+    int error_status;               // set with `error` when HTTP_ERROR is returned
+    const char *error;
+};
+
+void http_parser_init(struct http_parser *p, size_t max_body);
+
+// Parses the request starting at `data`. On HTTP_REQUEST the fields describe
+// it, body included, and p->pos is its length; call http_parser_reset()
+// once the caller has consumed those bytes. On HTTP_INCOMPLETE, call again
+// with the same start and more bytes appended. On HTTP_ERROR the connection
+// should be answered with p->error_status and closed.
+enum http_status http_parse(struct http_parser *p, const char *data, size_t len);
+void http_parser_reset(struct http_parser *p);
+
+// Returns the value of the first header called `name` (case-insensitive),
+// or NULL.
+const struct http_slice *http_find_header(const struct http_parser *p, const char *data,
+                                          const char *name);
+
+static inline int http_slice_eq(const char *data, struct http_slice s, const char *lit,
+                                size_t litlen) {
+    return s.len == litlen && __builtin_memcmp(data + s.off, lit, litlen) == 0;
+}
+
+#endif
@@ -0,0 +1,510 @@
+// `--mode http`: a small HTTP/1.1 server for health checks and metadata,
+// running on the same engines as the other modes. Requests are parsed in
+// place (http.h) and every request already complete in the input is answered
+// in one pass, in order, so a pipelined batch goes out in one gathered write.
+// Connections are kept alive unless the client is HTTP/1.0 without
+// "Connection: keep-alive", asks for "Connection: close", or sends something
+// the parser rejects, which is answered with an error status before closing.
+// While the server drains, every reply says "Connection: close".
+//
+// Routes live in a table; each handler fills in a reply body that the caller
+// frames with the status line and headers, dropping the body for HEAD. Other
+// paths are looked up under --http-root, if given, in the shared open-file
+// cache (filecache.h); a file body is queued by reference and goes out with
+// sendfile() after the headers, so it is never copied through user space.
+//
+// With --http-cache-size, successful GET and HEAD replies from cacheable
+// routes and small cached files are rendered once into the response cache
+// (httpcache.h). A hit queues the stored headers and body by reference with
+// only Date and Connection written per request, so the response, and a whole
+// pipelined batch of them, leaves in one gathered write. Entries made from a
+// file carry its version and are only used while the file cache still holds
+// that version, so a changed file is never served from a stale entry.
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filecache.h"
+#include "http.h"
+#include "httpcache.h"
+#include "protocol.h"
+#include "stats.h"
+#include "utils.h"
+
+#define HTTP_SERVER_NAME "concurrent_server"
+#define HTTP_CACHE_KEY_MAX 1024
+
+struct http_reply {
+    int status;
+    const char *type;
+    const char *allow;          // for 405, the methods the route accepts
+    struct buf *body;
+    struct file_info file;      // replaces `body` when file.file is set
+    int cacheable;              // may go into the response cache
+};
+
+struct http_route {
+    const char *path;
+    void (*handler)(struct session *s, struct http_reply *r);
+    int cacheable;              // same bytes for every request, within the TTL
+};
+
+struct http_conn {
+    struct http_parser parser;
+};
+
+static uint64_t start_ms;
+static int serve_files;
+static __thread struct buf scratch;
+static __thread struct buf head_scratch;
+static __thread time_t date_sec = -1;
+static __thread char date_value[40];
+static __thread int scratch_registered;
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+// The threads engine runs each client on its own thread, so the per-thread
+// buffers are freed when their thread exits.
+static void scratch_free(void *arg) {
+    (void) arg;
+    buf_free(&scratch);
+    buf_free(&head_scratch);
+}
+
+static void scratch_key_create(void) {
+    pthread_key_create(&scratch_key, scratch_free);
+}
+
+static void scratch_register(void) {
+    if (!scratch_registered) {
+        pthread_once(&scratch_once, scratch_key_create);
+        pthread_setspecific(scratch_key, &scratch);   // any non-NULL value runs the destructor
+        scratch_registered = 1;
+    }
+}
+
+static void buf_printf(struct buf *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void buf_printf(struct buf *b, const char *fmt, ...) {
+    size_t room = 256;
+    for (;;) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(buf_reserve(b, room), room, fmt, ap);
+        va_end(ap);
+        if ((size_t) n < room) {
+            buf_commit(b, n);
+            return;
+        }
+        room = n + 1;
+    }
+}
+
+static const char *status_reason(int status) {
+    switch (status) {
+    case 200:
+        return "OK";
+    case 400:
+        return "Bad Request";
+    case 403:
+        return "Forbidden";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 413:
+        return "Content Too Large";
+    case 431:
+        return "Request Header Fields Too Large";
+    case 500:
+        return "Internal Server Error";
+    case 501:
+        return "Not Implemented";
+    case 505:
+        return "HTTP Version Not Supported";
+    }
+    return "Unknown";
+}
+
+// The Date header only changes once a second, so each thread formats it then.
+static const char *http_date(void) {
+    time_t now = time(NULL);
+    if (now != date_sec) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(date_value, sizeof(date_value), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        date_sec = now;
+    }
+    return date_value;
+}
+
+static void get_health(struct session *s, struct http_reply *r) {
+    (void) s;
+    buf_append(r->body, "OK\n", 3);
+}
+
+static void get_info(struct session *s, struct http_reply *r) {
+    const struct server_config *cfg = s->cfg;
+    r->type = "application/json";
+    buf_printf(r->body,
+               "{\"server\":\"" HTTP_SERVER_NAME "\",\"mode\":\"%s\",\"engine\":\"%s\","
+               "\"workers\":%d,\"pid\":%d,\"uptime_ms\":%llu,\"stats\":{",
+               cfg->mode, engine_name(cfg->engine), cfg->workers, (int) getpid(),
+               (unsigned long long) (now_ms() - start_ms));
+    for (int i = 0; i < STAT_COUNT; i++) {
+        buf_printf(r->body, "%s\"%s\":%lld", i ? "," : "", stats_name(i), stats_get(i));
+    }
+    buf_printf(r->body, "}}\n");
+}
+
+static const struct http_route routes[] = {
+    {"/health", get_health, 1},
+    {"/info", get_info, 0},     // live counters, e.g. drain progress
+};
+
+static const struct {
+    const char *ext;
+    const char *type;
+} content_types[] = {
+    {"html", "text/html; charset=utf-8"},
+    {"htm", "text/html; charset=utf-8"},
+    {"css", "text/css"},
+    {"js", "text/javascript"},
+    {"json", "application/json"},
+    {"txt", "text/plain; charset=utf-8"},
+    {"xml", "application/xml"},
+    {"svg", "image/svg+xml"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"ico", "image/x-icon"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+};
+
+static const char *content_type(const char *path) {
+    const char *dot = strrchr(path, '.');
+    if (dot && strchr(dot, '/') == NULL) {
+        for (size_t i = 0; i < sizeof(content_types) / sizeof(content_types[0]); i++) {
+            if (!strcasecmp(dot + 1, content_types[i].ext)) {
+                return content_types[i].type;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+static int hex_value(char c) {
+    return c >= '0' && c <= '9' ? c - '0'
+           : c >= 'a' && c <= 'f' ? c - 'a' + 10
+           : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                  : -1;
+}
+
+// Turns the request path into a NUL-terminated path relative to the root,
+// decoding %XX escapes, with "index.html" appended to a directory. Returns
+// -1 for paths that are malformed, too long, or have a component starting
+// with '.', which rules out both ".." and hidden files.
+static int file_path(const char *p, size_t len, char *out, size_t outcap) {
+    static const char index[] = "index.html";
+    size_t n = 0;
+    if (len == 0 || p[0] != '/') {
+        return -1;
+    }
+    for (size_t i = 1; i < len; i++) {
+        char c = p[i];
+        if (c == '%') {
+            int hi = i + 2 < len ? hex_value(p[i + 1]) : -1;
+            int lo = hi >= 0 ? hex_value(p[i + 2]) : -1;
+            if (lo < 0) {
+                return -1;
+            }
+            c = (char) (hi << 4 | lo);
+            i += 2;
+        }
+        if (c == '\0' || n + 1 >= outcap) {
+            return -1;
+        }
+        if (c == '.' && (n == 0 || out[n - 1] == '/')) {
+            return -1;
+        }
+        if (c == '/' && (n == 0 || out[n - 1] == '/')) {
+            continue;           // collapse "//"
+        }
+        out[n++] = c;
+    }
+    if (n == 0 || out[n - 1] == '/') {
+        if (n + sizeof(index) > outcap) {
+            return -1;
+        }
+        memcpy(out + n, index, sizeof(index));
+        return 0;
+    }
+    out[n] = '\0';
+    return 0;
+}
+
+static void get_file(const struct http_parser *p, const char *data, struct http_reply *r) {
+    char path[PATH_MAX];
+    if (file_path(data + p->path.off, p->path.len, path, sizeof(path)) < 0) {
+        r->status = 404;
+        buf_append(r->body, "Not Found\n", 10);
+        return;
+    }
+    if (filecache_get(path, &r->file) < 0) {
+        switch (errno) {
+        case ENOENT:
+        case ENOTDIR:
+        case EISDIR:
+        case ENAMETOOLONG:
+        case EXDEV:             // resolves outside the root
+        case ELOOP:             // a symlink
+            r->status = 404;
+            buf_append(r->body, "Not Found\n", 10);
+            break;
+        case EACCES:
+        case EPERM:
+            r->status = 403;
+            buf_append(r->body, "Forbidden\n", 10);
+            break;
+        default:
+            r->status = 500;
+            buf_printf(r->body, "%s\n", strerror(errno));
+            break;
+        }
+        return;
+    }
+    r->type = content_type(path);
+    r->cacheable = r->file.version != 0 && r->file.size <= httpcache_max_entry();
+}
+
+static void route(struct session *s, const struct http_parser *p, const char *data,
+                  struct http_reply *r) {
+    const struct http_route *found = NULL;
+    for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+        if (http_slice_eq(data, p->path, routes[i].path, strlen(routes[i].path))) {
+            found = &routes[i];
+            break;
+        }
+    }
+    if (found == NULL && !serve_files) {
+        r->status = 404;
+        buf_append(r->body, "Not Found\n", 10);
+        return;
+    }
+    if (!http_slice_eq(data, p->method, "GET", 3) && !http_slice_eq(data, p->method, "HEAD", 4)) {
+        r->status = 405;
+        r->allow = "GET, HEAD";
+        buf_append(r->body, "Method Not Allowed\n", 19);
+        return;
+    }
+    if (found) {
+        found->handler(s, r);
+        r->cacheable = found->cacheable && r->status == 200;
+    } else {
+        get_file(p, data, r);
+    }
+}
+
+// The status line and the headers that are the same for every request,
+// without the terminating blank line.
+static void render_head(struct buf *b, const struct http_reply *r, size_t blen) {
+    char modified[48] = "";
+    if (r->file.file) {
+        struct tm tm;
+        time_t mtime = r->file.mtime;
+        gmtime_r(&mtime, &tm);
+        strftime(modified, sizeof(modified), "Last-Modified: %a, %d %b %Y %H:%M:%S GMT\r\n",
+                 &tm);
+    }
+    buf_printf(b,
+               "HTTP/1.1 %d %s\r\nServer: " HTTP_SERVER_NAME "\r\nContent-Type: %s\r\n"
+               "Content-Length: %zu\r\n%s%s%s%s",
+               r->status, status_reason(r->status), r->type, blen, modified,
+               r->allow ? "Allow: " : "", r->allow ? r->allow : "", r->allow ? "\r\n" : "");
+}
+
+// The per-request headers and the blank line.
+static void finish_head(struct buf *b, int minor, int keep_alive) {
+    buf_printf(b, "Date: %s\r\n%s\r\n", http_date(),
+               keep_alive ? (minor == 0 ? "Connection: keep-alive\r\n" : "")
+                          : "Connection: close\r\n");
+}
+
+// Releases what the reply holds once it has been sent or stored.
+static void reply_done(struct http_reply *r) {
+    buf_consume(r->body, buf_len(r->body));
+    rcfile_unref(r->file.file);
+    r->file.file = NULL;
+}
+
+// Appends the headers and (unless `head_only`) the body.
+static void respond(struct session *s, struct http_reply *r, int minor, int keep_alive,
+                    int head_only) {
+    size_t blen = r->file.file ? r->file.size : buf_len(r->body);
+    render_head(&s->out, r, blen);
+    finish_head(&s->out, minor, keep_alive);
+    if (!head_only && r->file.file) {
+        session_out_file(s, r->file.file, 0, blen);
+    } else if (!head_only) {
+        buf_append(&s->out, buf_head(r->body), blen);
+    }
+    reply_done(r);
+}
+
+static void respond_cached(struct session *s, const struct http_cached *c, int minor,
+                           int keep_alive, int head_only) {
+    session_out_ref_range(s, c->data, 0, c->head_len);
+    finish_head(&s->out, minor, keep_alive);
+    if (!head_only) {
+        session_out_ref_range(s, c->data, c->head_len, c->data->len - c->head_len);
+    }
+}
+
+// Renders the reply, body included, into one buffer for the cache. Returns
+// NULL if the file could not be read in full.
+static struct rcbuf *render_cached(const struct http_reply *r, size_t *head_len) {
+    size_t blen = r->file.file ? r->file.size : buf_len(r->body);
+    render_head(&head_scratch, r, blen);
+    *head_len = buf_len(&head_scratch);
+    struct rcbuf *rc = rcbuf_new(NULL, *head_len + blen);
+    memcpy(rc->data, buf_head(&head_scratch), *head_len);
+    buf_consume(&head_scratch, *head_len);
+    char *body = rc->data + *head_len;
+    if (r->file.file == NULL) {
+        memcpy(body, buf_head(r->body), blen);
+        return rc;
+    }
+    for (size_t done = 0; done < blen;) {
+        ssize_t n = pread(r->file.file->fd, body + done, blen - done, done);
+        if (n <= 0) {
+            rcbuf_unref(rc);
+            return NULL;
+        }
+        done += n;
+    }
+    return rc;
+}
+
+// The cache key: the method (HEAD shares GET's entry) and the target.
+static size_t cache_key(const struct http_parser *p, const char *data, char *key) {
+    if (p->target.len + 4 > HTTP_CACHE_KEY_MAX) {
+        return 0;
+    }
+    memcpy(key, "GET ", 4);
+    memcpy(key + 4, data + p->target.off, p->target.len);
+    return p->target.len + 4;
+}
+
+// A hit made from a file is current while the file cache holds that version.
+static int cached_current(const struct http_parser *p, const char *data,
+                          const struct http_cached *c) {
+    char path[PATH_MAX];
+    return c->tag == 0 ||
+           (file_path(data + p->path.off, p->path.len, path, sizeof(path)) == 0 &&
+            filecache_version(path) == c->tag);
+}
+
+// Answers one parsed request, from the response cache when possible.
+static void handle(struct session *s, const struct http_parser *p, const char *data) {
+    int head_only = http_slice_eq(data, p->method, "HEAD", 4);
+    int cache = httpcache_enabled() && (head_only || http_slice_eq(data, p->method, "GET", 3));
+    char key[HTTP_CACHE_KEY_MAX];
+    size_t klen = cache ? cache_key(p, data, key) : 0;
+    struct http_cached c;
+    if (klen > 0 && httpcache_get(key, klen, &c)) {
+        int current = cached_current(p, data, &c);
+        if (current) {
+            respond_cached(s, &c, p->minor, p->keep_alive, head_only);
+        }
+        rcbuf_unref(c.data);
+        if (current) {
+            return;
+        }
+    }
+
+    struct http_reply r = {.status = 200, .type = "text/plain", .body = &scratch};
+    route(s, p, data, &r);
+    if (klen > 0 && r.cacheable) {
+        c.data = render_cached(&r, &c.head_len);
+        if (c.data) {
+            httpcache_put(key, klen, c.data, c.head_len, r.file.version);
+            respond_cached(s, &c, p->minor, p->keep_alive, head_only);
+            rcbuf_unref(c.data);
+            reply_done(&r);
+            return;
+        }
+    }
+    respond(s, &r, p->minor, p->keep_alive, head_only);
+}
+
+static void http_init(const struct server_config *cfg) {
+    start_ms = now_ms();
+    httpcache_init(cfg->http_cache_size, cfg->http_cache_ttl_ms);
+    if (cfg->http_root[0]) {
+        filecache_init(cfg->http_root, cfg->http_file_cache);
+        serve_files = 1;
+    }
+}
+
+static void http_open(struct session *s) {
+    struct http_conn *conn = xmalloc(sizeof(*conn));
+    // The whole request has to fit in the input buffer.
+    size_t max_body = s->cfg->buf_large > HTTP_MAX_HEAD ? s->cfg->buf_large - HTTP_MAX_HEAD : 0;
+    http_parser_init(&conn->parser, max_body);
+    s->state = conn;
+}
+
+static size_t http_data(struct session *s, const char *data, size_t len) {
+    struct http_conn *conn = s->state;
+    struct http_parser *p = &conn->parser;
+    size_t used = 0;
+
+    scratch_register();
+    while (!s->closing) {
+        enum http_status st = http_parse(p, data + used, len - used);
+        if (st == HTTP_INCOMPLETE) {
+            break;
+        }
+        if (st == HTTP_ERROR) {
+            struct http_reply r = {.status = p->error_status, .type = "text/plain",
+                                   .body = &scratch};
+            buf_printf(r.body, "%s\n", p->error);
+            respond(s, &r, 1, 0, 0);
+            s->closing = 1;
+            return len;
+        }
+        if (s->draining) {
+            p->keep_alive = 0;  // the client should take its next request elsewhere
+        }
+        handle(s, p, data + used);
+        if (!p->keep_alive) {
+            s->closing = 1;
+        }
+        used += p->pos;
+        http_parser_reset(p);
+    }
+    return s->closing ? len : used;
+}
+
+static void http_close(struct session *s) {
+    free(s->state);
+}
+
+const struct protocol http_protocol = {
+    .name = "http",
+    .init = http_init,
+    .on_open = http_open,
+    .on_data = http_data,
+    .on_close = http_close,
+};
@@ -0,0 +1,150 @@
+#include "httpcache.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+#include "utils.h"
+
+struct entry {
+    struct entry *next;         // hash chain
+    struct entry *newer, *older;
+    uint64_t hash;
+    uint64_t expires_ms;
+    struct http_cached value;   // holds the cache's own reference
+    size_t klen;
+    char key[];
+};
+
+static struct {
+    size_t max_bytes;
+    uint64_t ttl_ms;
+
+    pthread_mutex_t lock;
+    struct entry **buckets;
+    size_t nbuckets;
+    size_t count;
+    size_t bytes;               // keys and responses held
+    struct entry *newest, *oldest;
+} cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static size_t entry_bytes(const struct entry *e) {
+    return sizeof(*e) + e->klen + sizeof(struct rcbuf) + e->value.data->len;
+}
+
+static struct entry **find(const char *key, size_t klen, uint64_t hash) {
+    struct entry **p = &cache.buckets[hash & (cache.nbuckets - 1)];
+    while (*p && !((*p)->hash == hash && (*p)->klen == klen && !memcmp((*p)->key, key, klen))) {
+        p = &(*p)->next;
+    }
+    return p;
+}
+
+static void lru_unlink(struct entry *e) {
+    *(e->newer ? &e->newer->older : &cache.newest) = e->older;
+    *(e->older ? &e->older->newer : &cache.oldest) = e->newer;
+}
+
+static void lru_push(struct entry *e) {
+    e->newer = NULL;
+    e->older = cache.newest;
+    *(cache.newest ? &cache.newest->newer : &cache.oldest) = e;
+    cache.newest = e;
+}
+
+static void entry_drop(struct entry **slot) {
+    struct entry *e = *slot;
+    *slot = e->next;
+    lru_unlink(e);
+    cache.bytes -= entry_bytes(e);
+    cache.count--;
+    rcbuf_unref(e->value.data);
+    free(e);
+}
+
+// Doubles the buckets once the chains average more than one entry.
+static void grow(void) {
+    size_t nbuckets = cache.nbuckets * 2;
+    struct entry **buckets = xcalloc(nbuckets, sizeof(*buckets));
+    for (size_t i = 0; i < cache.nbuckets; i++) {
+        struct entry *e = cache.buckets[i];
+        while (e) {
+            struct entry *next = e->next;
+            e->next = buckets[e->hash & (nbuckets - 1)];
+            buckets[e->hash & (nbuckets - 1)] = e;
+            e = next;
+        }
+    }
+    free(cache.buckets);
+    cache.buckets = buckets;
+    cache.nbuckets = nbuckets;
+}
+
+void httpcache_init(size_t max_bytes, int ttl_ms) {
+    cache.max_bytes = max_bytes;
+    cache.ttl_ms = ttl_ms;
+    cache.nbuckets = 64;
+    cache.buckets = xcalloc(cache.nbuckets, sizeof(*cache.buckets));
+}
+
+int httpcache_enabled(void) {
+    return cache.max_bytes > 0;
+}
+
+size_t httpcache_max_entry(void) {
+    return cache.max_bytes / 16;
+}
+
+int httpcache_get(const char *key, size_t klen, struct http_cached *out) {
+    uint64_t hash = kv_hash(key, klen);
+    uint64_t now = now_ms();
+    pthread_mutex_lock(&cache.lock);
+    struct entry **slot = find(key, klen, hash);
+    struct entry *e = *slot;
+    if (e && now >= e->expires_ms) {
+        entry_drop(slot);
+        e = NULL;
+    }
+    if (e) {
+        lru_unlink(e);
+        lru_push(e);
+        *out = e->value;
+        rcbuf_ref(out->data);
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return e != NULL;
+}
+
+void httpcache_put(const char *key, size_t klen, struct rcbuf *data, size_t head_len,
+                   uint64_t tag) {
+    struct entry *e = xmalloc(sizeof(*e) + klen);
+    e->hash = kv_hash(key, klen);
+    e->expires_ms = now_ms() + cache.ttl_ms;
+    e->value.data = rcbuf_ref(data);
+    e->value.head_len = head_len;
+    e->value.tag = tag;
+    e->klen = klen;
+    memcpy(e->key, key, klen);
+
+    pthread_mutex_lock(&cache.lock);
+    struct entry **slot = find(key, klen, e->hash);
+    if (*slot) {
+        entry_drop(slot);       // leaves the rest of the chain in *slot
+    }
+    e->next = *slot;
+    *slot = e;
+    lru_push(e);
+    cache.count++;
+    cache.bytes += entry_bytes(e);
+    while (cache.bytes > cache.max_bytes) {
+        struct entry *old = cache.oldest;
+        entry_drop(find(old->key, old->klen, old->hash));
+    }
+    if (cache.count > cache.nbuckets) {
+        grow();
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
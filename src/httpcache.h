@@ -0,0 +1,39 @@
+#ifndef HTTPCACHE_H
+#define HTTPCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rcbuf.h"
+
+// Complete HTTP responses kept ready to send, keyed by method and target.
+// An entry is one immutable buffer holding the rendered status line and
+// headers followed by the body; a hit queues it by reference, so no reply is
+// re-rendered or copied while the entry lives. Only the per-request headers
+// (Date, Connection) are written for each hit. Entries expire after a TTL,
+// and the least recently used ones are evicted to keep the total under a
+// byte limit. The cache is shared by all threads.
+
+struct http_cached {
+    struct rcbuf *data;         // the caller owns this reference
+    size_t head_len;            // headers, up to but excluding the blank line
+    uint64_t tag;               // as given to httpcache_put()
+};
+
+// A `max_bytes` of 0 disables the cache.
+void httpcache_init(size_t max_bytes, int ttl_ms);
+int httpcache_enabled(void);
+
+// Entries larger than this are not worth caching.
+size_t httpcache_max_entry(void);
+
+// Returns 1 and fills `out` if a live entry for `key` exists.
+int httpcache_get(const char *key, size_t klen, struct http_cached *out);
+
+// Stores `data` (taking a new reference) for `key`, replacing any entry there.
+// `tag` is opaque to the cache; the caller uses it to tell whether a hit is
+// still current, e.g. by comparing it with a file's version.
+void httpcache_put(const char *key, size_t klen, struct rcbuf *data, size_t head_len,
+                   uint64_t tag);
+
+#endif
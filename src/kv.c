@@ -0,0 +1,417 @@
+#include "kv.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "utils.h"
+
+#define GROUP_SIZE 16
+#define KV_INITIAL_CAPACITY 16
+// Groups of the old table migrated by every store operation during a rehash.
+#define REHASH_GROUPS_PER_OP 1
+
+// Control bytes: full slots hold H2 (0..127), so the sign bit marks free ones.
+#define CTRL_EMPTY ((int8_t) -128)
+#define CTRL_DELETED ((int8_t) -2)
+
+static inline uint64_t fold_mul(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t) a * b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+uint64_t kv_hash(const char *key, size_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ len;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, key, 8);
+        h = fold_mul(h ^ v, 0xbf58476d1ce4e5b9ull);
+        key += 8;
+        len -= 8;
+    }
+    uint64_t v = 0;
+    memcpy(&v, key, len);
+    h = fold_mul(h ^ v, 0x94d049bb133111ebull);
+    return fold_mul(h, 0x9e3779b97f4a7c15ull);
+}
+
+// The part of the hash that entries keep and the tables are indexed by.
+static inline uint64_t key_hash(const char *key, size_t len) {
+    return kv_hash(key, len) & ((1ull << KV_HASH_BITS) - 1);
+}
+
+static inline size_t h1(uint64_t hash) {
+    return hash >> 7;
+}
+
+static inline int8_t h2(uint64_t hash) {
+    return hash & 0x7f;
+}
+
+// Bitmasks over one group: bit i is set when slot i matches.
+#ifdef __SSE2__
+static inline unsigned group_match(const int8_t *g, int8_t h) {
+    __m128i ctrl = _mm_load_si128((const __m128i *) g);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h)));
+}
+
+static inline unsigned group_free(const int8_t *g) {
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i *) g));
+}
+#else
+static inline unsigned group_match(const int8_t *g, int8_t h) {
+    unsigned mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        mask |= (unsigned) (g[i] == h) << i;
+    }
+    return mask;
+}
+
+static inline unsigned group_free(const int8_t *g) {
+    unsigned mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        mask |= (unsigned) (g[i] < 0) << i;
+    }
+    return mask;
+}
+#endif
+
+static inline unsigned group_empty(const int8_t *g) {
+    return group_match(g, CTRL_EMPTY);
+}
+
+static void alloc_table(struct kv_table *t, size_t capacity) {
+    t->capacity = capacity;
+    t->ctrl = aligned_alloc(GROUP_SIZE, capacity);
+    if (t->ctrl == NULL) {
+        die("out of memory allocating %zu control bytes", capacity);
+    }
+    memset(t->ctrl, CTRL_EMPTY, capacity);
+    t->slots = xcalloc(capacity, sizeof(*t->slots));
+    t->count = 0;
+    t->tombstones = 0;
+}
+
+static int is_foreign(const struct kv_store *st, const void *p) {
+    return (const char *) p >= st->foreign && (const char *) p < st->foreign + st->foreign_len;
+}
+
+static void free_table(const struct kv_store *st, struct kv_table *t) {
+    if (!is_foreign(st, t->ctrl)) {
+        free(t->ctrl);
+        free(t->slots);
+    }
+    memset(t, 0, sizeof(*t));
+}
+
+void kv_store_init(struct kv_store *st) {
+    memset(st, 0, sizeof(*st));
+    alloc_table(&st->cur, KV_INITIAL_CAPACITY);
+}
+
+static void entry_free(struct kv_store *st, struct kv_entry *e) {
+    st->entry_bytes -= kv_entry_size(e);
+    rcbuf_unref(e->big);
+    if (!is_foreign(st, e)) {
+        free(e);
+    }
+}
+
+static void free_entries(struct kv_store *st, struct kv_table *t) {
+    for (size_t i = 0; i < t->capacity; i++) {
+        if (t->ctrl[i] >= 0) {
+            entry_free(st, t->slots[i]);
+        }
+    }
+}
+
+void kv_store_free(struct kv_store *st) {
+    free_entries(st, &st->cur);
+    free_table(st, &st->cur);
+    if (st->rehashing) {
+        free_entries(st, &st->old);
+        free_table(st, &st->old);
+    }
+    memset(st, 0, sizeof(*st));
+}
+
+// Groups are visited with triangular probing, which covers every group of a
+// power-of-two table exactly once.
+#define FOR_EACH_PROBE_GROUP(t, hash, base)                                             \
+    for (size_t mask_ = (t)->capacity / GROUP_SIZE - 1, g_ = h1(hash) & mask_, step_ = 0, \
+                base = g_ * GROUP_SIZE;                                                  \
+         step_ <= mask_; step_++, g_ = (g_ + step_) & mask_, base = g_ * GROUP_SIZE)
+
+// Returns the slot index holding `key`, or -1.
+static ptrdiff_t find(const struct kv_table *t, const char *key, size_t klen, uint64_t hash) {
+    int8_t tag = h2(hash);
+    FOR_EACH_PROBE_GROUP(t, hash, base) {
+        const int8_t *g = t->ctrl + base;
+        for (unsigned m = group_match(g, tag); m; m &= m - 1) {
+            size_t i = base + __builtin_ctz(m);
+            const struct kv_entry *e = t->slots[i];
+            if (e->hash == hash && e->klen == klen && memcmp(e->data, key, klen) == 0) {
+                return i;
+            }
+        }
+        if (group_empty(g)) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// Returns the first empty or deleted slot on `hash`'s probe sequence.
+static size_t find_free(const struct kv_table *t, uint64_t hash) {
+    FOR_EACH_PROBE_GROUP(t, hash, base) {
+        unsigned m = group_free(t->ctrl + base);
+        if (m) {
+            return base + __builtin_ctz(m);
+        }
+    }
+    die("kv: hash table unexpectedly full");
+}
+
+static void place(struct kv_table *t, size_t i, struct kv_entry *e) {
+    if (t->ctrl[i] == CTRL_DELETED) {
+        t->tombstones--;
+    }
+    t->ctrl[i] = h2(e->hash);
+    t->slots[i] = e;
+    t->count++;
+}
+
+static void erase(struct kv_table *t, size_t i) {
+    t->slots[i] = NULL;
+    t->count--;
+    // Probes stop at a group with an empty slot, so no probe sequence passes
+    // through such a group and the slot can be reused as empty right away.
+    const int8_t *g = t->ctrl + (i & ~(size_t) (GROUP_SIZE - 1));
+    if (group_empty(g)) {
+        t->ctrl[i] = CTRL_EMPTY;
+    } else {
+        t->ctrl[i] = CTRL_DELETED;
+        t->tombstones++;
+    }
+}
+
+// Moves the next `groups` groups of the old table into the current one.
+static void rehash_step(struct kv_store *st, size_t groups) {
+    struct kv_table *old = &st->old;
+    size_t end = st->rehash_pos + groups * GROUP_SIZE;
+    if (end > old->capacity) {
+        end = old->capacity;
+    }
+    for (size_t i = st->rehash_pos; i < end; i++) {
+        if (old->ctrl[i] >= 0) {
+            struct kv_entry *e = old->slots[i];
+            place(&st->cur, find_free(&st->cur, e->hash), e);
+            // Later groups may still be probed through this one.
+            old->ctrl[i] = CTRL_DELETED;
+            old->count--;
+        }
+    }
+    st->rehash_pos = end;
+    if (end == old->capacity) {
+        free_table(st, old);
+        st->rehashing = 0;
+    }
+}
+
+// Keeps the load of the current table, tombstones included, at or below 7/8
+// by starting a rehash into a new table when needed. The new table is large
+// enough to take every remaining entry of the old one, plus the inserts that
+// can happen before the migration finishes.
+static void reserve_one(struct kv_store *st) {
+    struct kv_table *cur = &st->cur;
+    if ((cur->count + cur->tombstones + 1) * 8 <= cur->capacity * 7) {
+        return;
+    }
+    if (st->rehashing) {
+        // Only reachable with a pathological insert pattern; catch up first.
+        rehash_step(st, st->old.capacity / GROUP_SIZE);
+        if ((cur->count + cur->tombstones + 1) * 8 <= cur->capacity * 7) {
+            return;
+        }
+    }
+    // Mostly tombstones: rebuilding at the same size is enough.
+    size_t capacity = cur->capacity;
+    if ((cur->count + 1) * 16 > capacity * 7) {
+        capacity *= 2;
+    }
+    st->old = *cur;
+    st->rehash_pos = 0;
+    st->rehashing = 1;
+    alloc_table(cur, capacity);
+}
+
+// Locates `key` in either table; returns NULL if absent.
+static struct kv_table *locate(struct kv_store *st, const char *key, size_t klen, uint64_t hash,
+                               ptrdiff_t *slot) {
+    if (st->rehashing) {
+        rehash_step(st, REHASH_GROUPS_PER_OP);
+    }
+    *slot = find(&st->cur, key, klen, hash);
+    if (*slot >= 0) {
+        return &st->cur;
+    }
+    if (st->rehashing) {
+        *slot = find(&st->old, key, klen, hash);
+        if (*slot >= 0) {
+            return &st->old;
+        }
+    }
+    return NULL;
+}
+
+struct kv_entry *kv_lookup(struct kv_store *st, const char *key, size_t klen) {
+    ptrdiff_t i;
+    struct kv_table *t = locate(st, key, klen, key_hash(key, klen), &i);
+    return t ? t->slots[i] : NULL;
+}
+
+static struct kv_entry *entry_new(uint64_t hash, const char *key, size_t klen,
+                                  const char *value, size_t vlen) {
+    int inline_value = vlen <= KV_INLINE_VALUE_MAX;
+    struct kv_entry *e = xmalloc(sizeof(*e) + klen + (inline_value ? vlen : 0));
+    e->hash = hash;
+    e->access = 0;
+    e->expire_at = 0;
+    e->klen = klen;
+    e->vlen = vlen;
+    memcpy(e->data, key, klen);
+    if (inline_value) {
+        e->big = NULL;
+        memcpy(e->data + klen, value, vlen);
+    } else {
+        e->big = rcbuf_new(value, vlen);
+    }
+    return e;
+}
+
+struct kv_entry *kv_set(struct kv_store *st, const char *key, size_t klen, const char *value,
+                        size_t vlen) {
+    uint64_t hash = key_hash(key, klen);
+    ptrdiff_t i;
+    struct kv_table *t = locate(st, key, klen, hash, &i);
+    if (t) {
+        struct kv_entry *old = t->slots[i];
+        if (old->big == NULL && vlen <= old->vlen) {
+            // Fits in place: no allocation for same-size overwrites.
+            memcpy(old->data + klen, value, vlen);
+            st->entry_bytes -= old->vlen - vlen;
+            old->vlen = vlen;
+            return old;
+        }
+        struct kv_entry *e = entry_new(hash, key, klen, value, vlen);
+        e->expire_at = old->expire_at;
+        e->access = old->access;
+        t->slots[i] = e;
+        entry_free(st, old);
+        st->entry_bytes += kv_entry_size(e);
+        return e;
+    }
+
+    reserve_one(st);
+    struct kv_entry *e = entry_new(hash, key, klen, value, vlen);
+    place(&st->cur, find_free(&st->cur, hash), e);
+    st->entry_bytes += kv_entry_size(e);
+    return e;
+}
+
+int kv_delete(struct kv_store *st, const char *key, size_t klen) {
+    ptrdiff_t i;
+    struct kv_table *t = locate(st, key, klen, key_hash(key, klen), &i);
+    if (t == NULL) {
+        return 0;
+    }
+    entry_free(st, t->slots[i]);
+    erase(t, i);
+    return 1;
+}
+
+struct kv_entry *kv_next(const struct kv_store *st, size_t *pos) {
+    for (;;) {
+        size_t i = *pos;
+        const struct kv_table *t = &st->cur;
+        if (i >= t->capacity) {
+            i -= t->capacity;
+            t = &st->old;
+            if (!st->rehashing || i >= t->capacity) {
+                return NULL;
+            }
+        }
+        (*pos)++;
+        if (t->ctrl[i] >= 0) {
+            return t->slots[i];
+        }
+    }
+}
+
+struct kv_entry *kv_slot(const struct kv_store *st, size_t pos) {
+    const struct kv_table *t = &st->cur;
+    if (pos >= t->capacity) {
+        pos -= t->capacity;
+        t = &st->old;
+    }
+    return t->ctrl[pos] >= 0 ? t->slots[pos] : NULL;
+}
+
+int kv_rehash_for(struct kv_store *st, uint64_t budget_ns) {
+    uint64_t deadline = now_ns() + budget_ns;
+    while (st->rehashing) {
+        rehash_step(st, 64);
+        if (now_ns() >= deadline) {
+            break;
+        }
+    }
+    return st->rehashing;
+}
+
+// Room for `count` entries at the load a grown table starts out with.
+size_t kv_table_capacity(size_t count) {
+    size_t capacity = KV_INITIAL_CAPACITY;
+    while ((count + 1) * 16 > capacity * 7) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+void kv_table_alloc(struct kv_table *t, size_t capacity) {
+    alloc_table(t, capacity);
+}
+
+void kv_table_free(struct kv_table *t) {
+    free(t->ctrl);
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+void kv_table_add(struct kv_table *t, uint64_t hash, struct kv_entry *e) {
+    size_t i = find_free(t, hash);
+    t->ctrl[i] = h2(hash);
+    t->slots[i] = e;
+    t->count++;
+}
+
+void kv_store_set_foreign(struct kv_store *st, const void *base, size_t len) {
+    st->foreign = base;
+    st->foreign_len = len;
+}
+
+void kv_store_adopt(struct kv_store *st, const struct kv_table *t, size_t entry_bytes) {
+    free_table(st, &st->cur);
+    st->cur = *t;
+    st->entry_bytes = entry_bytes;
+}
+
+void kv_store_add(struct kv_store *st, struct kv_entry *e) {
+    if (st->rehashing) {
+        rehash_step(st, REHASH_GROUPS_PER_OP);
+    }
+    reserve_one(st);
+    place(&st->cur, find_free(&st->cur, e->hash), e);
+    st->entry_bytes += kv_entry_size(e);
+}
@@ -0,0 +1,133 @@
+#ifndef KV_H
+#define KV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rcbuf.h"
+
+// The key-value store behind `--mode kv`: a Swiss-table style open-addressing
+// hash table. A byte of control metadata per slot (empty, deleted, or the low
+// 7 bits of the hash) is kept in a separate array and probed 16 slots at a
+// time with SSE2, so a lookup usually touches one control group, one slot and
+// the entry itself. Each entry is a single allocation holding the key and,
+// when short, the value. It is not thread-safe; the command layer serializes
+// access.
+//
+// Resizing is incremental: a grown table is allocated next to the old one and
+// entries migrate a group at a time on every operation and from
+// kv_rehash_for() while the server is idle, so no single call pays for
+// moving the whole keyspace.
+
+#define KV_INLINE_VALUE_MAX 256
+// Bits of the key hash stored in an entry; enough to index 2^37 slots.
+#define KV_HASH_BITS 40
+
+struct kv_entry {
+    uint64_t hash : KV_HASH_BITS;
+    uint64_t access : 64 - KV_HASH_BITS;    // for eviction, see evict.h; 0 = new
+    int64_t expire_at;          // absolute Unix time in ms, 0 = persistent
+    uint32_t klen;
+    uint32_t vlen;
+    struct rcbuf *big;          // value when longer than KV_INLINE_VALUE_MAX
+    char data[];                // key, followed by the value if inline
+};
+
+struct kv_table {
+    int8_t *ctrl;               // one control byte per slot
+    struct kv_entry **slots;
+    size_t capacity;            // power of two, multiple of the group size
+    size_t count;
+    size_t tombstones;
+};
+
+struct kv_store {
+    struct kv_table cur;        // receives all inserts
+    struct kv_table old;        // being drained into `cur` while rehashing
+    size_t rehash_pos;          // next slot of `old` to migrate
+    int rehashing;
+    size_t entry_bytes;         // kv_entry_size() of all entries
+    // Entries and tables inside this range (a mapped snapshot) were not
+    // allocated by the store and are never freed by it.
+    const char *foreign;
+    size_t foreign_len;
+};
+
+static inline size_t kv_count(const struct kv_store *st) {
+    return st->cur.count + st->old.count;
+}
+
+static inline const char *kv_key(const struct kv_entry *e) {
+    return e->data;
+}
+
+static inline const char *kv_value(const struct kv_entry *e) {
+    return e->big ? e->big->data : e->data + e->klen;
+}
+
+// Memory an entry accounts for, including a separately allocated value.
+static inline size_t kv_entry_size(const struct kv_entry *e) {
+    return sizeof(*e) + e->klen + e->vlen + (e->big ? sizeof(*e->big) : 0);
+}
+
+// Memory held by the store: its entries and hash tables, not counting
+// allocator overhead.
+static inline size_t kv_memory(const struct kv_store *st) {
+    size_t slots = st->cur.capacity + (st->rehashing ? st->old.capacity : 0);
+    return st->entry_bytes + slots * (1 + sizeof(*st->cur.slots));
+}
+
+uint64_t kv_hash(const char *key, size_t len);
+
+void kv_store_init(struct kv_store *st);
+void kv_store_free(struct kv_store *st);
+
+// Returns the entry for `key` or NULL. Neither expiry nor access is tracked
+// here.
+struct kv_entry *kv_lookup(struct kv_store *st, const char *key, size_t klen);
+
+// Inserts or overwrites `key` and returns its (possibly reallocated) entry;
+// previously returned pointers to that entry are invalid afterwards. The
+// TTL and access metadata of an existing entry are kept.
+struct kv_entry *kv_set(struct kv_store *st, const char *key, size_t klen, const char *value,
+                        size_t vlen);
+
+// Removes `key`; returns 1 if it existed.
+int kv_delete(struct kv_store *st, const char *key, size_t klen);
+
+// Iterates over all entries: start with *pos = 0 and call until it returns
+// NULL. The store must not be modified in between.
+struct kv_entry *kv_next(const struct kv_store *st, size_t *pos);
+
+// Slots are numbered as for kv_next(); kv_slot() returns the entry in one, or
+// NULL if it is free. Picking random slots until one is full gives every
+// entry the same chance, unlike taking the entry after a random slot.
+static inline size_t kv_slots(const struct kv_store *st) {
+    return st->cur.capacity + (st->rehashing ? st->old.capacity : 0);
+}
+struct kv_entry *kv_slot(const struct kv_store *st, size_t pos);
+
+// Migrates entries for up to `budget_ns`. Returns 1 while a rehash is still
+// in progress.
+int kv_rehash_for(struct kv_store *st, uint64_t budget_ns);
+
+// Table images, for snapshots that are mapped and used in place. The writer
+// sizes a table with kv_table_capacity(), fills it with kv_table_add() and
+// writes out the arrays; the loader points a kv_table at the mapped arrays
+// and hands it to kv_store_adopt().
+size_t kv_table_capacity(size_t count);
+void kv_table_alloc(struct kv_table *t, size_t capacity);
+void kv_table_free(struct kv_table *t);
+// Places `e` by `hash` without dereferencing it, so it may be an address
+// that is only valid once the image is mapped.
+void kv_table_add(struct kv_table *t, uint64_t hash, struct kv_entry *e);
+
+// Marks [base, base + len) as memory the store must not free.
+void kv_store_set_foreign(struct kv_store *st, const void *base, size_t len);
+// Replaces the table of a store that is still empty with `t`, whose entries
+// add up to `entry_bytes`.
+void kv_store_adopt(struct kv_store *st, const struct kv_table *t, size_t entry_bytes);
+// Inserts an existing entry whose key is not in the store yet.
+void kv_store_add(struct kv_store *st, struct kv_entry *e);
+
+#endif
@@ -0,0 +1,1598 @@
+// `--mode kv`: a Redis-compatible subset (GET, SET, DEL, INCR, MGET, MSET,
+// EXPIRE, PEXPIREAT, TTL, PING, DBSIZE, BGREWRITEAOF, SAVE, BGSAVE, LASTSAVE,
+// SUBSCRIBE, UNSUBSCRIBE, PUBLISH, QUIT) over RESP.
+//
+// Under the epoll engine the keyspace is shared-nothing: every reactor owns
+// the shard of keys whose hash maps to it and is the only thread to touch
+// it, so there are no locks. A command for a key owned elsewhere is packed
+// into a batch for the owning reactor and posted to its inbox; the owner runs
+// it and posts the replies back. Multi-key commands are split per key and
+// their partial replies merged. Replies that arrive out of order wait in
+// per-client slots so a pipeline is still answered in order. The blocking
+// engines have no reactors and share a single shard under a lock.
+//
+// Every command already complete in the input is executed in one pass and
+// all replies are queued before anything is written, so a pipelined batch
+// goes out in one gathered write. Large values are queued by reference
+// instead of being copied into the output buffer.
+//
+// With --appendonly every mutation is also recorded in a canonical single-key
+// form (SET ... PXAT, PEXPIREAT, DEL, INCR) in the shard's log buffer, which
+// goes to the AOF writer once per pass. Under "appendfsync always" replies are
+// held in their slots until the fsync covering that pass has completed.
+// BGREWRITEAOF, or the log outgrowing --auto-aof-rewrite-percentage, forks a
+// child that writes the keyspace as one SET per key while the live log keeps
+// going; see aof.h. SAVE and BGSAVE write a binary snapshot (snapshot.h),
+// which is loaded at startup when there is no append-only file.
+//
+// Keys with a TTL are removed when a command finds them expired and, under
+// the epoll engine, by an active cycle in the idle hook that samples keys and
+// works harder while many of them turn out to be expired.
+//
+// With --maxmemory each shard may hold its share of the limit; a command that
+// can add data first evicts sampled keys until the shard is under it again
+// (evict.h), or is refused under noeviction.
+//
+// Pub/sub needs the epoll engine. Each reactor registers its own clients'
+// subscriptions (pubsub.h). PUBLISH encodes the message once into an rcbuf,
+// queues that same buffer on every local subscriber's output and posts a
+// reference to every other reactor, which does the same for its subscribers
+// and reports back how many it reached.
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aof.h"
+#include "engine.h"
+#include "evict.h"
+#include "kv.h"
+#include "protocol.h"
+#include "pubsub.h"
+#include "resp.h"
+#include "snapshot.h"
+#include "utils.h"
+
+// How the partial replies of a split command are combined.
+enum kv_merge {
+    MERGE_NONE,     // single part, passed through
+    MERGE_SUM,      // integers added up (DEL)
+    MERGE_ARRAY,    // concatenated under one array header (MGET)
+    MERGE_OK,       // +OK unless a part failed (MSET)
+};
+
+// One command's place in a client's reply order.
+struct kv_slot {
+    struct kv_slot *next;
+    enum kv_merge merge;
+    int nparts;
+    int pending;            // parts still being executed
+    uint64_t durable_at;    // AOF offset that must be synced before sending
+    struct buf parts[];
+};
+
+struct kv_client {
+    struct resp_parser parser;
+    struct session *session;    // NULL once the connection has closed
+    int refs;                   // the session plus batches in flight
+    int quit;                   // close after the queued replies
+    struct kv_slot *head, *tail;
+    struct kv_batch **building; // per target shard, filled during on_data
+    int waiting;                // on its shard's list, blocked on an fsync
+    struct kv_client *wait_prev, *wait_next;
+    struct pubsub_sub **subs;   // only pub/sub commands are accepted while any
+    int nsubs, subs_cap;
+};
+
+// Commands forwarded to one shard. The owner appends each part's reply to
+// `replies` and posts the batch back to `origin`.
+struct kv_batch {
+    struct reactor_msg msg;
+    struct kv_client *client;
+    int origin;
+    int nparts, parts_cap;
+    struct kv_part {
+        struct kv_slot *slot;
+        int index;
+    } *parts;
+    struct buf args;        // per part: argc, then each argument as length + bytes
+    struct buf replies;     // per part: length + reply
+    uint64_t durable_at;    // AOF offset of the owner's records for it
+};
+
+// A PUBLISH for another reactor's subscribers: carries a reference to the
+// encoded message there and the number of subscribers it reached back.
+struct kv_publish {
+    struct reactor_msg msg;
+    struct rcbuf *message;
+    const char *channel;    // inside `message`
+    size_t clen;
+    struct kv_client *client;
+    struct kv_slot *slot;
+    int index;
+    int origin;
+    size_t reached;
+};
+
+struct kv_shard {
+    struct kv_store store;
+    atomic_size_t count;    // published after each pass, for DBSIZE elsewhere
+    struct buf log;         // AOF records of the current pass
+    uint64_t flushed;       // offset covering the records handed over this pass
+    struct kv_client *waiters;      // clients whose next reply awaits an fsync
+    struct reactor_msg synced_msg;  // posted by the AOF writer
+    atomic_int synced_posted;
+    uint64_t rng;           // for sampling keys
+    struct pubsub pubsub;   // subscriptions of this reactor's clients
+} __attribute__((aligned(64)));
+
+// Arguments of the command being executed, resolved against the input.
+struct kv_cmd {
+    struct kv_store *db;
+    struct kv_client *client;   // NULL for forwarded and replayed commands
+    struct session *session;    // NULL when large values must be copied
+    struct buf *out;
+    struct buf *log;            // NULL unless mutations are being logged
+    int argc;
+    const char **argv;
+    size_t *argl;
+    int quit;
+};
+
+struct kv_command {
+    const char *name;
+    int arity;                  // exact argc, or -N for "at least N"
+    void (*proc)(struct kv_cmd *c);
+    int has_key;            // argv[1] is a key
+    int key_step;           // multi-key: argv[1..] are groups of key_step
+    enum kv_merge merge;    // multi-key: how per-group `part` replies combine
+    const char *part;
+    int grows;              // may add data: evicts first, refused under noeviction
+};
+
+// Background work slice per idle callback; short enough not to delay events.
+#define KV_IDLE_BUDGET_NS 100000
+// The idle callback runs at least this often, so keys expire on a quiet server.
+#define KV_IDLE_TICK_MS 100
+// Active expiry: keys with a TTL looked at per round, random slots probed at
+// most to find them, the share of expired ones above which more rounds
+// follow, and the rounds that share is measured over at least.
+#define KV_EXPIRE_SAMPLE 20
+#define KV_EXPIRE_TRIES 400
+#define KV_EXPIRE_STALE_PCT 10
+#define KV_EXPIRE_MIN_ROUNDS 4
+
+static struct kv_shard *shards;
+static int nshards;
+// Set for engines without reactors: shard 0 is shared under store_lock.
+static int shared_store;
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct kv_store **shard_stores;     // &shards[i].store, for snapshots
+static const char *snapshot_path;
+static int aof_enabled;
+// appendfsync always: under the epoll engine replies wait in their slots,
+// the blocking engines simply wait for the fsync before answering.
+static int hold_replies;
+static int wait_for_sync;
+static enum maxmemory_policy evict_policy;
+static int evict_samples;
+static size_t shard_maxmemory;          // 0 = unlimited
+
+static const char err_not_int[] = "ERR value is not an integer or out of range";
+static const char err_syntax[] = "ERR syntax error";
+static const char err_fork_busy[] = "ERR another reactor is forking, try again";
+static const char err_oom[] = "OOM command not allowed when used memory > 'maxmemory'.";
+
+static struct kv_shard *cmd_shard(const struct kv_cmd *c) {
+    return (struct kv_shard *) ((char *) c->db - offsetof(struct kv_shard, store));
+}
+
+static void encode_command(struct buf *log, int argc, const char *const *argv,
+                           const size_t *argl) {
+    resp_add_array(log, argc);
+    for (int i = 0; i < argc; i++) {
+        resp_add_bulk(log, argv[i], argl[i]);
+    }
+}
+
+// SET key value [PXAT ms]: replays to the same state whenever it is read.
+static void encode_set(struct buf *log, const char *key, size_t klen, const char *value,
+                       size_t vlen, int64_t expire_at) {
+    char ts[24];
+    const char *argv[] = {"SET", key, value, "PXAT", ts};
+    size_t argl[] = {3, klen, vlen, 4, 0};
+    if (expire_at != 0) {
+        argl[4] = snprintf(ts, sizeof(ts), "%lld", (long long) expire_at);
+    }
+    encode_command(log, expire_at != 0 ? 5 : 3, argv, argl);
+}
+
+// Records a mutation for the append-only file.
+static void propagate(struct kv_cmd *c, int argc, const char *const *argv, const size_t *argl) {
+    if (c->log) {
+        encode_command(c->log, argc, argv, argl);
+    }
+}
+
+static void propagate_del(struct kv_cmd *c, const char *key, size_t klen) {
+    const char *argv[] = {"DEL", key};
+    size_t argl[] = {3, klen};
+    propagate(c, 2, argv, argl);
+}
+
+static void propagate_set(struct kv_cmd *c, const char *key, size_t klen, const char *value,
+                          size_t vlen, int64_t expire_at) {
+    if (c->log) {
+        encode_set(c->log, key, klen, value, vlen, expire_at);
+    }
+}
+
+static void touch(struct kv_cmd *c, struct kv_entry *e) {
+    evict_touch(e, evict_policy, &cmd_shard(c)->rng);
+}
+
+// Looks a key up, deleting it first if its TTL has passed.
+static struct kv_entry *lookup_live(struct kv_cmd *c, const char *key, size_t klen) {
+    struct kv_entry *e = kv_lookup(c->db, key, klen);
+    if (e && e->expire_at != 0 && e->expire_at <= unix_ms()) {
+        kv_delete(c->db, key, klen);
+        propagate_del(c, key, klen);
+        return NULL;
+    }
+    if (e) {
+        touch(c, e);
+    }
+    return e;
+}
+
+// kv_set() that also starts the access history of a new key.
+static struct kv_entry *store_value(struct kv_cmd *c, const char *key, size_t klen,
+                                    const char *value, size_t vlen) {
+    struct kv_entry *e = kv_set(c->db, key, klen, value, vlen);
+    if (e->access == 0) {
+        touch(c, e);
+    }
+    return e;
+}
+
+// Evicts keys until the shard is within its share of --maxmemory. Fails under
+// noeviction, or when the policy finds nothing it may evict.
+static int make_room(struct kv_cmd *c) {
+    struct kv_shard *sh = cmd_shard(c);
+    while (kv_memory(c->db) > shard_maxmemory) {
+        if (evict_policy == MAXMEMORY_NOEVICTION) {
+            return -1;
+        }
+        struct kv_entry *e = evict_pick(c->db, evict_policy, evict_samples, &sh->rng);
+        if (e == NULL) {
+            return -1;
+        }
+        propagate_del(c, kv_key(e), e->klen);
+        kv_delete(c->db, kv_key(e), e->klen);
+    }
+    return 0;
+}
+
+// Large values live in their own rcbuf and are sent by reference.
+static void reply_value(struct kv_cmd *c, struct kv_entry *e) {
+    struct rcbuf *v = e->big;
+    if (v == NULL || c->session == NULL) {
+        resp_add_bulk(c->out, kv_value(e), e->vlen);
+        return;
+    }
+    char hdr[24];
+    buf_append(c->out, hdr, snprintf(hdr, sizeof(hdr), "$%zu\r\n", v->len));
+    session_out_ref(c->session, v);
+    buf_append(c->out, "\r\n", 2);
+}
+
+static int parse_int64(const char *s, size_t len, int64_t *out) {
+    char tmp[32];
+    if (len == 0 || len >= sizeof(tmp)) {
+        return -1;
+    }
+    memcpy(tmp, s, len);
+    tmp[len] = '\0';
+    char *end;
+    errno = 0;
+    long long v = strtoll(tmp, &end, 10);
+    if (errno != 0 || *end != '\0' || isspace((unsigned char) tmp[0])) {
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+static void cmd_ping(struct kv_cmd *c) {
+    if (c->client && c->client->nsubs > 0) {
+        // A subscriber's replies are arrays, like the messages.
+        resp_add_array(c->out, 2);
+        resp_add_bulk(c->out, "pong", 4);
+        resp_add_bulk(c->out, c->argc > 1 ? c->argv[1] : "", c->argc > 1 ? c->argl[1] : 0);
+    } else if (c->argc > 1) {
+        resp_add_bulk(c->out, c->argv[1], c->argl[1]);
+    } else {
+        resp_add_simple(c->out, "PONG");
+    }
+}
+
+static void cmd_quit(struct kv_cmd *c) {
+    resp_add_simple(c->out, "OK");
+    c->quit = 1;
+}
+
+static void cmd_get(struct kv_cmd *c) {
+    struct kv_entry *e = lookup_live(c, c->argv[1], c->argl[1]);
+    if (e) {
+        reply_value(c, e);
+    } else {
+        resp_add_null(c->out);
+    }
+}
+
+// SET key value [EX seconds | PX milliseconds | EXAT unix-s | PXAT unix-ms] [NX | XX]
+static void cmd_set(struct kv_cmd *c) {
+    int64_t expire_at = 0;
+    int nx = 0, xx = 0;
+    for (int i = 3; i < c->argc; i++) {
+        const char *opt = c->argv[i];
+        size_t len = c->argl[i];
+        if (len == 2 && !strncasecmp(opt, "nx", 2)) {
+            nx = 1;
+        } else if (len == 2 && !strncasecmp(opt, "xx", 2)) {
+            xx = 1;
+        } else if ((len == 2 || len == 4) && i + 1 < c->argc &&
+                   (!strncasecmp(opt, "ex", len) || !strncasecmp(opt, "px", len) ||
+                    !strncasecmp(opt, "exat", len) || !strncasecmp(opt, "pxat", len))) {
+            int64_t v;
+            if (parse_int64(c->argv[i + 1], c->argl[i + 1], &v) < 0 || v <= 0 ||
+                v > INT64_MAX / 1000 / 2) {
+                resp_add_error(c->out, "ERR invalid expire time in 'set' command");
+                return;
+            }
+            if (tolower((unsigned char) opt[0]) == 'e') {
+                v *= 1000;
+            }
+            expire_at = len == 4 ? v : unix_ms() + v;
+            i++;
+        } else {
+            resp_add_error(c->out, err_syntax);
+            return;
+        }
+    }
+    if (nx && xx) {
+        resp_add_error(c->out, err_syntax);
+        return;
+    }
+
+    struct kv_entry *e = lookup_live(c, c->argv[1], c->argl[1]);
+    if ((nx && e) || (xx && !e)) {
+        resp_add_null(c->out);
+        return;
+    }
+    e = store_value(c, c->argv[1], c->argl[1], c->argv[2], c->argl[2]);
+    e->expire_at = expire_at;
+    propagate_set(c, c->argv[1], c->argl[1], c->argv[2], c->argl[2], expire_at);
+    resp_add_simple(c->out, "OK");
+}
+
+static void cmd_del(struct kv_cmd *c) {
+    int64_t n = 0;
+    for (int i = 1; i < c->argc; i++) {
+        if (lookup_live(c, c->argv[i], c->argl[i])) {
+            n += kv_delete(c->db, c->argv[i], c->argl[i]);
+            propagate_del(c, c->argv[i], c->argl[i]);
+        }
+    }
+    resp_add_int(c->out, n);
+}
+
+static void cmd_incr(struct kv_cmd *c) {
+    struct kv_entry *e = lookup_live(c, c->argv[1], c->argl[1]);
+    int64_t v = 0;
+    if (e && parse_int64(kv_value(e), e->vlen, &v) < 0) {
+        resp_add_error(c->out, err_not_int);
+        return;
+    }
+    if (v == INT64_MAX) {
+        resp_add_error(c->out, "ERR increment or decrement would overflow");
+        return;
+    }
+    v++;
+    char tmp[24];
+    int n = snprintf(tmp, sizeof(tmp), "%lld", (long long) v);
+    store_value(c, c->argv[1], c->argl[1], tmp, n);
+    propagate(c, c->argc, c->argv, c->argl);
+    resp_add_int(c->out, v);
+}
+
+static void cmd_mget(struct kv_cmd *c) {
+    resp_add_array(c->out, c->argc - 1);
+    for (int i = 1; i < c->argc; i++) {
+        struct kv_entry *e = lookup_live(c, c->argv[i], c->argl[i]);
+        if (e) {
+            reply_value(c, e);
+        } else {
+            resp_add_null(c->out);
+        }
+    }
+}
+
+static void cmd_mset(struct kv_cmd *c) {
+    if (c->argc % 2 != 1) {
+        resp_add_error(c->out, "ERR wrong number of arguments for 'mset' command");
+        return;
+    }
+    for (int i = 1; i < c->argc; i += 2) {
+        struct kv_entry *e = store_value(c, c->argv[i], c->argl[i], c->argv[i + 1],
+                                         c->argl[i + 1]);
+        e->expire_at = 0;
+        propagate_set(c, c->argv[i], c->argl[i], c->argv[i + 1], c->argl[i + 1], 0);
+    }
+    resp_add_simple(c->out, "OK");
+}
+
+// Shared by EXPIRE and PEXPIREAT; logged as the latter.
+static void expire_key_at(struct kv_cmd *c, int64_t when) {
+    struct kv_entry *e = lookup_live(c, c->argv[1], c->argl[1]);
+    if (e == NULL) {
+        resp_add_int(c->out, 0);
+        return;
+    }
+    if (when <= unix_ms()) {
+        kv_delete(c->db, c->argv[1], c->argl[1]);
+        propagate_del(c, c->argv[1], c->argl[1]);
+    } else {
+        e->expire_at = when;
+        char ts[24];
+        const char *argv[] = {"PEXPIREAT", c->argv[1], ts};
+        size_t argl[] = {9, c->argl[1], snprintf(ts, sizeof(ts), "%lld", (long long) when)};
+        propagate(c, 3, argv, argl);
+    }
+    resp_add_int(c->out, 1);
+}
+
+static void cmd_expire(struct kv_cmd *c) {
+    int64_t secs;
+    if (parse_int64(c->argv[2], c->argl[2], &secs) < 0 || secs > INT64_MAX / 1000 / 2 ||
+        secs < INT64_MIN / 1000 / 2) {
+        resp_add_error(c->out, err_not_int);
+        return;
+    }
+    expire_key_at(c, secs <= 0 ? 0 : unix_ms() + secs * 1000);
+}
+
+static void cmd_pexpireat(struct kv_cmd *c) {
+    int64_t when;
+    if (parse_int64(c->argv[2], c->argl[2], &when) < 0) {
+        resp_add_error(c->out, err_not_int);
+        return;
+    }
+    expire_key_at(c, when);
+}
+
+static void cmd_ttl(struct kv_cmd *c) {
+    struct kv_entry *e = lookup_live(c, c->argv[1], c->argl[1]);
+    if (e == NULL) {
+        resp_add_int(c->out, -2);
+    } else if (e->expire_at == 0) {
+        resp_add_int(c->out, -1);
+    } else {
+        resp_add_int(c->out, (e->expire_at - unix_ms() + 500) / 1000);
+    }
+}
+
+static int start_rewrite(struct kv_shard *sh);
+static int save_snapshot(int background);
+
+static void cmd_bgrewriteaof(struct kv_cmd *c) {
+    struct kv_shard *sh = cmd_shard(c);
+    if (!aof_enabled) {
+        resp_add_error(c->out, "ERR append only file is disabled");
+    } else if (start_rewrite(sh) < 0) {
+        resp_add_error(c->out, errno == EBUSY    ? "ERR Background append only file rewriting "
+                                                   "already in progress"
+                               : errno == EAGAIN ? err_fork_busy
+                                                 : "ERR Background append only file rewriting "
+                                                   "failed to start");
+    } else {
+        resp_add_simple(c->out, "Background append only file rewriting started");
+    }
+}
+
+static void cmd_save(struct kv_cmd *c) {
+    if (snapshot_in_progress()) {
+        resp_add_error(c->out, "ERR Background save already in progress");
+    } else if (save_snapshot(0) < 0) {
+        resp_add_error(c->out, errno == EAGAIN ? err_fork_busy : "ERR failed to save the snapshot");
+    } else {
+        resp_add_simple(c->out, "OK");
+    }
+}
+
+static void cmd_bgsave(struct kv_cmd *c) {
+    if (save_snapshot(1) < 0) {
+        resp_add_error(c->out, errno == EBUSY    ? "ERR Background save already in progress"
+                               : errno == EAGAIN ? err_fork_busy
+                                                 : "ERR Background save failed to start");
+    } else {
+        resp_add_simple(c->out, "Background saving started");
+    }
+}
+
+static void cmd_lastsave(struct kv_cmd *c) {
+    resp_add_int(c->out, snapshot_last_save());
+}
+
+static struct rcbuf *message_new(const char *channel, size_t clen, const char *msg,
+                                 size_t mlen, size_t *channel_off);
+static size_t publish_local(struct kv_shard *sh, struct rcbuf *message, const char *channel,
+                            size_t clen);
+
+static void reply_subscription(struct buf *out, const char *kind, const char *channel,
+                               size_t clen, int count) {
+    resp_add_array(out, 3);
+    resp_add_bulk(out, kind, strlen(kind));
+    if (channel) {
+        resp_add_bulk(out, channel, clen);
+    } else {
+        resp_add_null(out);
+    }
+    resp_add_int(out, count);
+}
+
+static int find_subscription(const struct kv_client *cl, const char *channel, size_t clen) {
+    for (int i = 0; i < cl->nsubs; i++) {
+        const struct pubsub_channel *ch = cl->subs[i]->channel;
+        if (ch->len == clen && !memcmp(ch->name, channel, clen)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void cmd_subscribe(struct kv_cmd *c) {
+    struct kv_client *cl = c->client;
+    if (shared_store || cl == NULL) {
+        resp_add_error(c->out, "ERR SUBSCRIBE needs the epoll engine");
+        return;
+    }
+    struct kv_shard *sh = cmd_shard(c);
+    for (int i = 1; i < c->argc; i++) {
+        if (find_subscription(cl, c->argv[i], c->argl[i]) < 0) {
+            if (cl->nsubs == cl->subs_cap) {
+                cl->subs_cap = cl->subs_cap ? cl->subs_cap * 2 : 4;
+                cl->subs = xrealloc(cl->subs, cl->subs_cap * sizeof(*cl->subs));
+            }
+            cl->subs[cl->nsubs++] = pubsub_add(&sh->pubsub, c->argv[i], c->argl[i], cl);
+        }
+        reply_subscription(c->out, "subscribe", c->argv[i], c->argl[i], cl->nsubs);
+    }
+}
+
+static void unsubscribe(struct kv_cmd *c, int index) {
+    struct kv_client *cl = c->client;
+    struct pubsub_sub *sub = cl->subs[index];
+    cl->subs[index] = cl->subs[--cl->nsubs];
+    reply_subscription(c->out, "unsubscribe", sub->channel->name, sub->channel->len, cl->nsubs);
+    pubsub_remove(&cmd_shard(c)->pubsub, sub);
+}
+
+// Without arguments, from every channel.
+static void cmd_unsubscribe(struct kv_cmd *c) {
+    struct kv_client *cl = c->client;
+    if (cl == NULL || cl->nsubs == 0) {
+        for (int i = 1; i < c->argc; i++) {
+            reply_subscription(c->out, "unsubscribe", c->argv[i], c->argl[i], 0);
+        }
+        if (c->argc == 1) {
+            reply_subscription(c->out, "unsubscribe", NULL, 0, 0);
+        }
+        return;
+    }
+    if (c->argc == 1) {
+        while (cl->nsubs > 0) {
+            unsubscribe(c, cl->nsubs - 1);
+        }
+        return;
+    }
+    for (int i = 1; i < c->argc; i++) {
+        int index = find_subscription(cl, c->argv[i], c->argl[i]);
+        if (index >= 0) {
+            unsubscribe(c, index);
+        } else {
+            reply_subscription(c->out, "unsubscribe", c->argv[i], c->argl[i], cl->nsubs);
+        }
+    }
+}
+
+// With several reactors, dispatch() runs PUBLISH through run_publish() to
+// reach the other reactors' subscribers; this only serves the local ones.
+static void cmd_publish(struct kv_cmd *c) {
+    size_t off;
+    struct rcbuf *message = message_new(c->argv[1], c->argl[1], c->argv[2], c->argl[2], &off);
+    resp_add_int(c->out, publish_local(cmd_shard(c), message, message->data + off, c->argl[1]));
+    rcbuf_unref(message);
+}
+
+// Other shards report their size as of their last pass.
+static void cmd_dbsize(struct kv_cmd *c) {
+    size_t n = 0;
+    for (int i = 0; i < nshards; i++) {
+        if (&shards[i].store == c->db) {
+            n += kv_count(c->db);
+        } else {
+            n += atomic_load_explicit(&shards[i].count, memory_order_relaxed);
+        }
+    }
+    resp_add_int(c->out, n);
+}
+
+static const struct kv_command commands[] = {
+    {"get", 2, cmd_get, 1, 0, MERGE_NONE, NULL, 0},
+    {"set", -3, cmd_set, 1, 0, MERGE_NONE, NULL, 1},
+    {"del", -2, cmd_del, 1, 1, MERGE_SUM, "del", 0},
+    {"incr", 2, cmd_incr, 1, 0, MERGE_NONE, NULL, 1},
+    {"mget", -2, cmd_mget, 1, 1, MERGE_ARRAY, "get", 0},
+    {"mset", -3, cmd_mset, 1, 2, MERGE_OK, "set", 1},
+    {"expire", 3, cmd_expire, 1, 0, MERGE_NONE, NULL, 0},
+    {"pexpireat", 3, cmd_pexpireat, 1, 0, MERGE_NONE, NULL, 0},
+    {"ttl", 2, cmd_ttl, 1, 0, MERGE_NONE, NULL, 0},
+    {"ping", -1, cmd_ping, 0, 0, MERGE_NONE, NULL, 0},
+    {"dbsize", 1, cmd_dbsize, 0, 0, MERGE_NONE, NULL, 0},
+    {"quit", 1, cmd_quit, 0, 0, MERGE_NONE, NULL, 0},
+    {"bgrewriteaof", 1, cmd_bgrewriteaof, 0, 0, MERGE_NONE, NULL, 0},
+    {"save", 1, cmd_save, 0, 0, MERGE_NONE, NULL, 0},
+    {"bgsave", 1, cmd_bgsave, 0, 0, MERGE_NONE, NULL, 0},
+    {"lastsave", 1, cmd_lastsave, 0, 0, MERGE_NONE, NULL, 0},
+    {"subscribe", -2, cmd_subscribe, 0, 0, MERGE_NONE, NULL, 0},
+    {"unsubscribe", -1, cmd_unsubscribe, 0, 0, MERGE_NONE, NULL, 0},
+    {"publish", 3, cmd_publish, 0, 0, MERGE_NONE, NULL, 0},
+};
+
+static const struct kv_command *lookup_command(const char *name, size_t len) {
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (strlen(commands[i].name) == len && !strncasecmp(commands[i].name, name, len)) {
+            return &commands[i];
+        }
+    }
+    return NULL;
+}
+
+static int arity_ok(const struct kv_command *cmd, int argc) {
+    return cmd->arity > 0 ? argc == cmd->arity : argc >= -cmd->arity;
+}
+
+// What a client may still send while it has subscriptions.
+static int subscriber_command(const struct kv_command *cmd) {
+    return cmd->proc == cmd_subscribe || cmd->proc == cmd_unsubscribe || cmd->proc == cmd_ping ||
+           cmd->proc == cmd_quit;
+}
+
+// Runs `cmd`, as returned by lookup_command(), against c->db.
+static void execute(struct kv_cmd *c, const struct kv_command *cmd) {
+    char msg[128];
+    if (cmd == NULL) {
+        snprintf(msg, sizeof(msg), "ERR unknown command '%.*s'",
+                 (int) (c->argl[0] < 64 ? c->argl[0] : 64), c->argv[0]);
+        resp_add_error(c->out, msg);
+        return;
+    }
+    if (!arity_ok(cmd, c->argc)) {
+        snprintf(msg, sizeof(msg), "ERR wrong number of arguments for '%s' command", cmd->name);
+        resp_add_error(c->out, msg);
+        return;
+    }
+    if (c->client && c->client->nsubs > 0 && !subscriber_command(cmd)) {
+        snprintf(msg, sizeof(msg),
+                 "ERR Can't execute '%s': only SUBSCRIBE / UNSUBSCRIBE / PING / QUIT are "
+                 "allowed in this context", cmd->name);
+        resp_add_error(c->out, msg);
+        return;
+    }
+    if (cmd->grows && shard_maxmemory && make_room(c) < 0) {
+        resp_add_error(c->out, err_oom);
+        return;
+    }
+    cmd->proc(c);
+}
+
+// Uses the upper half of the hash; the table indexes with the lower bits.
+static int shard_of(const char *key, size_t klen) {
+    return (uint32_t) (kv_hash(key, klen) >> 32) % nshards;
+}
+
+static void shard_publish(struct kv_shard *sh) {
+    atomic_store_explicit(&sh->count, kv_count(&sh->store), memory_order_relaxed);
+}
+
+static struct buf *shard_log(struct kv_shard *sh) {
+    return aof_enabled ? &sh->log : NULL;
+}
+
+// Hands the pass's records to the AOF writer; returns the offset that covers
+// everything handed over since sh->flushed was last reset, or 0 if nothing was.
+static uint64_t shard_flush_log(struct kv_shard *sh) {
+    size_t n = buf_len(&sh->log);
+    if (n > 0) {
+        sh->flushed = aof_append(buf_head(&sh->log), n);
+        buf_consume(&sh->log, n);
+    }
+    return sh->flushed;
+}
+
+// Runs in the rewrite child: the state as SET [PXAT] records, one per live key.
+static int dump_aof(int fd) {
+    struct buf out;
+    buf_init(&out, 0);
+    int64_t now = unix_ms();
+    for (int i = 0; i < nshards; i++) {
+        size_t pos = 0;
+        struct kv_entry *e;
+        while ((e = kv_next(&shards[i].store, &pos))) {
+            if (e->expire_at != 0 && e->expire_at <= now) {
+                continue;
+            }
+            encode_set(&out, kv_key(e), e->klen, kv_value(e), e->vlen,
+                       e->expire_at);
+            if (buf_len(&out) >= 64 * 1024) {
+                if (write_all(fd, buf_head(&out), buf_len(&out)) < 0) {
+                    return -1;
+                }
+                buf_consume(&out, buf_len(&out));
+            }
+        }
+    }
+    return write_all(fd, buf_head(&out), buf_len(&out));
+}
+
+// Brings every other shard to a pass boundary, for a fork or a foreground
+// save: the other reactors are parked between passes, and the blocking
+// engines are already held off by store_lock, which the caller owns. Fails
+// with EAGAIN while another reactor has them parked.
+static int freeze_others(void) {
+    if (!shared_store && reactor_pause_others() < 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+static void thaw_others(void) {
+    int err = errno;
+    if (!shared_store) {
+        reactor_resume_others();
+    }
+    errno = err;
+}
+
+// The caller's records so far go to the old log before the fork; the other
+// shards' logs are empty between passes.
+static int start_rewrite(struct kv_shard *sh) {
+    shard_flush_log(sh);
+    if (freeze_others() < 0) {
+        return -1;
+    }
+    int rc = aof_rewrite_start(dump_aof);
+    thaw_others();
+    return rc;
+}
+
+static int save_snapshot(int background) {
+    if (freeze_others() < 0) {
+        return -1;
+    }
+    int rc = background ? snapshot_bgsave(snapshot_path, shard_stores, nshards)
+                        : snapshot_save(snapshot_path, shard_stores, nshards);
+    if (rc < 0 && errno != EBUSY) {
+        perror(snapshot_path);
+    }
+    thaw_others();
+    return rc;
+}
+
+static void put_u32(struct buf *b, uint32_t v) {
+    buf_append(b, &v, sizeof(v));
+}
+
+static uint32_t get_u32(const char **p) {
+    uint32_t v;
+    memcpy(&v, *p, sizeof(v));
+    *p += sizeof(v);
+    return v;
+}
+
+static struct kv_slot *slot_new(struct kv_client *cl, int nparts, enum kv_merge merge) {
+    struct kv_slot *slot = xmalloc(sizeof(*slot) + nparts * sizeof(slot->parts[0]));
+    slot->next = NULL;
+    slot->merge = merge;
+    slot->nparts = slot->pending = nparts;
+    slot->durable_at = 0;
+    for (int i = 0; i < nparts; i++) {
+        buf_init(&slot->parts[i], 0);
+    }
+    if (cl->tail) {
+        cl->tail->next = slot;
+    } else {
+        cl->head = slot;
+    }
+    cl->tail = slot;
+    return slot;
+}
+
+static void slot_free(struct kv_slot *slot) {
+    for (int i = 0; i < slot->nparts; i++) {
+        buf_free(&slot->parts[i]);
+    }
+    free(slot);
+}
+
+static void slot_merge(struct kv_slot *slot, struct buf *out) {
+    int64_t sum = 0;
+    const struct buf *failed = NULL;
+    for (int i = 0; i < slot->nparts && slot->merge != MERGE_ARRAY; i++) {
+        const struct buf *part = &slot->parts[i];
+        if (buf_len(part) > 0 && buf_head(part)[0] == '-') {
+            failed = failed ? failed : part;
+        } else if (slot->merge == MERGE_SUM) {
+            sum += strtoll(buf_head(part) + 1, NULL, 10);
+        }
+    }
+    if (failed && slot->merge != MERGE_NONE) {
+        buf_append(out, buf_head(failed), buf_len(failed));
+        return;
+    }
+    switch (slot->merge) {
+    case MERGE_SUM:
+        resp_add_int(out, sum);
+        return;
+    case MERGE_OK:
+        resp_add_simple(out, "OK");
+        return;
+    case MERGE_ARRAY:
+        resp_add_array(out, slot->nparts);
+        break;
+    case MERGE_NONE:
+        break;
+    }
+    for (int i = 0; i < slot->nparts; i++) {
+        buf_append(out, buf_head(&slot->parts[i]), buf_len(&slot->parts[i]));
+    }
+}
+
+static void waiter_add(struct kv_shard *sh, struct kv_client *cl) {
+    cl->waiting = 1;
+    cl->wait_prev = NULL;
+    cl->wait_next = sh->waiters;
+    if (sh->waiters) {
+        sh->waiters->wait_prev = cl;
+    }
+    sh->waiters = cl;
+}
+
+static void waiter_remove(struct kv_shard *sh, struct kv_client *cl) {
+    if (cl->wait_prev) {
+        cl->wait_prev->wait_next = cl->wait_next;
+    } else {
+        sh->waiters = cl->wait_next;
+    }
+    if (cl->wait_next) {
+        cl->wait_next->wait_prev = cl->wait_prev;
+    }
+    cl->waiting = 0;
+}
+
+// Moves every reply at the front of the order that is complete (and durable,
+// if it has to be) to the session, and starts closing once a QUIT has been
+// reached. A client held back only by the AOF waits on its shard's list.
+static void drain_slots(struct kv_client *cl, struct session *s) {
+    uint64_t synced = hold_replies ? aof_synced() : 0;
+    while (cl->head && cl->head->pending == 0) {
+        if (cl->head->durable_at > synced) {
+            if (!cl->waiting) {
+                waiter_add(&shards[reactor_self], cl);
+            }
+            return;
+        }
+        struct kv_slot *slot = cl->head;
+        slot_merge(slot, &s->out);
+        cl->head = slot->next;
+        if (cl->head == NULL) {
+            cl->tail = NULL;
+        }
+        slot_free(slot);
+    }
+    if (cl->head == NULL && cl->quit) {
+        s->closing = 1;
+    }
+}
+
+static void client_free(struct kv_client *cl) {
+    while (cl->head) {
+        struct kv_slot *next = cl->head->next;
+        slot_free(cl->head);
+        cl->head = next;
+    }
+    free(cl->building);
+    free(cl->subs);
+    free(cl);
+}
+
+// Queues one part for the shard that owns it; batches go out after the pass.
+static void forward(struct kv_client *cl, int target, struct kv_slot *slot, int index,
+                    int argc, const char **argv, const size_t *argl) {
+    struct kv_batch *b = cl->building[target];
+    if (b == NULL) {
+        b = xcalloc(1, sizeof(*b));
+        b->client = cl;
+        b->origin = reactor_self;
+        buf_init(&b->args, 0);
+        buf_init(&b->replies, 0);
+        cl->building[target] = b;
+    }
+    if (b->nparts == b->parts_cap) {
+        b->parts_cap = b->parts_cap ? b->parts_cap * 2 : 8;
+        b->parts = xrealloc(b->parts, b->parts_cap * sizeof(*b->parts));
+    }
+    b->parts[b->nparts].slot = slot;
+    b->parts[b->nparts].index = index;
+    b->nparts++;
+    put_u32(&b->args, argc);
+    for (int i = 0; i < argc; i++) {
+        put_u32(&b->args, argl[i]);
+        buf_append(&b->args, argv[i], argl[i]);
+    }
+}
+
+static void batch_done(struct reactor_msg *msg);
+
+// Back on the client's reactor after work posted elsewhere has filled in
+// its replies.
+static void reply_arrived(struct kv_client *cl) {
+    cl->refs--;
+    struct session *s = cl->session;
+    if (s == NULL) {
+        if (cl->refs == 0) {
+            client_free(cl);
+        }
+        return;
+    }
+    s->async_pending--;
+    drain_slots(cl, s);
+    s->wake(s);
+}
+
+// Runs on the owning reactor.
+static void batch_run(struct reactor_msg *msg) {
+    struct kv_batch *b = (struct kv_batch *) msg;
+    struct kv_shard *sh = &shards[reactor_self];
+    const char *argv_small[16];
+    size_t argl_small[16];
+    const char *p = buf_head(&b->args);
+
+    sh->flushed = 0;
+    for (int i = 0; i < b->nparts; i++) {
+        int argc = get_u32(&p);
+        const char **argv = argv_small;
+        size_t *argl = argl_small;
+        if (argc > 16) {
+            argv = xmalloc(argc * sizeof(*argv));
+            argl = xmalloc(argc * sizeof(*argl));
+        }
+        for (int j = 0; j < argc; j++) {
+            argl[j] = get_u32(&p);
+            argv[j] = p;
+            p += argl[j];
+        }
+        size_t at = buf_len(&b->replies);
+        put_u32(&b->replies, 0);
+        struct kv_cmd c = {
+            .db = &sh->store,
+            .out = &b->replies,
+            .log = shard_log(sh),
+            .argc = argc,
+            .argv = argv,
+            .argl = argl,
+        };
+        execute(&c, lookup_command(argv[0], argl[0]));
+        uint32_t n = buf_len(&b->replies) - at - sizeof(n);
+        memcpy(buf_head(&b->replies) + at, &n, sizeof(n));
+        if (argv != argv_small) {
+            free(argv);
+            free(argl);
+        }
+    }
+    shard_publish(sh);
+    uint64_t durable = shard_flush_log(sh);
+    b->durable_at = hold_replies ? durable : 0;
+    b->msg.handler = batch_done;
+    reactor_post(b->origin, &b->msg);
+}
+
+// Back on the client's reactor: files the replies into their slots.
+static void batch_done(struct reactor_msg *msg) {
+    struct kv_batch *b = (struct kv_batch *) msg;
+    struct kv_client *cl = b->client;
+    const char *p = buf_head(&b->replies);
+    for (int i = 0; i < b->nparts; i++) {
+        uint32_t n = get_u32(&p);
+        struct kv_slot *slot = b->parts[i].slot;
+        buf_append(&slot->parts[b->parts[i].index], p, n);
+        slot->pending--;
+        if (b->durable_at > slot->durable_at) {
+            slot->durable_at = b->durable_at;
+        }
+        p += n;
+    }
+    free(b->parts);
+    buf_free(&b->args);
+    buf_free(&b->replies);
+    free(b);
+    reply_arrived(cl);
+}
+
+static void post_batches(struct kv_client *cl, struct session *s) {
+    for (int i = 0; i < nshards; i++) {
+        struct kv_batch *b = cl->building[i];
+        if (b) {
+            cl->building[i] = NULL;
+            cl->refs++;
+            s->async_pending++;
+            b->msg.handler = batch_run;
+            reactor_post(i, &b->msg);
+        }
+    }
+}
+
+// `message` framed as the RESP push a subscriber receives. Built once per
+// PUBLISH; every subscriber's output references it.
+static struct rcbuf *message_new(const char *channel, size_t clen, const char *msg,
+                                 size_t mlen, size_t *channel_off) {
+    char head[48], mid[24];
+    int nhead = snprintf(head, sizeof(head), "*3\r\n$7\r\nmessage\r\n$%zu\r\n", clen);
+    int nmid = snprintf(mid, sizeof(mid), "\r\n$%zu\r\n", mlen);
+    struct rcbuf *rc = rcbuf_new(NULL, nhead + clen + nmid + mlen + 2);
+    char *p = rc->data;
+    memcpy(p, head, nhead);
+    memcpy(p += nhead, channel, clen);
+    memcpy(p += clen, mid, nmid);
+    memcpy(p += nmid, msg, mlen);
+    memcpy(p + mlen, "\r\n", 2);
+    *channel_off = nhead;
+    return rc;
+}
+
+// Queues a message on one subscriber. Like Redis's pubsub output buffer
+// limit, a subscriber that has fallen --buffer-sizes behind is disconnected
+// rather than buffered for without bound.
+static void deliver(struct pubsub_sub *sub, void *arg) {
+    struct kv_client *cl = sub->client;
+    struct rcbuf *message = arg;
+    struct session *s = cl->session;
+    if (s->closing) {
+        return;
+    }
+    if (session_out_len(s) > s->cfg->buf_large) {
+        s->closing = 1;
+    } else if (cl->head) {
+        // Replies still outstanding go first; this rare case pays for a copy.
+        struct kv_slot *slot = slot_new(cl, 1, MERGE_NONE);
+        slot->pending = 0;
+        buf_append(&slot->parts[0], message->data, message->len);
+        return;
+    } else {
+        session_out_ref(s, message);
+    }
+    s->wake(s);
+}
+
+static size_t publish_local(struct kv_shard *sh, struct rcbuf *message, const char *channel,
+                            size_t clen) {
+    return pubsub_each(&sh->pubsub, channel, clen, deliver, message);
+}
+
+static void publish_done(struct reactor_msg *msg);
+
+// Runs on each other reactor.
+static void publish_run(struct reactor_msg *msg) {
+    struct kv_publish *p = (struct kv_publish *) msg;
+    p->reached = publish_local(&shards[reactor_self], p->message, p->channel, p->clen);
+    rcbuf_unref(p->message);
+    p->msg.handler = publish_done;
+    reactor_post(p->origin, &p->msg);
+}
+
+static void publish_done(struct reactor_msg *msg) {
+    struct kv_publish *p = (struct kv_publish *) msg;
+    struct kv_client *cl = p->client;
+    resp_add_int(&p->slot->parts[p->index], p->reached);
+    p->slot->pending--;
+    free(p);
+    reply_arrived(cl);
+}
+
+// PUBLISH across reactors: the reply adds up the subscribers each reached.
+static void run_publish(struct kv_client *cl, struct session *s, struct kv_shard *sh,
+                        const char **argv, const size_t *argl) {
+    size_t off;
+    struct rcbuf *message = message_new(argv[1], argl[1], argv[2], argl[2], &off);
+    struct kv_slot *slot = slot_new(cl, nshards, MERGE_SUM);
+    for (int i = 0; i < nshards; i++) {
+        if (&shards[i] == sh) {
+            resp_add_int(&slot->parts[i], publish_local(sh, message, message->data + off,
+                                                        argl[1]));
+            slot->pending--;
+            continue;
+        }
+        struct kv_publish *p = xmalloc(sizeof(*p));
+        p->msg.handler = publish_run;
+        p->message = rcbuf_ref(message);
+        p->channel = message->data + off;
+        p->clen = argl[1];
+        p->client = cl;
+        p->slot = slot;
+        p->index = i;
+        p->origin = reactor_self;
+        cl->refs++;
+        s->async_pending++;
+        reactor_post(i, &p->msg);
+    }
+    rcbuf_unref(message);
+}
+
+// Runs a command against the local shard. Its reply goes straight to the
+// session unless earlier replies are still outstanding.
+static void run_local(struct kv_client *cl, struct session *s, struct kv_shard *sh,
+                      const struct kv_command *cmd, int argc, const char **argv, size_t *argl) {
+    struct kv_cmd c = {
+        .db = &sh->store,
+        .client = cl,
+        .session = s,
+        .out = &s->out,
+        .log = shard_log(sh),
+        .argc = argc,
+        .argv = argv,
+        .argl = argl,
+    };
+    if (cl->head || hold_replies) {
+        struct kv_slot *slot = slot_new(cl, 1, MERGE_NONE);
+        slot->pending = 0;
+        c.session = NULL;
+        c.out = &slot->parts[0];
+    }
+    execute(&c, cmd);
+    if (c.quit) {
+        cl->quit = 1;
+    }
+}
+
+// Splits a multi-key command into one `part` command per key group, runs the
+// local ones and forwards the rest. Unlike Redis, a split MSET is not atomic.
+static void run_split(struct kv_client *cl, struct kv_shard *sh, const struct kv_command *cmd,
+                      int argc, const char **argv, const size_t *argl) {
+    const struct kv_command *part = lookup_command(cmd->part, strlen(cmd->part));
+    int step = cmd->key_step;
+    int ngroups = (argc - 1) / step;
+    struct kv_slot *slot = slot_new(cl, ngroups, cmd->merge);
+    const char *pargv[3] = {part->name};
+    size_t pargl[3] = {strlen(part->name)};
+
+    for (int k = 0; k < ngroups; k++) {
+        for (int j = 0; j < step; j++) {
+            pargv[1 + j] = argv[1 + k * step + j];
+            pargl[1 + j] = argl[1 + k * step + j];
+        }
+        int owner = shard_of(pargv[1], pargl[1]);
+        if (&shards[owner] == sh) {
+            struct kv_cmd c = {
+                .db = &sh->store,
+                .out = &slot->parts[k],
+                .log = shard_log(sh),
+                .argc = 1 + step,
+                .argv = pargv,
+                .argl = pargl,
+            };
+            execute(&c, part);
+            slot->pending--;
+        } else {
+            forward(cl, owner, slot, k, 1 + step, pargv, pargl);
+        }
+    }
+}
+
+static void dispatch(struct kv_client *cl, struct session *s, struct kv_shard *sh,
+                     int argc, const char **argv, size_t *argl) {
+    const struct kv_command *cmd = lookup_command(argv[0], argl[0]);
+    // Malformed commands run locally, where they are reported; so does
+    // anything a subscriber sends.
+    if (nshards > 1 && cmd && cl->nsubs == 0 && cmd->proc == cmd_publish &&
+        arity_ok(cmd, argc)) {
+        run_publish(cl, s, sh, argv, argl);
+        return;
+    }
+    if (nshards > 1 && cmd && cl->nsubs == 0 && cmd->has_key && arity_ok(cmd, argc)) {
+        if (cmd->key_step == 0) {
+            int owner = shard_of(argv[1], argl[1]);
+            if (&shards[owner] != sh) {
+                forward(cl, owner, slot_new(cl, 1, MERGE_NONE), 0, argc, argv, argl);
+                return;
+            }
+        } else if ((argc - 1) % cmd->key_step == 0) {
+            for (int i = 1; i < argc; i += cmd->key_step) {
+                if (&shards[shard_of(argv[i], argl[i])] != sh) {
+                    run_split(cl, sh, cmd, argc, argv, argl);
+                    return;
+                }
+            }
+        }
+    }
+    run_local(cl, s, sh, cmd, argc, argv, argl);
+}
+
+// Runs on a reactor after the AOF writer has synced more of the log.
+static void shard_synced(struct reactor_msg *msg) {
+    struct kv_shard *sh = (struct kv_shard *) ((char *) msg - offsetof(struct kv_shard, synced_msg));
+    atomic_store_explicit(&sh->synced_posted, 0, memory_order_relaxed);
+    struct kv_client *cl = sh->waiters;
+    sh->waiters = NULL;
+    while (cl) {
+        struct kv_client *next = cl->wait_next;
+        cl->waiting = 0;
+        drain_slots(cl, cl->session);
+        cl->session->wake(cl->session);
+        cl = next;
+    }
+}
+
+// Called on the AOF writer thread.
+static void notify_synced(void) {
+    for (int i = 0; i < nshards; i++) {
+        if (!atomic_exchange_explicit(&shards[i].synced_posted, 1, memory_order_acq_rel)) {
+            reactor_post(i, &shards[i].synced_msg);
+        }
+    }
+}
+
+// Applies one logged command to the shard(s) owning its keys; commands
+// without keys have no effect on the keyspace and are skipped.
+static void replay(int argc, const char **argv, size_t *argl, struct buf *scratch) {
+    const struct kv_command *cmd = lookup_command(argv[0], argl[0]);
+    if (cmd == NULL || !cmd->has_key || !arity_ok(cmd, argc)) {
+        return;
+    }
+    struct kv_cmd c = {.out = scratch, .argc = argc, .argv = argv, .argl = argl};
+    if (cmd->key_step == 0) {
+        c.db = &shards[shard_of(argv[1], argl[1])].store;
+        execute(&c, cmd);
+        return;
+    }
+    const struct kv_command *part = lookup_command(cmd->part, strlen(cmd->part));
+    const char *pargv[3] = {part->name};
+    size_t pargl[3] = {strlen(part->name)};
+    for (int i = 1; i + cmd->key_step <= argc; i += cmd->key_step) {
+        memcpy(pargv + 1, argv + i, cmd->key_step * sizeof(*argv));
+        memcpy(pargl + 1, argl + i, cmd->key_step * sizeof(*argl));
+        c.db = &shards[shard_of(argv[i], argl[i])].store;
+        c.argc = 1 + cmd->key_step;
+        c.argv = pargv;
+        c.argl = pargl;
+        execute(&c, part);
+    }
+}
+
+static struct kv_store *store_for(const char *key, size_t klen) {
+    return &shards[shard_of(key, klen)].store;
+}
+
+// Rebuilds the keyspace from the append-only file. A command cut short by a
+// crash is dropped, and the file truncated to the last complete one so that
+// new records do not follow garbage.
+static void load_aof(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return;
+        }
+        perror_die(path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror_die(path);
+    }
+    size_t len = st.st_size;
+    if (len == 0) {
+        close(fd);
+        return;
+    }
+    const char *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror_die(path);
+    }
+    close(fd);
+    madvise((void *) data, len, MADV_SEQUENTIAL);
+
+    struct resp_parser p;
+    resp_parser_init(&p);
+    struct buf scratch;
+    buf_init(&scratch, 0);
+    const char **argv = NULL;
+    size_t *argl = NULL;
+    int argv_cap = 0;
+    size_t used = 0;
+    long ncmds = 0;
+    uint64_t start = now_ms();
+    while (used < len) {
+        enum resp_status rs = resp_parse(&p, data + used, len - used);
+        if (rs == RESP_INCOMPLETE) {
+            break;
+        }
+        if (rs == RESP_ERROR) {
+            die("%s: corrupt command at offset %zu: %s", path, used, p.error);
+        }
+        if (p.argc > argv_cap) {
+            argv_cap = p.argc;
+            argv = xrealloc(argv, argv_cap * sizeof(*argv));
+            argl = xrealloc(argl, argv_cap * sizeof(*argl));
+        }
+        for (int i = 0; i < p.argc; i++) {
+            argv[i] = data + used + p.argv[i].off;
+            argl[i] = p.argv[i].len;
+        }
+        if (p.argc > 0) {
+            replay(p.argc, argv, argl, &scratch);
+            buf_consume(&scratch, buf_len(&scratch));
+            ncmds++;
+        }
+        used += p.pos;
+        resp_parser_reset(&p);
+    }
+    free(argv);
+    free(argl);
+    buf_free(&scratch);
+    resp_parser_free(&p);
+    munmap((void *) data, len);
+
+    if (used < len) {
+        fprintf(stderr, "%s: dropping %zu bytes of a truncated command\n", path, len - used);
+        if (truncate(path, used) < 0) {
+            perror_die(path);
+        }
+    }
+    printf("Loaded %ld commands from %s in %llu ms\n", ncmds, path,
+           (unsigned long long) (now_ms() - start));
+}
+
+static void kv_init(const struct server_config *cfg) {
+    shared_store = cfg->engine != ENGINE_EPOLL;
+    nshards = shared_store ? 1 : cfg->workers;
+    shards = aligned_alloc(64, nshards * sizeof(*shards));
+    if (shards == NULL) {
+        die("out of memory");
+    }
+    for (int i = 0; i < nshards; i++) {
+        struct kv_shard *sh = &shards[i];
+        kv_store_init(&sh->store);
+        atomic_init(&sh->count, 0);
+        buf_init(&sh->log, 0);
+        sh->flushed = 0;
+        sh->waiters = NULL;
+        sh->rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        pubsub_init(&sh->pubsub);
+        sh->synced_msg.handler = shard_synced;
+        atomic_init(&sh->synced_posted, 0);
+    }
+
+    shard_stores = xmalloc(nshards * sizeof(*shard_stores));
+    for (int i = 0; i < nshards; i++) {
+        shard_stores[i] = &shards[i].store;
+    }
+    snapshot_path = cfg->snapshot_path;
+    evict_policy = cfg->maxmemory_policy;
+    evict_samples = cfg->maxmemory_samples;
+
+    // The log is more recent than any snapshot.
+    if (cfg->aof_path[0]) {
+        load_aof(cfg->aof_path);
+    } else {
+        snapshot_load(cfg->snapshot_path, shard_stores, nshards, store_for);
+    }
+    for (int i = 0; i < nshards; i++) {
+        shard_publish(&shards[i]);
+    }
+    // Not applied while loading; the first writes evict what is over.
+    shard_maxmemory = cfg->maxmemory / nshards;
+    if (cfg->maxmemory && shard_maxmemory == 0) {
+        shard_maxmemory = 1;
+    }
+    if (cfg->aof_path[0]) {
+        aof_enabled = 1;
+        hold_replies = cfg->aof_fsync == AOF_FSYNC_ALWAYS && !shared_store;
+        wait_for_sync = cfg->aof_fsync == AOF_FSYNC_ALWAYS && shared_store;
+        aof_start(cfg->aof_path, cfg->aof_fsync, hold_replies ? notify_synced : NULL);
+        aof_set_auto_rewrite(cfg->aof_rewrite_percent, cfg->aof_rewrite_min_size);
+    }
+}
+
+static void kv_open(struct session *s) {
+    struct kv_client *client = xcalloc(1, sizeof(*client));
+    resp_parser_init(&client->parser);
+    client->session = s;
+    client->refs = 1;
+    client->building = xcalloc(nshards, sizeof(*client->building));
+    s->state = client;
+}
+
+static size_t kv_data(struct session *s, const char *data, size_t len) {
+    struct kv_client *client = s->state;
+    struct resp_parser *p = &client->parser;
+    struct kv_shard *sh = &shards[shared_store ? 0 : reactor_self];
+    const char *argv_small[16];
+    size_t argl_small[16];
+    size_t used = 0;
+    int locked = 0;
+    struct kv_slot *mark = client->tail;
+    if (!shared_store) {
+        sh->flushed = 0;
+    }
+
+    while (!client->quit) {
+        enum resp_status st = resp_parse(p, data + used, len - used);
+        if (st == RESP_INCOMPLETE) {
+            break;
+        }
+        if (st == RESP_ERROR) {
+            struct buf *out = &s->out;
+            if (client->head || hold_replies) {
+                struct kv_slot *slot = slot_new(client, 1, MERGE_NONE);
+                slot->pending = 0;
+                out = &slot->parts[0];
+            }
+            resp_add_error(out, p->error);
+            client->quit = 1;
+            used = len;
+            break;
+        }
+        if (p->argc > 0) {
+            const char **argv = argv_small;
+            size_t *argl = argl_small;
+            if (p->argc > 16) {
+                argv = xmalloc(p->argc * sizeof(*argv));
+                argl = xmalloc(p->argc * sizeof(*argl));
+            }
+            for (int i = 0; i < p->argc; i++) {
+                argv[i] = data + used + p->argv[i].off;
+                argl[i] = p->argv[i].len;
+            }
+            if (shared_store && !locked) {
+                pthread_mutex_lock(&store_lock);
+                locked = 1;
+                sh->flushed = 0;
+            }
+            dispatch(client, s, sh, p->argc, argv, argl);
+            if (argv != argv_small) {
+                free(argv);
+                free(argl);
+            }
+        }
+        used += p->pos;
+        resp_parser_reset(p);
+    }
+    // Records reach the log in execution order: under the lock when shared.
+    uint64_t durable = 0;
+    if (locked || !shared_store) {
+        durable = shard_flush_log(sh);
+        if (aof_enabled && aof_rewrite_due() && start_rewrite(sh) < 0 && errno != EBUSY &&
+            errno != EAGAIN) {
+            perror("aof rewrite");
+        }
+    }
+    if (locked) {
+        pthread_mutex_unlock(&store_lock);
+    } else if (!shared_store) {
+        shard_publish(sh);
+    }
+    post_batches(client, s);
+    if (durable && hold_replies) {
+        for (struct kv_slot *slot = mark ? mark->next : client->head; slot; slot = slot->next) {
+            slot->durable_at = durable;
+        }
+    } else if (durable && wait_for_sync) {
+        aof_wait(durable);
+    }
+    drain_slots(client, s);
+    return used;
+}
+
+// Removes expired keys nobody asks for. Each round picks keys at random
+// until it has seen KV_EXPIRE_SAMPLE with a TTL and deletes the expired ones.
+// Once KV_EXPIRE_MIN_ROUNDS have run, the share of expired keys among all
+// those sampled decides: above KV_EXPIRE_STALE_PCT there are likely many
+// more, so rounds continue until the deadline. Returns 1 if that was still
+// the case when time ran out, asking to be called again as soon as the loop
+// has nothing else to do.
+static int expire_cycle(struct kv_shard *sh, uint64_t deadline) {
+    struct kv_store *st = &sh->store;
+    struct kv_cmd c = {.db = st, .log = shard_log(sh)};
+    int64_t now = unix_ms();
+    long sampled = 0, expired = 0;
+    int stale = 0;
+    for (int round = 1; kv_count(st) > 0; round++) {
+        int seen = 0;
+        for (int tries = 0; seen < KV_EXPIRE_SAMPLE && tries < KV_EXPIRE_TRIES; tries++) {
+            struct kv_entry *e = kv_slot(st, next_random(&sh->rng) % kv_slots(st));
+            if (e == NULL || e->expire_at == 0) {
+                continue;
+            }
+            seen++;
+            if (e->expire_at <= now) {
+                propagate_del(&c, kv_key(e), e->klen);
+                kv_delete(st, kv_key(e), e->klen);
+                expired++;
+            }
+        }
+        if (seen == 0) {
+            break;
+        }
+        sampled += seen;
+        stale = expired * 100 > sampled * KV_EXPIRE_STALE_PCT;
+        if ((round >= KV_EXPIRE_MIN_ROUNDS && !stale) || now_ns() >= deadline) {
+            break;
+        }
+    }
+    shard_flush_log(sh);
+    return stale;
+}
+
+static int kv_idle(void) {
+    if (shared_store) {
+        return 0;
+    }
+    struct kv_shard *sh = &shards[reactor_self];
+    uint64_t deadline = now_ns() + KV_IDLE_BUDGET_NS;
+    int pending = expire_cycle(sh, deadline);
+    if (sh->store.rehashing) {
+        uint64_t now = now_ns();
+        if (now < deadline) {
+            kv_rehash_for(&sh->store, deadline - now);
+        }
+        pending |= sh->store.rehashing;
+    }
+    shard_publish(sh);
+    return pending;
+}
+
+// Batches still in flight keep the client alive until they come back.
+static void kv_close(struct session *s) {
+    struct kv_client *client = s->state;
+    resp_parser_free(&client->parser);
+    client->session = NULL;
+    if (client->waiting) {
+        waiter_remove(&shards[reactor_self], client);
+    }
+    while (client->nsubs > 0) {
+        pubsub_remove(&shards[reactor_self].pubsub, client->subs[--client->nsubs]);
+    }
+    if (--client->refs == 0) {
+        client_free(client);
+    }
+}
+
+const struct protocol kv_protocol = {
+    .name = "kv",
+    .init = kv_init,
+    .on_open = kv_open,
+    .on_data = kv_data,
+    .on_close = kv_close,
+    .on_idle = kv_idle,
+    .idle_tick_ms = KV_IDLE_TICK_MS,
+};
@@ -1,6 +1,112 @@
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
-int main() {
-    printf("Hello, World!");
-    return 0;
+#include "config.h"
+#include "engine.h"
+#include "protocol.h"
+#include "upgrade.h"
+#include "utils.h"
+
+// The first SIGTERM drains (see engine_drain()); a second one stops waiting.
+static void on_sigterm(int sig) {
+    (void) sig;
+    if (engine_draining()) {
+        _exit(EXIT_FAILURE);
+    }
+    engine_drain();
+}
+
+int main(int argc, char **argv) {
+    // Static: detached threads may still use it while the process exits.
+    static struct server_config cfg;
+    config_parse(&cfg, argc, argv);
+
+    const struct protocol *proto = protocol_lookup(cfg.mode);
+    if (proto == NULL) {
+        die("unknown mode '%s'", cfg.mode);
+    }
+
+    setvbuf(stdout, NULL, _IONBF, 0);
+    if (cfg.upgrade_path[0]) {
+        int n = upgrade_takeover(cfg.upgrade_path);
+        if (n > 0) {
+            printf("Took over %d listening sockets from %s\n", n, cfg.upgrade_path);
+        }
+    }
+    if (proto->init) {
+        proto->init(&cfg);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    engine_drain_fd();          // created before the handler may need it
+    struct sigaction sa = {.sa_handler = on_sigterm, .sa_flags = SA_RESTART};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (cfg.transport == TRANSPORT_UDP && proto->on_datagram == NULL) {
+        die("mode '%s' does not support the udp transport", proto->name);
+    }
+
+    if (cfg.shm_path[0] && (cfg.transport != TRANSPORT_TCP || cfg.engine != ENGINE_EPOLL)) {
+        die("--shm is served by the epoll engine over the tcp transport only");
+    }
+    if (cfg.steer_cpu) {
+        // Worker i owns the i-th socket of each group and runs on cpus[i].
+        int ok = cfg.transport == TRANSPORT_TCP && cfg.engine == ENGINE_EPOLL && cfg.reuseport &&
+                 cfg.workers <= cfg.ncpus;
+        for (int i = 0; ok && i < cfg.workers; i++) {
+            for (int j = 0; j < i; j++) {
+                ok &= cfg.cpus[j] != cfg.cpus[i];
+            }
+        }
+        if (!ok) {
+            die("--steer-cpu needs the epoll engine over tcp with --reuseport, and --cpus "
+                "giving every worker a CPU of its own");
+        }
+    }
+    if (cfg.transport == TRANSPORT_UDP && cfg.nports == 0) {
+        die("the udp transport needs at least one port");
+    }
+
+    printf("Serving '%s' with the %s engine on", proto->name,
+           cfg.transport == TRANSPORT_UDP ? "datagram" : engine_name(cfg.engine));
+    for (int i = 0; i < cfg.nports; i++) {
+        if (i == 0) {
+            printf(" %s port %d", transport_name(cfg.transport), cfg.ports[i]);
+        } else {
+            printf(",%d", cfg.ports[i]);
+        }
+    }
+    if (cfg.transport != TRANSPORT_UDP) {
+        for (int i = 0; i < cfg.nunix; i++) {
+            printf(" %s:%s", cfg.unix_listeners[i].seqpacket ? "unix-seqpacket" : "unix",
+                   cfg.unix_listeners[i].path);
+        }
+    }
+    if (cfg.shm_path[0]) {
+        printf(" shm:%s", cfg.shm_path);
+    }
+    printf("\n");
+
+    int rc;
+    if (cfg.transport == TRANSPORT_UDP) {
+        return engine_udp_run(&cfg, proto) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    switch (cfg.engine) {
+    case ENGINE_SEQUENTIAL:
+        rc = engine_sequential_run(&cfg, proto);
+        break;
+    case ENGINE_THREADS:
+        rc = engine_threads_run(&cfg, proto);
+        break;
+    case ENGINE_EPOLL:
+    default:
+        rc = engine_epoll_run(&cfg, proto);
+        break;
+    }
+    if (rc == 0) {
+        engine_drain_report(&cfg, 1);
+    }
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,419 @@
+#include "net.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/filter.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+// Every listening or bound socket this process serves, for net_listeners(),
+// and those handed over by a previous process that no listener claimed yet.
+static struct {
+    pthread_mutex_t lock;
+    int fds[NET_MAX_SOCKETS];
+    int nfds;
+    int inherited[NET_MAX_SOCKETS];
+    int ninherited;
+} sockets = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void remember(int fd) {
+    pthread_mutex_lock(&sockets.lock);
+    if (sockets.nfds < NET_MAX_SOCKETS) {
+        sockets.fds[sockets.nfds++] = fd;
+    }
+    pthread_mutex_unlock(&sockets.lock);
+}
+
+// Returns 1 if `ss` is the address and port of one of `addrs`.
+static int inet_matches(const struct sockaddr_storage *ss, const struct addrinfo *addrs) {
+    for (const struct addrinfo *ai = addrs; ai; ai = ai->ai_next) {
+        if (ai->ai_family != ss->ss_family) {
+            continue;
+        }
+        if (ss->ss_family == AF_INET) {
+            const struct sockaddr_in *a = (const struct sockaddr_in *) ss;
+            const struct sockaddr_in *b = (const struct sockaddr_in *) ai->ai_addr;
+            if (a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr) {
+                return 1;
+            }
+        } else {
+            const struct sockaddr_in6 *a = (const struct sockaddr_in6 *) ss;
+            const struct sockaddr_in6 *b = (const struct sockaddr_in6 *) ai->ai_addr;
+            if (a->sin6_port == b->sin6_port &&
+                !memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr))) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Returns 1 if `fd` is a socket of `type` bound to one of `addrs` (inet) or
+// to `path` (AF_UNIX).
+static int socket_matches(int fd, int type, const struct addrinfo *addrs, const char *path) {
+    int so_type;
+    socklen_t len = sizeof(so_type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &so_type, &len) < 0 || so_type != type) {
+        return 0;
+    }
+    struct sockaddr_storage ss;
+    len = sizeof(ss);
+    if (getsockname(fd, (struct sockaddr *) &ss, &len) < 0) {
+        return 0;
+    }
+    switch (ss.ss_family) {
+    case AF_INET:
+    case AF_INET6:
+        return !path && inet_matches(&ss, addrs);
+    case AF_UNIX:
+        return path && !strcmp(((struct sockaddr_un *) &ss)->sun_path, path);
+    }
+    return 0;
+}
+
+// Claims an inherited socket matching the arguments, or returns -1. An inet
+// socket has to be bound to an address binding host:port would pick, so that
+// a change of --host is not silently ignored. With SO_REUSEPORT the old
+// process may have handed over several for one port; each call takes the next.
+static int take_inherited(int type, const char *host, int port, const char *path,
+                          int nonblock) {
+    int fd = -1;
+    struct addrinfo *addrs = NULL;
+    pthread_mutex_lock(&sockets.lock);
+    if (sockets.ninherited > 0 && !path) {
+        struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = type,
+                                 .ai_flags = AI_PASSIVE};
+        char portstr[16];
+        snprintf(portstr, sizeof(portstr), "%d", port);
+        if (getaddrinfo(host && host[0] ? host : NULL, portstr, &hints, &addrs) != 0) {
+            addrs = NULL;       // binding reports it
+        }
+    }
+    for (int i = 0; i < sockets.ninherited; i++) {
+        if (socket_matches(sockets.inherited[i], type, addrs, path)) {
+            // Keep the handover order, so that sockets of one SO_REUSEPORT
+            // group are claimed in the order they joined it.
+            fd = sockets.inherited[i];
+            sockets.ninherited--;
+            memmove(&sockets.inherited[i], &sockets.inherited[i + 1],
+                    (sockets.ninherited - i) * sizeof(int));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sockets.lock);
+    if (addrs) {
+        freeaddrinfo(addrs);
+    }
+    // The file status flags are shared with the other process, so only ever
+    // add O_NONBLOCK; the blocking engines poll and cope with EAGAIN.
+    if (fd >= 0 && nonblock && net_set_nonblocking(fd) < 0) {
+        perror_die("fcntl O_NONBLOCK");
+    }
+    return fd;
+}
+
+void net_inherit(const int *fds, int n) {
+    pthread_mutex_lock(&sockets.lock);
+    for (int i = 0; i < n; i++) {
+        if (sockets.ninherited < NET_MAX_SOCKETS) {
+            sockets.inherited[sockets.ninherited++] = fds[i];
+        } else {
+            close(fds[i]);
+        }
+    }
+    pthread_mutex_unlock(&sockets.lock);
+}
+
+int net_unclaimed_inherited(void) {
+    pthread_mutex_lock(&sockets.lock);
+    int n = sockets.ninherited;
+    for (int i = 0; i < n; i++) {
+        struct sockaddr_storage ss;
+        socklen_t len = sizeof(ss);
+        char name[NI_MAXHOST + NI_MAXSERV + 2] = "unknown";
+        if (getsockname(sockets.inherited[i], (struct sockaddr *) &ss, &len) == 0) {
+            if (ss.ss_family == AF_UNIX) {
+                snprintf(name, sizeof(name), "%s", ((struct sockaddr_un *) &ss)->sun_path);
+            } else {
+                net_format_peer((struct sockaddr *) &ss, len, name, sizeof(name));
+            }
+        }
+        fprintf(stderr, "inherited socket %s: no listener is configured for it\n", name);
+    }
+    pthread_mutex_unlock(&sockets.lock);
+    return n;
+}
+
+void net_forget(int fd) {
+    pthread_mutex_lock(&sockets.lock);
+    for (int i = 0; i < sockets.nfds; i++) {
+        if (sockets.fds[i] == fd) {
+            sockets.nfds--;     // in order: net_listeners() reports creation order
+            memmove(&sockets.fds[i], &sockets.fds[i + 1], (sockets.nfds - i) * sizeof(int));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sockets.lock);
+}
+
+void net_close_listeners(void) {
+    pthread_mutex_lock(&sockets.lock);
+    for (int i = 0; i < sockets.nfds; i++) {
+        close(sockets.fds[i]);
+    }
+    sockets.nfds = 0;
+    pthread_mutex_unlock(&sockets.lock);
+}
+
+int net_listeners(int *fds, int max) {
+    pthread_mutex_lock(&sockets.lock);
+    int n = sockets.nfds < max ? sockets.nfds : max;
+    memcpy(fds, sockets.fds, n * sizeof(int));
+    pthread_mutex_unlock(&sockets.lock);
+    return n;
+}
+
+static int bind_inet(const char *host, int port, int socktype, int reuseport, int nonblock) {
+    struct addrinfo hints = {0};
+    struct addrinfo *res;
+    char portstr[16];
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socktype;
+    hints.ai_flags = AI_PASSIVE;
+    snprintf(portstr, sizeof(portstr), "%d", port);
+
+    int rc = getaddrinfo(host && host[0] ? host : NULL, portstr, &hints, &res);
+    if (rc != 0) {
+        die("getaddrinfo %s:%d: %s", host, port, gai_strerror(rc));
+    }
+
+    int sockfd = -1;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        int type = ai->ai_socktype | SOCK_CLOEXEC | (nonblock ? SOCK_NONBLOCK : 0);
+        sockfd = socket(ai->ai_family, type, ai->ai_protocol);
+        if (sockfd < 0) {
+            continue;
+        }
+        int opt = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+            perror_die("setsockopt SO_REUSEADDR");
+        }
+        if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            perror_die("setsockopt SO_REUSEPORT");
+        }
+        if (bind(sockfd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(sockfd);
+        sockfd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (sockfd < 0) {
+        perror_die("bind");
+    }
+    return sockfd;
+}
+
+int net_listen_tcp(const char *host, int port, int backlog, int reuseport, int nonblock) {
+    int sockfd = take_inherited(SOCK_STREAM, host, port, NULL, nonblock);
+    if (sockfd >= 0) {
+        // Already listening; this only applies our backlog.
+        if (listen(sockfd, backlog) < 0) {
+            perror_die("listen");
+        }
+        remember(sockfd);
+        return sockfd;
+    }
+    sockfd = bind_inet(host, port, SOCK_STREAM, reuseport, nonblock);
+    // Inherited by accepted sockets. Replies can complete in more than one
+    // write (e.g. once another reactor answers), and Nagle would hold the
+    // later ones back until the client's delayed ACK.
+    int opt = 1;
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) < 0) {
+        perror_die("setsockopt TCP_NODELAY");
+    }
+    if (listen(sockfd, backlog) < 0) {
+        perror_die("listen");
+    }
+    remember(sockfd);
+    return sockfd;
+}
+
+int net_bind_udp(const char *host, int port, int reuseport, int nonblock) {
+    int sockfd = take_inherited(SOCK_DGRAM, host, port, NULL, nonblock);
+    if (sockfd < 0) {
+        sockfd = bind_inet(host, port, SOCK_DGRAM, reuseport, nonblock);
+    }
+    remember(sockfd);
+    return sockfd;
+}
+
+int net_listen_unix(const char *path, int type, int backlog, int nonblock) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        die("Unix socket path too long: %s", path);
+    }
+    strcpy(addr.sun_path, path);
+
+    int sockfd = take_inherited(type, NULL, 0, path, nonblock);
+    if (sockfd >= 0) {
+        if (listen(sockfd, backlog) < 0) {
+            perror_die("listen");
+        }
+        remember(sockfd);
+        return sockfd;
+    }
+    sockfd = socket(AF_UNIX, type | SOCK_CLOEXEC | (nonblock ? SOCK_NONBLOCK : 0), 0);
+    if (sockfd < 0) {
+        perror_die("socket AF_UNIX");
+    }
+
+    // Only remove leftovers from a previous run, never a regular file.
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    if (bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror_die(path);
+    }
+    if (listen(sockfd, backlog) < 0) {
+        perror_die("listen");
+    }
+    remember(sockfd);
+    return sockfd;
+}
+
+int net_set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+void net_format_peer(const struct sockaddr *sa, socklen_t len, char *out, size_t outlen) {
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    if (getnameinfo(sa, len, host, sizeof(host), serv, sizeof(serv),
+                    NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+        snprintf(out, outlen, "%s:%s", host, serv);
+    } else {
+        snprintf(out, outlen, "unknown");
+    }
+}
+
+int net_accept_any(const int *listeners, int n, int stop_fd, struct sockaddr *sa,
+                   socklen_t *len) {
+    if (n == 1 && stop_fd < 0) {
+        return accept4(listeners[0], sa, len, SOCK_CLOEXEC);
+    }
+
+    struct pollfd pfds[n + 1];
+    for (int i = 0; i < n; i++) {
+        pfds[i].fd = listeners[i];
+        pfds[i].events = POLLIN;
+    }
+    pfds[n].fd = stop_fd;       // ignored by poll() when negative
+    pfds[n].events = POLLIN;
+    for (;;) {
+        if (poll(pfds, n + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (pfds[n].revents & POLLIN) {
+            errno = ECANCELED;
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            if (pfds[i].revents & POLLIN) {
+                return accept4(listeners[i], sa, len, SOCK_CLOEXEC);
+            }
+        }
+    }
+}
+
+int net_pin_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0) {
+        errno = rc;
+        perror("pthread_setaffinity_np");
+        return -1;
+    }
+    return 0;
+}
+
+int net_steer_by_cpu(int fd, const int *cpus, int n) {
+    // A = the receiving CPU; compare it with each worker's in turn. An index
+    // past the end of the group makes the kernel fall back to its hash.
+    struct sock_filter *code = xmalloc((2 * n + 2) * sizeof(*code));
+    int len = 0;
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < n; i++) {
+        code[len++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, UINT32_MAX);
+    struct sock_fprog prog = {.len = len, .filter = code};
+    int rc = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+    free(code);
+    return rc;
+}
+
+int net_steer_clear(int fd) {
+    int opt = 0;
+    if (setsockopt(fd, SOL_SOCKET, SO_DETACH_REUSEPORT_BPF, &opt, sizeof(opt)) < 0 &&
+        errno != ENOENT) {
+        return -1;
+    }
+    return 0;
+}
+
+int net_incoming_cpu(int fd) {
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0) {
+        return -1;
+    }
+    return cpu;
+}
+
+int net_cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    int node = -1;
+    struct dirent *d;
+    while (node < 0 && (d = readdir(dir))) {
+        if (!strncmp(d->d_name, "node", 4) && d->d_name[4] >= '0' && d->d_name[4] <= '9') {
+            node = atoi(d->d_name + 4);
+        }
+    }
+    closedir(dir);
+    return node;
+}
@@ -0,0 +1,77 @@
+#ifndef NET_H
+#define NET_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+#define NET_MAX_SOCKETS 1024
+
+// The functions creating sockets first claim a matching one handed over by a
+// previous process (see net_inherit()), so a hot upgrade keeps its queued
+// connections and never refuses new ones.
+
+// Creates a bound, listening TCP socket on host:port (host may be empty for
+// "any"). Dies on failure, like the rest of the startup path.
+int net_listen_tcp(const char *host, int port, int backlog, int reuseport, int nonblock);
+
+// Creates a bound UDP socket on host:port. Dies on failure.
+int net_bind_udp(const char *host, int port, int reuseport, int nonblock);
+
+// Creates a listening AF_UNIX socket of `type` (SOCK_STREAM or
+// SOCK_SEQPACKET) at `path`, replacing a stale socket file. Dies on failure.
+int net_listen_unix(const char *path, int type, int backlog, int nonblock);
+
+// Offers sockets received from a previous process to the functions above,
+// which match them by type and by address and port, or path; takes ownership
+// of `fds`. Matching sockets are claimed in the order given, which is the
+// order the previous process created them (see net_listeners()). Creating
+// the listeners in the same order therefore gives each one the place its
+// predecessor held in a SO_REUSEPORT group.
+void net_inherit(const int *fds, int n);
+
+// Returns how many inherited sockets no listener claimed, naming each on
+// stderr. They are left open: closing the last copy would reset the
+// connections queued in them.
+int net_unclaimed_inherited(void);
+
+// Copies up to `max` of the sockets created or claimed above into `fds`, in
+// the order they were created or claimed.
+int net_listeners(int *fds, int max);
+
+// Leaves `fd` out of net_listeners() and net_close_listeners().
+void net_forget(int fd);
+
+// Closes every socket created or claimed above, refusing new connections
+// unless another process shares them. Nothing may still be polling them.
+void net_close_listeners(void);
+
+int net_set_nonblocking(int fd);
+
+// Formats a peer address as "host:port" for log messages.
+void net_format_peer(const struct sockaddr *sa, socklen_t len, char *out, size_t outlen);
+
+// Blocks until one of the listeners is readable and accepts from it. Fails
+// with ECANCELED once `stop_fd` (-1 for none) becomes readable instead.
+int net_accept_any(const int *listeners, int n, int stop_fd, struct sockaddr *sa,
+                   socklen_t *len);
+
+// Pins the calling thread to `cpu`; returns 0 on success.
+int net_pin_thread(int cpu);
+
+// Attaches a classic BPF program to the SO_REUSEPORT group of `fd` that hands
+// a new connection received on cpus[i] to the group's i-th socket (in the
+// order they started listening). Connections arriving on any other CPU are
+// spread by the kernel's usual hash. Returns 0 or -1.
+int net_steer_by_cpu(int fd, const int *cpus, int n);
+
+// Detaches any such program, e.g. one attached by a previous process to a
+// group handed over with a hot upgrade. Returns 0 or -1.
+int net_steer_clear(int fd);
+
+// The CPU that processed the packets of socket `fd`, or -1 if unknown.
+int net_incoming_cpu(int fd);
+
+// Returns the NUMA node `cpu` belongs to, or -1 if the kernel does not say.
+int net_cpu_node(int cpu);
+
+#endif
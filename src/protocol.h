@@ -0,0 +1,138 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "buf.h"
+#include "config.h"
+#include "rcbuf.h"
+
+#define SESSION_IOV_MAX 64
+
+struct protocol;
+
+// A shared buffer or a range of an open file, queued between the inline
+// bytes of `out`.
+struct out_ref {
+    uint64_t pos;       // inline output bytes that precede it
+    struct rcbuf *rc;   // NULL for a file range
+    struct rcfile *file;
+    uint64_t off;       // start of the range within `rc` or `file`
+    size_t len;
+};
+
+// Per-connection protocol state shared by all engines. Engines read into
+// `in` and call session_process(); protocols append replies to `out` or
+// queue shared buffers and files with session_out_ref() / session_out_file().
+// Engines drain the combined output with session_out_iov() or
+// session_out_next_file(), then session_out_consume().
+struct session {
+    const struct protocol *proto;
+    const struct server_config *cfg;
+    void *state;        // owned by the protocol
+    struct buf in;
+    struct buf out;
+    int closing;        // close once all output has been flushed
+    // Set by the engine once the server is draining; protocols may then ask
+    // the client to go elsewhere, e.g. with "Connection: close".
+    int draining;
+    // Replies the protocol still owes from work running elsewhere (another
+    // reactor); the connection stays open until they have been delivered.
+    int async_pending;
+    // Set by engines that support asynchronous replies; the protocol calls it
+    // from the session's own reactor after appending output outside on_data,
+    // possibly from within another session's on_data, so it never runs this
+    // session's on_data itself. It may close the connection, so the session
+    // must not be used after.
+    void (*wake)(struct session *s);
+
+    uint64_t out_base;  // inline output bytes consumed so far
+    struct out_ref *refs;
+    int ref_head;       // first unsent reference
+    int nrefs;
+    int refs_cap;
+    size_t ref_off;     // bytes of refs[ref_head] already sent
+    size_t ref_bytes;   // unsent bytes held in references
+};
+
+struct protocol {
+    const char *name;
+    // Optional: called once at startup, before any engine runs.
+    void (*init)(const struct server_config *cfg);
+    // Called once after the connection is accepted; may queue a greeting.
+    void (*on_open)(struct session *s);
+    // Handles buffered input and returns the number of bytes consumed.
+    // Unconsumed bytes are presented again once more data has arrived.
+    size_t (*on_data)(struct session *s, const char *data, size_t len);
+    void (*on_close)(struct session *s);
+    // Optional: answers one self-contained datagram for the UDP transport.
+    // Writes at most `outcap` bytes to `out` and returns the reply length;
+    // a zero-length reply is not sent.
+    size_t (*on_datagram)(const char *in, size_t len, char *out, size_t outcap);
+    // Optional: runs a short slice of background work when an event loop
+    // has spare time. Returns 1 while more work is pending, in which case
+    // the loop polls instead of blocking and calls it again.
+    int (*on_idle)(void);
+    // Optional: on_idle also runs at least this often, whether the loop is
+    // idle (it wakes up for it) or saturated. 0 = only when there is slack.
+    int idle_tick_ms;
+};
+
+extern const struct protocol transform_protocol;
+extern const struct protocol kv_protocol;
+extern const struct protocol http_protocol;
+
+// Finds a protocol by its `--mode` name; returns NULL if unknown.
+const struct protocol *protocol_lookup(const char *name);
+
+void session_init(struct session *s, const struct protocol *proto,
+                  const struct server_config *cfg);
+void session_destroy(struct session *s);
+
+// Queues `rc` (taking a new reference) after all output queued so far.
+void session_out_ref(struct session *s, struct rcbuf *rc);
+
+// Like session_out_ref(), for the `len` bytes of `rc` starting at `off`.
+void session_out_ref_range(struct session *s, struct rcbuf *rc, size_t off, size_t len);
+
+// Queues `len` bytes of `file` from offset `off` (taking a new reference),
+// to be sent with sendfile() rather than read into memory.
+void session_out_file(struct session *s, struct rcfile *file, uint64_t off, size_t len);
+
+static inline size_t session_out_len(const struct session *s) {
+    return buf_len(&s->out) + s->ref_bytes;
+}
+
+// True once the session is closing and has nothing left to send or await.
+static inline int session_done(const struct session *s) {
+    return s->closing && s->async_pending == 0 && session_out_len(s) == 0;
+}
+
+// True when nothing is in hand: no partial request buffered, no output
+// pending and no replies awaited. A draining server half-closes such
+// connections.
+static inline int session_idle(const struct session *s) {
+    return buf_len(&s->in) == 0 && session_out_len(s) == 0 && s->async_pending == 0;
+}
+
+// Describes pending output in at most `max` iovecs; returns the count.
+// Stops short of a queued file range, which may make the count 0.
+int session_out_iov(const struct session *s, struct iovec *iov, int max);
+
+// If the next pending output comes from a file, returns 1 and the fd and
+// range still to be sent; the caller copies it and consumes what it sent.
+int session_out_next_file(const struct session *s, int *fd, uint64_t *off, size_t *len);
+
+// Marks `n` bytes of pending output as written.
+void session_out_consume(struct session *s, size_t n);
+
+// Returns a pointer where at least cfg->buf_small bytes of input can be read.
+char *session_read_ptr(struct session *s, size_t *avail);
+
+// Feeds `n` freshly read bytes to the protocol. Returns -1 if the client has
+// to be dropped because its unparsed input exceeds cfg->buf_large.
+int session_process(struct session *s, size_t n);
+
+#endif
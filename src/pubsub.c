@@ -0,0 +1,106 @@
+#include "pubsub.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv.h"
+#include "utils.h"
+
+#define PUBSUB_INITIAL_BUCKETS 16
+
+void pubsub_init(struct pubsub *ps) {
+    ps->nbuckets = PUBSUB_INITIAL_BUCKETS;
+    ps->buckets = xcalloc(ps->nbuckets, sizeof(*ps->buckets));
+    ps->nchannels = 0;
+}
+
+static struct pubsub_channel **find(const struct pubsub *ps, const char *name, size_t len,
+                                    uint64_t hash) {
+    struct pubsub_channel **p = &ps->buckets[hash & (ps->nbuckets - 1)];
+    while (*p && !((*p)->hash == hash && (*p)->len == len && !memcmp((*p)->name, name, len))) {
+        p = &(*p)->next;
+    }
+    return p;
+}
+
+static void grow(struct pubsub *ps) {
+    size_t nbuckets = ps->nbuckets * 2;
+    struct pubsub_channel **buckets = xcalloc(nbuckets, sizeof(*buckets));
+    for (size_t i = 0; i < ps->nbuckets; i++) {
+        struct pubsub_channel *ch = ps->buckets[i];
+        while (ch) {
+            struct pubsub_channel *next = ch->next;
+            ch->next = buckets[ch->hash & (nbuckets - 1)];
+            buckets[ch->hash & (nbuckets - 1)] = ch;
+            ch = next;
+        }
+    }
+    free(ps->buckets);
+    ps->buckets = buckets;
+    ps->nbuckets = nbuckets;
+}
+
+struct pubsub_sub *pubsub_add(struct pubsub *ps, const char *name, size_t len, void *client) {
+    uint64_t hash = kv_hash(name, len);
+    struct pubsub_channel **p = find(ps, name, len, hash);
+    struct pubsub_channel *ch = *p;
+    if (ch == NULL) {
+        ch = xcalloc(1, sizeof(*ch) + len);
+        ch->hash = hash;
+        ch->len = len;
+        memcpy(ch->name, name, len);
+        *p = ch;
+        if (++ps->nchannels > ps->nbuckets) {
+            grow(ps);
+        }
+    }
+    if (ch->nsubs == ch->cap) {
+        ch->cap = ch->cap ? ch->cap * 2 : 4;
+        ch->subs = xrealloc(ch->subs, ch->cap * sizeof(*ch->subs));
+    }
+    struct pubsub_sub *sub = xmalloc(sizeof(*sub));
+    sub->channel = ch;
+    sub->client = client;
+    sub->index = ch->nsubs;
+    ch->subs[ch->nsubs++] = sub;
+    return sub;
+}
+
+static void channel_free(struct pubsub *ps, struct pubsub_channel *ch) {
+    struct pubsub_channel **p = find(ps, ch->name, ch->len, ch->hash);
+    *p = ch->next;
+    ps->nchannels--;
+    free(ch->subs);
+    free(ch);
+}
+
+void pubsub_remove(struct pubsub *ps, struct pubsub_sub *sub) {
+    struct pubsub_channel *ch = sub->channel;
+    struct pubsub_sub *last = ch->subs[--ch->nsubs];
+    ch->subs[sub->index] = last;
+    last->index = sub->index;
+    free(sub);
+    if (ch->nsubs == 0 && !ch->pinned) {
+        channel_free(ps, ch);
+    }
+}
+
+size_t pubsub_each(struct pubsub *ps, const char *name, size_t len,
+                   void (*fn)(struct pubsub_sub *sub, void *arg), void *arg) {
+    struct pubsub_channel *ch = *find(ps, name, len, kv_hash(name, len));
+    if (ch == NULL) {
+        return 0;
+    }
+    size_t n = ch->nsubs;
+    // Backwards, so that removing the current subscription moves one that
+    // has already been visited into its place.
+    ch->pinned = 1;
+    for (size_t i = ch->nsubs; i-- > 0;) {
+        fn(ch->subs[i], arg);
+    }
+    ch->pinned = 0;
+    if (ch->nsubs == 0) {
+        channel_free(ps, ch);
+    }
+    return n;
+}
@@ -0,0 +1,51 @@
+#ifndef PUBSUB_H
+#define PUBSUB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Channel registry for SUBSCRIBE / PUBLISH: which clients of one reactor
+// listen on which channel. A channel keeps its subscriptions in an array, so
+// a publish walks them without chasing pointers through the clients, and each
+// subscription remembers its index so it is removed in O(1). Not thread-safe;
+// every reactor has its own.
+
+struct pubsub_sub;
+
+struct pubsub_channel {
+    struct pubsub_channel *next;    // hash chain
+    uint64_t hash;
+    struct pubsub_sub **subs;
+    size_t nsubs, cap;
+    int pinned;                     // being published to, freed afterwards
+    size_t len;
+    char name[];
+};
+
+struct pubsub_sub {
+    struct pubsub_channel *channel;
+    void *client;
+    size_t index;                   // in channel->subs
+};
+
+struct pubsub {
+    struct pubsub_channel **buckets;
+    size_t nbuckets;                // power of two
+    size_t nchannels;
+};
+
+void pubsub_init(struct pubsub *ps);
+
+// Subscribes `client` to `name`; the caller checks that it was not already.
+struct pubsub_sub *pubsub_add(struct pubsub *ps, const char *name, size_t len, void *client);
+
+// Ends a subscription, dropping the channel once nobody listens to it.
+void pubsub_remove(struct pubsub *ps, struct pubsub_sub *sub);
+
+// Calls fn() for every subscription to `name` and returns how many there
+// were. fn() may remove the subscription it is called for (a client that
+// disconnects while being written to), but no other.
+size_t pubsub_each(struct pubsub *ps, const char *name, size_t len,
+                   void (*fn)(struct pubsub_sub *sub, void *arg), void *arg);
+
+#endif
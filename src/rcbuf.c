@@ -0,0 +1,37 @@
+#include "rcbuf.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+struct rcbuf *rcbuf_new(const void *data, size_t len) {
+    struct rcbuf *rc = xmalloc(sizeof(*rc) + len);
+    atomic_init(&rc->refs, 1);
+    rc->len = len;
+    if (data) {
+        memcpy(rc->data, data, len);
+    }
+    return rc;
+}
+
+void rcbuf_unref(struct rcbuf *rc) {
+    if (rc && atomic_fetch_sub_explicit(&rc->refs, 1, memory_order_acq_rel) == 1) {
+        free(rc);
+    }
+}
+
+struct rcfile *rcfile_new(int fd) {
+    struct rcfile *f = xmalloc(sizeof(*f));
+    atomic_init(&f->refs, 1);
+    f->fd = fd;
+    return f;
+}
+
+void rcfile_unref(struct rcfile *f) {
+    if (f && atomic_fetch_sub_explicit(&f->refs, 1, memory_order_acq_rel) == 1) {
+        close(f->fd);
+        free(f);
+    }
+}
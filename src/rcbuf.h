@@ -0,0 +1,45 @@
+#ifndef RCBUF_H
+#define RCBUF_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// An immutable, reference-counted byte buffer. It lets the same bytes be
+// queued on many connections' output (see session_out_ref()) without copying.
+// References may be dropped from any thread.
+struct rcbuf {
+    atomic_uint refs;
+    size_t len;
+    char data[];
+};
+
+// Returns a buffer with one reference holding a copy of `data` (which may be
+// NULL to leave the contents for the caller to fill in).
+struct rcbuf *rcbuf_new(const void *data, size_t len);
+
+static inline struct rcbuf *rcbuf_ref(struct rcbuf *rc) {
+    atomic_fetch_add_explicit(&rc->refs, 1, memory_order_relaxed);
+    return rc;
+}
+
+void rcbuf_unref(struct rcbuf *rc);
+
+// A reference-counted open file descriptor, closed with the last reference.
+// It lets a file stay queued for sending (see session_out_file()) after
+// whoever opened it has moved on.
+struct rcfile {
+    atomic_uint refs;
+    int fd;
+};
+
+// Takes ownership of `fd`; the result has one reference.
+struct rcfile *rcfile_new(int fd);
+
+static inline struct rcfile *rcfile_ref(struct rcfile *f) {
+    atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+    return f;
+}
+
+void rcfile_unref(struct rcfile *f);
+
+#endif
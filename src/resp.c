@@ -0,0 +1,219 @@
+#include "resp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+enum {
+    PS_START,       // first byte of a command
+    PS_ARRAY_LEN,   // "*<n>\r\n"
+    PS_BULK_LEN,    // "$<len>\r\n"
+    PS_BULK_DATA,   // <len> bytes + "\r\n"
+    PS_INLINE,      // "arg arg ...\r\n"
+};
+
+void resp_parser_init(struct resp_parser *p) {
+    memset(p, 0, sizeof(*p));
+}
+
+void resp_parser_free(struct resp_parser *p) {
+    free(p->argv);
+    p->argv = NULL;
+}
+
+void resp_parser_reset(struct resp_parser *p) {
+    p->state = PS_START;
+    p->pos = 0;
+    p->argc = 0;
+    p->nargs = 0;
+    p->error = NULL;
+}
+
+static void push_arg(struct resp_parser *p, size_t off, size_t len) {
+    if (p->argc == p->argv_cap) {
+        p->argv_cap = p->argv_cap ? p->argv_cap * 2 : 8;
+        p->argv = xrealloc(p->argv, p->argv_cap * sizeof(*p->argv));
+    }
+    p->argv[p->argc].off = off;
+    p->argv[p->argc].len = len;
+    p->argc++;
+}
+
+// Parses "<prefix><integer>\r\n" at p->pos. Returns 1 and advances on
+// success, 0 if the line is incomplete, -1 if it is malformed.
+static int parse_len_line(struct resp_parser *p, const char *data, size_t len, long *out) {
+    const char *start = data + p->pos + 1;
+    const char *end = data + len;
+    const char *cr = memchr(start, '\r', end - start);
+    if (cr == NULL) {
+        return end - start > 32 ? -1 : 0;
+    }
+    if (cr + 1 >= end) {
+        return 0;
+    }
+    if (cr[1] != '\n' || cr == start) {
+        return -1;
+    }
+    long v = 0;
+    int neg = 0;
+    const char *q = start;
+    if (*q == '-') {
+        neg = 1;
+        q++;
+    }
+    for (; q < cr; q++) {
+        if (*q < '0' || *q > '9' || v > RESP_MAX_BULK) {
+            return -1;
+        }
+        v = v * 10 + (*q - '0');
+    }
+    *out = neg ? -v : v;
+    p->pos = cr + 2 - data;
+    return 1;
+}
+
+static enum resp_status fail(struct resp_parser *p, const char *msg) {
+    p->error = msg;
+    return RESP_ERROR;
+}
+
+static enum resp_status parse_inline(struct resp_parser *p, const char *data, size_t len) {
+    const char *nl = memchr(data, '\n', len);
+    if (nl == NULL) {
+        return len > RESP_MAX_INLINE ? fail(p, "Protocol error: too big inline request")
+                                     : RESP_INCOMPLETE;
+    }
+    size_t end = nl - data;
+    if (end > 0 && data[end - 1] == '\r') {
+        end--;
+    }
+    p->argc = 0;
+    size_t i = 0;
+    while (i < end) {
+        while (i < end && (data[i] == ' ' || data[i] == '\t')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < end && data[i] != ' ' && data[i] != '\t') {
+            i++;
+        }
+        if (i > start) {
+            push_arg(p, start, i - start);
+        }
+    }
+    p->pos = nl + 1 - data;
+    return RESP_COMMAND;
+}
+
+enum resp_status resp_parse(struct resp_parser *p, const char *data, size_t len) {
+    for (;;) {
+        switch (p->state) {
+        case PS_START:
+            if (p->pos >= len) {
+                return RESP_INCOMPLETE;
+            }
+            if (data[p->pos] != '*') {
+                // An empty inline line yields argc == 0, which callers skip.
+                return parse_inline(p, data, len);
+            }
+            p->state = PS_ARRAY_LEN;
+            break;
+
+        case PS_ARRAY_LEN: {
+            int rc = parse_len_line(p, data, len, &p->nargs);
+            if (rc == 0) {
+                return RESP_INCOMPLETE;
+            }
+            if (rc < 0 || p->nargs > RESP_MAX_ARGS) {
+                return fail(p, "Protocol error: invalid multibulk length");
+            }
+            p->argc = 0;
+            if (p->nargs <= 0) {
+                return RESP_COMMAND;
+            }
+            p->state = PS_BULK_LEN;
+            break;
+        }
+
+        case PS_BULK_LEN: {
+            if (p->pos >= len) {
+                return RESP_INCOMPLETE;
+            }
+            if (data[p->pos] != '$') {
+                return fail(p, "Protocol error: expected '$'");
+            }
+            int rc = parse_len_line(p, data, len, &p->bulk_len);
+            if (rc == 0) {
+                return RESP_INCOMPLETE;
+            }
+            if (rc < 0 || p->bulk_len < 0 || p->bulk_len > RESP_MAX_BULK) {
+                return fail(p, "Protocol error: invalid bulk length");
+            }
+            p->state = PS_BULK_DATA;
+            break;
+        }
+
+        case PS_BULK_DATA:
+            if (len - p->pos < (size_t) p->bulk_len + 2) {
+                return RESP_INCOMPLETE;
+            }
+            if (data[p->pos + p->bulk_len] != '\r' || data[p->pos + p->bulk_len + 1] != '\n') {
+                return fail(p, "Protocol error: bulk string not terminated by CRLF");
+            }
+            push_arg(p, p->pos, p->bulk_len);
+            p->pos += p->bulk_len + 2;
+            if (p->argc == p->nargs) {
+                p->state = PS_START;
+                return RESP_COMMAND;
+            }
+            p->state = PS_BULK_LEN;
+            break;
+        }
+    }
+}
+
+void resp_add_simple(struct buf *out, const char *s) {
+    size_t n = strlen(s);
+    char *p = buf_reserve(out, n + 3);
+    p[0] = '+';
+    memcpy(p + 1, s, n);
+    memcpy(p + 1 + n, "\r\n", 2);
+    buf_commit(out, n + 3);
+}
+
+void resp_add_error(struct buf *out, const char *msg) {
+    size_t n = strlen(msg);
+    char *p = buf_reserve(out, n + 3);
+    p[0] = '-';
+    memcpy(p + 1, msg, n);
+    memcpy(p + 1 + n, "\r\n", 2);
+    buf_commit(out, n + 3);
+}
+
+static void add_prefixed_int(struct buf *out, char prefix, int64_t v) {
+    char *p = buf_reserve(out, 24);
+    int n = snprintf(p, 24, "%c%lld\r\n", prefix, (long long) v);
+    buf_commit(out, n);
+}
+
+void resp_add_int(struct buf *out, int64_t v) {
+    add_prefixed_int(out, ':', v);
+}
+
+void resp_add_bulk(struct buf *out, const char *data, size_t len) {
+    add_prefixed_int(out, '$', len);
+    char *p = buf_reserve(out, len + 2);
+    memcpy(p, data, len);
+    memcpy(p + len, "\r\n", 2);
+    buf_commit(out, len + 2);
+}
+
+void resp_add_null(struct buf *out) {
+    buf_append(out, "$-1\r\n", 5);
+}
+
+void resp_add_array(struct buf *out, long n) {
+    add_prefixed_int(out, '*', n);
+}
@@ -0,0 +1,56 @@
+#ifndef RESP_H
+#define RESP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buf.h"
+
+// Incremental parser for Redis RESP commands (arrays of bulk strings) and
+// space-separated inline commands. Arguments are recorded as offsets into the
+// caller's input rather than copied, so they stay valid when the input buffer
+// is moved or grown between calls. Parsing resumes where the previous call
+// stopped: completed arguments are never parsed again, only an unfinished
+// length line or inline command is re-examined once more bytes arrive.
+
+#define RESP_MAX_ARGS (1024 * 1024)
+#define RESP_MAX_BULK (512L * 1024 * 1024)
+#define RESP_MAX_INLINE (64 * 1024)
+
+enum resp_status { RESP_INCOMPLETE, RESP_COMMAND, RESP_ERROR };
+
+struct resp_arg {
+    size_t off;
+    size_t len;
+};
+
+struct resp_parser {
+    int state;
+    size_t pos;                 // bytes of the current command parsed so far
+    long nargs;                 // array length of the current command
+    long bulk_len;              // length of the bulk string being read
+    int argc;
+    int argv_cap;
+    struct resp_arg *argv;
+    const char *error;          // set when RESP_ERROR is returned
+};
+
+void resp_parser_init(struct resp_parser *p);
+void resp_parser_free(struct resp_parser *p);
+
+// Parses the command starting at `data`. On RESP_COMMAND, p->argc/argv hold
+// the arguments and p->pos its length; call resp_parser_reset() once the
+// caller has consumed those bytes. On RESP_INCOMPLETE, call again with the
+// same start and more bytes appended.
+enum resp_status resp_parse(struct resp_parser *p, const char *data, size_t len);
+void resp_parser_reset(struct resp_parser *p);
+
+// Reply encoders.
+void resp_add_simple(struct buf *out, const char *s);
+void resp_add_error(struct buf *out, const char *msg);
+void resp_add_int(struct buf *out, int64_t v);
+void resp_add_bulk(struct buf *out, const char *data, size_t len);
+void resp_add_null(struct buf *out);
+void resp_add_array(struct buf *out, long n);
+
+#endif
@@ -0,0 +1,186 @@
+#include "protocol.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+static const struct protocol *const protocols[] = {
+    &transform_protocol,
+    &kv_protocol,
+    &http_protocol,
+};
+
+const struct protocol *protocol_lookup(const char *name) {
+    for (size_t i = 0; i < sizeof(protocols) / sizeof(protocols[0]); i++) {
+        if (!strcmp(protocols[i]->name, name)) {
+            return protocols[i];
+        }
+    }
+    return NULL;
+}
+
+void session_init(struct session *s, const struct protocol *proto,
+                  const struct server_config *cfg) {
+    s->proto = proto;
+    s->cfg = cfg;
+    s->state = NULL;
+    s->closing = 0;
+    s->draining = 0;
+    s->async_pending = 0;
+    s->wake = NULL;
+    s->out_base = 0;
+    s->refs = NULL;
+    s->ref_head = s->nrefs = s->refs_cap = 0;
+    s->ref_off = s->ref_bytes = 0;
+    buf_init(&s->in, cfg->buf_small);
+    buf_init(&s->out, 0);
+    if (proto->on_open) {
+        proto->on_open(s);
+    }
+}
+
+void session_destroy(struct session *s) {
+    if (s->proto->on_close) {
+        s->proto->on_close(s);
+    }
+    for (int i = s->ref_head; i < s->nrefs; i++) {
+        rcbuf_unref(s->refs[i].rc);
+        rcfile_unref(s->refs[i].file);
+    }
+    free(s->refs);
+    buf_free(&s->in);
+    buf_free(&s->out);
+}
+
+static struct out_ref *ref_push(struct session *s, size_t len) {
+    if (s->nrefs == s->refs_cap) {
+        s->refs_cap = s->refs_cap ? s->refs_cap * 2 : 8;
+        s->refs = xrealloc(s->refs, s->refs_cap * sizeof(*s->refs));
+    }
+    struct out_ref *r = &s->refs[s->nrefs++];
+    r->pos = s->out_base + buf_len(&s->out);
+    r->rc = NULL;
+    r->file = NULL;
+    r->off = 0;
+    r->len = len;
+    s->ref_bytes += len;
+    return r;
+}
+
+void session_out_ref(struct session *s, struct rcbuf *rc) {
+    session_out_ref_range(s, rc, 0, rc->len);
+}
+
+void session_out_ref_range(struct session *s, struct rcbuf *rc, size_t off, size_t len) {
+    if (len > 0) {
+        struct out_ref *r = ref_push(s, len);
+        r->rc = rcbuf_ref(rc);
+        r->off = off;
+    }
+}
+
+void session_out_file(struct session *s, struct rcfile *file, uint64_t off, size_t len) {
+    if (len > 0) {
+        struct out_ref *r = ref_push(s, len);
+        r->file = rcfile_ref(file);
+        r->off = off;
+    }
+}
+
+int session_out_iov(const struct session *s, struct iovec *iov, int max) {
+    const char *p = buf_head(&s->out);
+    size_t left = buf_len(&s->out);
+    uint64_t pos = s->out_base;
+    int n = 0;
+    for (int i = s->ref_head; i < s->nrefs && n < max; i++) {
+        size_t before = s->refs[i].pos - pos;
+        if (before > 0) {
+            iov[n].iov_base = (char *) p;
+            iov[n].iov_len = before;
+            p += before;
+            left -= before;
+            pos += before;
+            if (++n == max) {
+                return n;
+            }
+        }
+        if (s->refs[i].file) {
+            return n;
+        }
+        size_t skip = i == s->ref_head ? s->ref_off : 0;
+        iov[n].iov_base = s->refs[i].rc->data + s->refs[i].off + skip;
+        iov[n].iov_len = s->refs[i].len - skip;
+        n++;
+    }
+    if (left > 0 && n < max) {
+        iov[n].iov_base = (char *) p;
+        iov[n].iov_len = left;
+        n++;
+    }
+    return n;
+}
+
+int session_out_next_file(const struct session *s, int *fd, uint64_t *off, size_t *len) {
+    if (s->ref_head == s->nrefs) {
+        return 0;
+    }
+    const struct out_ref *r = &s->refs[s->ref_head];
+    if (r->file == NULL || r->pos != s->out_base) {
+        return 0;
+    }
+    *fd = r->file->fd;
+    *off = r->off + s->ref_off;
+    *len = r->len - s->ref_off;
+    return 1;
+}
+
+void session_out_consume(struct session *s, size_t n) {
+    while (n > 0 && s->ref_head < s->nrefs) {
+        struct out_ref *r = &s->refs[s->ref_head];
+        size_t before = r->pos - s->out_base;
+        if (before > 0) {
+            size_t k = n < before ? n : before;
+            buf_consume(&s->out, k);
+            s->out_base += k;
+            n -= k;
+            continue;
+        }
+        size_t k = r->len - s->ref_off;
+        if (n < k) {
+            k = n;
+        }
+        s->ref_off += k;
+        s->ref_bytes -= k;
+        n -= k;
+        if (s->ref_off == r->len) {
+            rcbuf_unref(r->rc);
+            rcfile_unref(r->file);
+            s->ref_head++;
+            s->ref_off = 0;
+        }
+    }
+    if (s->ref_head == s->nrefs) {
+        s->ref_head = s->nrefs = 0;
+    } else if (s->ref_head > s->refs_cap / 2) {
+        // A queue that never fully drains would otherwise grow forever.
+        s->nrefs -= s->ref_head;
+        memmove(s->refs, s->refs + s->ref_head, s->nrefs * sizeof(*s->refs));
+        s->ref_head = 0;
+    }
+    buf_consume(&s->out, n);
+    s->out_base += n;
+}
+
+char *session_read_ptr(struct session *s, size_t *avail) {
+    char *p = buf_reserve(&s->in, s->cfg->buf_small);
+    *avail = s->in.cap - s->in.end;
+    return p;
+}
+
+int session_process(struct session *s, size_t n) {
+    buf_commit(&s->in, n);
+    size_t used = s->proto->on_data(s, buf_head(&s->in), buf_len(&s->in));
+    buf_consume(&s->in, used);
+    return buf_len(&s->in) > s->cfg->buf_large ? -1 : 0;
+}
@@ -0,0 +1,79 @@
+#include "shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int shm_accept_segment(int sockfd, void **base, size_t *maplen, uint64_t *ring_size,
+                       int *server_doorbell, int *client_doorbell) {
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t n = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+        return -1;
+    }
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (n == 0 || cm == NULL || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+        errno = EPROTO;
+        return -1;
+    }
+    int nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int fds[3];
+    memcpy(fds, CMSG_DATA(cm), (nfds < 3 ? nfds : 3) * sizeof(int));
+    if (nfds != 3 || (msg.msg_flags & MSG_CTRUNC)) {
+        for (int i = 0; i < nfds && i < 3; i++) {
+            close(fds[i]);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    int seals = fcntl(fds[0], F_GET_SEALS);
+    if (seals >= 0 && (seals & F_SEAL_SHRINK) && fstat(fds[0], &st) == 0 &&
+        (size_t) st.st_size >= SHM_DATA_OFFSET) {
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    }
+    close(fds[0]);
+    if (map == MAP_FAILED) {
+        close(fds[1]);
+        close(fds[2]);
+        errno = EPROTO;
+        return -1;
+    }
+
+    // Snapshot the geometry once; the client can scribble over the header.
+    const struct shm_header *hdr = map;
+    uint64_t size = hdr->ring_size;
+    if (hdr->magic != SHM_MAGIC || hdr->version != SHM_VERSION || size < SHM_RING_MIN ||
+        size > SHM_RING_MAX || (size & (size - 1)) != 0 ||
+        shm_segment_size(size) > (size_t) st.st_size) {
+        munmap(map, st.st_size);
+        close(fds[1]);
+        close(fds[2]);
+        errno = EPROTO;
+        return -1;
+    }
+
+    *base = map;
+    *maplen = st.st_size;
+    *ring_size = size;
+    *server_doorbell = fds[1];
+    *client_doorbell = fds[2];
+    return 0;
+}
@@ -0,0 +1,165 @@
+#ifndef SHM_H
+#define SHM_H
+
+// Shared-memory transport. A client creates a memfd holding one segment with
+// two single-producer/single-consumer byte rings (client->server and
+// server->client) plus an eventfd "doorbell" for each side. It then connects
+// to the --shm rendezvous socket and passes {memfd, server doorbell, client
+// doorbell} with SCM_RIGHTS. From then on bytes flow through the rings and
+// the connection stays open only to signal hangup.
+//
+// The memfd has to be created with MFD_ALLOW_SEALING and sealed with
+// F_SEAL_SHRINK before it is sent; unsealed segments are refused. Otherwise
+// the client could truncate it and the server would fault on its mapping.
+//
+// Doorbells are rung only when the other side has announced that it is about
+// to sleep: a consumer sets `data_waiting` before blocking on an empty ring,
+// a producer sets `space_waiting` before blocking on a full one. The side
+// that makes progress clears the flag and rings exactly once. Each side
+// stores to one location and then loads the other (flag then indices for the
+// sleeper, indices then flag for the waker), so a full fence sits between the
+// two on both sides; without it either load may see the old value and both
+// sides sleep.
+//
+// This header is self-contained so that clients can include it as is.
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SHM_MAGIC 0x52485343u   // "CSHR"
+#define SHM_VERSION 1
+#define SHM_CACHELINE 64
+#define SHM_RING_MIN (4u << 10)
+#define SHM_RING_MAX (64u << 20)
+
+enum { SHM_RING_C2S = 0, SHM_RING_S2C = 1 };
+
+struct shm_ring_ctl {
+    _Alignas(SHM_CACHELINE) _Atomic uint64_t head;         // advanced by the producer
+    _Alignas(SHM_CACHELINE) _Atomic uint64_t tail;         // advanced by the consumer
+    _Alignas(SHM_CACHELINE) _Atomic uint32_t data_waiting; // consumer sleeps on empty
+    _Atomic uint32_t space_waiting;                       // producer sleeps on full
+};
+
+struct shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ring_size;         // bytes per ring, a power of two
+    struct shm_ring_ctl rings[2];
+};
+
+#define SHM_DATA_OFFSET \
+    ((sizeof(struct shm_header) + SHM_CACHELINE - 1) & ~(size_t) (SHM_CACHELINE - 1))
+
+// One side's view of a ring. `data` and `size` are private copies so that a
+// misbehaving peer cannot redirect them.
+struct shm_ring {
+    struct shm_ring_ctl *ctl;
+    char *data;
+    uint64_t size;
+};
+
+static inline size_t shm_segment_size(uint64_t ring_size) {
+    return SHM_DATA_OFFSET + 2 * ring_size;
+}
+
+static inline void shm_segment_init(void *base, uint64_t ring_size) {
+    struct shm_header *hdr = base;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = SHM_MAGIC;
+    hdr->version = SHM_VERSION;
+    hdr->ring_size = ring_size;
+}
+
+static inline void shm_ring_attach(struct shm_ring *r, void *base, uint64_t ring_size, int which) {
+    struct shm_header *hdr = base;
+    r->ctl = &hdr->rings[which];
+    r->data = (char *) base + SHM_DATA_OFFSET + (size_t) which * ring_size;
+    r->size = ring_size;
+}
+
+// Bytes available to the consumer, or UINT64_MAX if the indices are corrupt.
+static inline uint64_t shm_ring_readable(const struct shm_ring *r) {
+    uint64_t head = atomic_load_explicit(&r->ctl->head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&r->ctl->tail, memory_order_relaxed);
+    uint64_t n = head - tail;
+    return n > r->size ? UINT64_MAX : n;
+}
+
+// Copies up to `len` bytes in; returns the number written.
+static inline size_t shm_ring_write(struct shm_ring *r, const void *src, size_t len) {
+    uint64_t head = atomic_load_explicit(&r->ctl->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->ctl->tail, memory_order_acquire);
+    uint64_t used = head - tail;
+    if (used > r->size) {
+        return 0;
+    }
+    size_t n = r->size - used < len ? r->size - used : len;
+    size_t off = head & (r->size - 1);
+    size_t first = r->size - off < n ? r->size - off : n;
+    memcpy(r->data + off, src, first);
+    memcpy(r->data, (const char *) src + first, n - first);
+    atomic_store_explicit(&r->ctl->head, head + n, memory_order_release);
+    return n;
+}
+
+// Copies up to `len` bytes out; returns the number read.
+static inline size_t shm_ring_read(struct shm_ring *r, void *dst, size_t len) {
+    uint64_t avail = shm_ring_readable(r);
+    if (avail == UINT64_MAX) {
+        return 0;
+    }
+    uint64_t tail = atomic_load_explicit(&r->ctl->tail, memory_order_relaxed);
+    size_t n = avail < len ? avail : len;
+    size_t off = tail & (r->size - 1);
+    size_t first = r->size - off < n ? r->size - off : n;
+    memcpy(dst, r->data + off, first);
+    memcpy((char *) dst + first, r->data, n - first);
+    atomic_store_explicit(&r->ctl->tail, tail + n, memory_order_release);
+    return n;
+}
+
+// Announces that the caller will sleep until the ring has data. Returns 0 if
+// it may sleep, or 1 if data raced in and it should keep consuming instead.
+static inline int shm_ring_prepare_wait_data(struct shm_ring *r) {
+    atomic_store(&r->ctl->data_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (shm_ring_readable(r) != 0) {
+        atomic_store(&r->ctl->data_waiting, 0);
+        return 1;
+    }
+    return 0;
+}
+
+// Same as above for a producer waiting for free space.
+static inline int shm_ring_prepare_wait_space(struct shm_ring *r) {
+    atomic_store(&r->ctl->space_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (shm_ring_readable(r) < r->size) {
+        atomic_store(&r->ctl->space_waiting, 0);
+        return 1;
+    }
+    return 0;
+}
+
+// Called after producing/consuming: return 1 if the peer is asleep and its
+// doorbell has to be rung.
+static inline int shm_ring_should_wake_consumer(struct shm_ring *r) {
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load(&r->ctl->data_waiting) && atomic_exchange(&r->ctl->data_waiting, 0);
+}
+
+static inline int shm_ring_should_wake_producer(struct shm_ring *r) {
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load(&r->ctl->space_waiting) && atomic_exchange(&r->ctl->space_waiting, 0);
+}
+
+// Server side: receives the client's descriptors from the rendezvous socket,
+// maps and validates the segment. Returns 0 and fills the outputs, -1 with
+// errno = EAGAIN if the descriptors have not arrived yet, or -1 on error.
+int shm_accept_segment(int sockfd, void **base, size_t *maplen, uint64_t *ring_size,
+                       int *server_doorbell, int *client_doorbell);
+
+#endif
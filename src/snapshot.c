@@ -0,0 +1,410 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "buf.h"
+#include "utils.h"
+
+#define SNAPSHOT_MAGIC "CSKVSNAP"
+#define SNAPSHOT_VERSION 3
+// Where the loader tries to map the file: far from the heap, the stacks and
+// the default mmap area, so it is normally free and no pointer needs fixing.
+#define SNAPSHOT_MAP_ADDR 0x200000000000ull
+#define SNAPSHOT_PAGE 4096
+// Output goes to write() in chunks of about this size.
+#define SNAPSHOT_CHUNK (256 * 1024)
+
+struct snapshot_shard {
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t ctrl_off;      // capacity control bytes, 64-byte aligned
+    uint64_t slots_off;     // capacity entry pointers, NULL when free
+    uint64_t entry_bytes;   // kv_entry_size() of the entries, for --maxmemory
+};
+
+// Padded to a page, so the entries that follow are page-aligned too.
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nshards;
+    int64_t created_ms;
+    uint64_t map_addr;      // the pointers in the file are valid there
+    uint64_t file_size;
+    uint64_t count;
+    struct snapshot_shard shards[];
+};
+
+struct save_stats {
+    uint64_t keys;
+    uint64_t bytes;
+    uint64_t cow_bytes;     // private dirty memory of the bgsave child
+};
+
+struct bgsave_job {
+    pid_t pid;
+    int result_fd;          // the child writes its save_stats here
+    uint64_t start_ms;
+};
+
+static atomic_int bgsave_running;
+static _Atomic int64_t last_save;
+
+static int flush_out(int fd, struct buf *out, struct save_stats *stats) {
+    if (write_all(fd, buf_head(out), buf_len(out)) < 0) {
+        return -1;
+    }
+    stats->bytes += buf_len(out);
+    buf_consume(out, buf_len(out));
+    return 0;
+}
+
+static size_t align_up(size_t n, size_t a) {
+    return (n + a - 1) & ~(a - 1);
+}
+
+static size_t header_size(int nshards) {
+    return align_up(sizeof(struct snapshot_header) + nshards * sizeof(struct snapshot_shard),
+                    SNAPSHOT_PAGE);
+}
+
+static int is_live(const struct kv_entry *e, int64_t now) {
+    return e->expire_at == 0 || e->expire_at > now;
+}
+
+static void pad_to(struct buf *out, size_t *off, size_t align) {
+    static const char zeros[64];
+    size_t n = align_up(*off, align) - *off;
+    buf_append(out, zeros, n);
+    *off += n;
+}
+
+// Entries first, each placed in its shard's table image at the address it
+// will have once mapped; then the tables; the header goes in last.
+static int write_entries(int fd, struct kv_store *const *stores, int n, struct save_stats *stats) {
+    int64_t now = unix_ms();
+    size_t head = header_size(n);
+    struct snapshot_header *h = xcalloc(1, head);
+    memcpy(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic));
+    h->version = SNAPSHOT_VERSION;
+    h->nshards = n;
+    h->created_ms = now;
+    h->map_addr = SNAPSHOT_MAP_ADDR;
+
+    struct kv_table *tables = xcalloc(n, sizeof(*tables));
+    for (int i = 0; i < n; i++) {
+        size_t pos = 0, count = 0;
+        struct kv_entry *e;
+        while ((e = kv_next(stores[i], &pos))) {
+            count += is_live(e, now);
+        }
+        kv_table_alloc(&tables[i], kv_table_capacity(count));
+    }
+
+    struct buf out;
+    buf_init(&out, SNAPSHOT_CHUNK);
+    buf_append(&out, h, head);
+    size_t off = head;
+    size_t *entry_bytes = xcalloc(n, sizeof(*entry_bytes));
+    int rc = 0;
+    for (int i = 0; i < n && rc == 0; i++) {
+        size_t pos = 0;
+        struct kv_entry *e;
+        while ((e = kv_next(stores[i], &pos))) {
+            if (!is_live(e, now)) {
+                continue;
+            }
+            kv_table_add(&tables[i], e->hash, (struct kv_entry *) (uintptr_t) (h->map_addr + off));
+            struct kv_entry image = *e;
+            image.big = NULL;
+            buf_append(&out, &image, sizeof(image));
+            buf_append(&out, kv_key(e), e->klen);
+            buf_append(&out, kv_value(e), e->vlen);
+            off += kv_entry_size(&image);
+            entry_bytes[i] += kv_entry_size(&image);
+            pad_to(&out, &off, 8);
+            if (buf_len(&out) >= SNAPSHOT_CHUNK && (rc = flush_out(fd, &out, stats)) < 0) {
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < n && rc == 0; i++) {
+        struct kv_table *t = &tables[i];
+        pad_to(&out, &off, 64);
+        h->shards[i] = (struct snapshot_shard){
+            .capacity = t->capacity,
+            .count = t->count,
+            .ctrl_off = off,
+            .slots_off = off + t->capacity,
+            .entry_bytes = entry_bytes[i],
+        };
+        h->count += t->count;
+        off += t->capacity * (1 + sizeof(*t->slots));
+        if ((rc = flush_out(fd, &out, stats)) == 0 &&
+            (rc = write_all(fd, t->ctrl, t->capacity)) == 0 &&
+            (rc = write_all(fd, t->slots, t->capacity * sizeof(*t->slots))) == 0) {
+            stats->bytes += t->capacity * (1 + sizeof(*t->slots));
+        }
+    }
+    if (rc == 0) {
+        rc = flush_out(fd, &out, stats);
+    }
+    if (rc == 0) {
+        h->file_size = off;
+        stats->keys = h->count;
+        rc = pwrite(fd, h, head, 0) == (ssize_t) head ? 0 : -1;
+    }
+    for (int i = 0; i < n; i++) {
+        kv_table_free(&tables[i]);
+    }
+    free(tables);
+    free(entry_bytes);
+    buf_free(&out);
+    free(h);
+    return rc;
+}
+
+static int save(const char *path, struct kv_store *const *stores, int n, struct save_stats *stats) {
+    size_t len = strlen(path) + sizeof(".tmp");
+    char *tmp = xmalloc(len);
+    snprintf(tmp, len, "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        free(tmp);
+        return -1;
+    }
+    int rc = write_entries(fd, stores, n, stats);
+    if (rc == 0) {
+        rc = fdatasync(fd);
+    }
+    if (close(fd) < 0) {
+        rc = -1;
+    }
+    if (rc == 0) {
+        rc = rename(tmp, path);
+    }
+    int err = errno;
+    if (rc < 0) {
+        unlink(tmp);
+    } else if (fsync_dir(path) < 0) {
+        perror("snapshot: fsync directory");
+    }
+    free(tmp);
+    errno = err;
+    return rc;
+}
+
+int snapshot_save(const char *path, struct kv_store *const *stores, int n) {
+    struct save_stats stats = {0};
+    uint64_t start = now_ms();
+    if (save(path, stores, n, &stats) < 0) {
+        return -1;
+    }
+    atomic_store(&last_save, unix_ms() / 1000);
+    printf("DB saved on disk: %llu keys, %llu bytes in %llu ms\n",
+           (unsigned long long) stats.keys, (unsigned long long) stats.bytes,
+           (unsigned long long) (now_ms() - start));
+    return 0;
+}
+
+// Memory this process has written to since it was forked, or the parent has
+// written to since: either way pages that are no longer shared.
+static uint64_t private_dirty_bytes(void) {
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL) {
+        f = fopen("/proc/self/smaps", "r");
+    }
+    if (f == NULL) {
+        return 0;
+    }
+    char line[256];
+    unsigned long long kb, total = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "Private_Dirty: %llu kB", &kb) == 1) {
+            total += kb;
+        }
+    }
+    fclose(f);
+    return total * 1024;
+}
+
+static void *reap_bgsave(void *arg) {
+    struct bgsave_job job = *(struct bgsave_job *) arg;
+    free(arg);
+
+    struct save_stats stats;
+    ssize_t n;
+    do {
+        n = read(job.result_fd, &stats, sizeof(stats));
+    } while (n < 0 && errno == EINTR);
+    close(job.result_fd);
+    int status = -1;
+    while (waitpid(job.pid, &status, 0) < 0 && errno == EINTR) {
+    }
+
+    if (n == sizeof(stats) && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        atomic_store(&last_save, unix_ms() / 1000);
+        long page = sysconf(_SC_PAGESIZE);
+        printf("Background saving done: %llu keys, %llu bytes in %llu ms, "
+               "copy-on-write %llu kB (%llu pages)\n",
+               (unsigned long long) stats.keys, (unsigned long long) stats.bytes,
+               (unsigned long long) (now_ms() - job.start_ms),
+               (unsigned long long) stats.cow_bytes / 1024,
+               (unsigned long long) stats.cow_bytes / page);
+    } else {
+        fprintf(stderr, "Background saving failed\n");
+    }
+    atomic_store(&bgsave_running, 0);
+    return NULL;
+}
+
+int snapshot_bgsave(const char *path, struct kv_store *const *stores, int n) {
+    int expected = 0;
+    if (!atomic_compare_exchange_strong(&bgsave_running, &expected, 1)) {
+        errno = EBUSY;
+        return -1;
+    }
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        atomic_store(&bgsave_running, 0);
+        return -1;
+    }
+    uint64_t start = now_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        struct save_stats stats = {0};
+        if (save(path, stores, n, &stats) < 0) {
+            perror(path);
+            _exit(1);
+        }
+        stats.cow_bytes = private_dirty_bytes();
+        _exit(write_all(fds[1], &stats, sizeof(stats)) == 0 ? 0 : 1);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        int err = errno;
+        close(fds[0]);
+        atomic_store(&bgsave_running, 0);
+        errno = err;
+        return -1;
+    }
+    printf("Background saving started by pid %d (fork took %.3f ms)\n", (int) pid,
+           (now_ns() - start) / 1e6);
+
+    struct bgsave_job *job = xmalloc(sizeof(*job));
+    job->pid = pid;
+    job->result_fd = fds[0];
+    job->start_ms = now_ms();
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, reap_bgsave, job);
+    if (rc != 0) {
+        die("pthread_create: %s", strerror(rc));
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+int snapshot_in_progress(void) {
+    return atomic_load(&bgsave_running);
+}
+
+int64_t snapshot_last_save(void) {
+    return atomic_load(&last_save);
+}
+
+long snapshot_load(const char *path, struct kv_store *const *stores, int n,
+                   struct kv_store *(*store_for)(const char *key, size_t klen)) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        perror_die(path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror_die(path);
+    }
+    struct snapshot_header h;
+    if ((size_t) st.st_size < sizeof(h) || pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+        memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0) {
+        die("%s: not a snapshot", path);
+    }
+    if (h.version != SNAPSHOT_VERSION) {
+        die("%s: unsupported snapshot version %u", path, h.version);
+    }
+    if (h.file_size != (uint64_t) st.st_size || h.nshards == 0 ||
+        header_size(h.nshards) > h.file_size) {
+        die("%s: truncated or corrupt", path);
+    }
+
+    uint64_t start = now_ms();
+    size_t len = h.file_size;
+    // Private and writable: overwriting a value in place copies just its page.
+    char *base = mmap((void *) (uintptr_t) h.map_addr, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0);
+    if (base == MAP_FAILED) {
+        base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    if (base == MAP_FAILED) {
+        perror_die(path);
+    }
+    close(fd);
+    const struct snapshot_header *mh = (const struct snapshot_header *) base;
+    uintptr_t delta = (uintptr_t) base - h.map_addr;
+    for (int i = 0; i < n; i++) {
+        kv_store_set_foreign(stores[i], base, len);
+    }
+
+    int rehash = (int) h.nshards != n;
+    const char *how = rehash ? "rehashed" : delta ? "relocated" : "mapped in place";
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < h.nshards; i++) {
+        const struct snapshot_shard *sh = &mh->shards[i];
+        if (sh->capacity == 0 || (sh->capacity & (sh->capacity - 1)) || sh->ctrl_off % 64 ||
+            sh->slots_off != sh->ctrl_off + sh->capacity ||
+            sh->slots_off + sh->capacity * sizeof(struct kv_entry *) > len) {
+            die("%s: corrupt table %u", path, i);
+        }
+        struct kv_table t = {
+            .ctrl = (int8_t *) (base + sh->ctrl_off),
+            .slots = (struct kv_entry **) (base + sh->slots_off),
+            .capacity = sh->capacity,
+            .count = sh->count,
+        };
+        if (delta || rehash) {
+            // Touches every slot, but still no key is parsed or copied.
+            for (size_t j = 0; j < t.capacity; j++) {
+                if (t.ctrl[j] < 0) {
+                    continue;
+                }
+                struct kv_entry *e = (struct kv_entry *) ((char *) t.slots[j] + delta);
+                if (rehash) {
+                    kv_store_add(store_for(kv_key(e), e->klen), e);
+                } else {
+                    t.slots[j] = e;
+                }
+            }
+        }
+        if (!rehash) {
+            kv_store_adopt(stores[i], &t, sh->entry_bytes);
+        }
+        count += t.count;
+    }
+    if (count != h.count) {
+        die("%s: corrupt entry count", path);
+    }
+    printf("Loaded %llu keys from %s in %llu ms (%s)\n", (unsigned long long) count, path,
+           (unsigned long long) (now_ms() - start), how);
+    return count;
+}
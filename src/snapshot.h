@@ -0,0 +1,42 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kv.h"
+
+// Point-in-time snapshots of the kv keyspace, laid out so that loading is
+// just mapping the file: after the header come the entries, each an image of
+// a struct kv_entry with its value inline, and then every shard's hash table
+// (control bytes and slot pointers). The pointers assume the file is mapped
+// at a fixed address; if that range is taken the loader adjusts them, and if
+// the shard count differs it re-inserts the entries, which still needs
+// neither parsing nor copying. Untouched entries stay in the page cache and
+// are only faulted in when used. A snapshot is written to PATH.tmp and
+// renamed over PATH, so a crash leaves the previous one intact.
+
+// Writes the live entries of stores[0..n) to `path` from the calling thread.
+// Returns 0, or -1 with errno set.
+int snapshot_save(const char *path, struct kv_store *const *stores, int n);
+
+// Forks a child that writes the snapshot while the parent carries on;
+// copy-on-write keeps the stores as they were at the fork. The caller must
+// keep them from being modified during the call. The outcome, including how
+// much memory the child ended up copying, is printed when it exits. Returns
+// -1 (EBUSY if a save is already running) on failure.
+int snapshot_bgsave(const char *path, struct kv_store *const *stores, int n);
+int snapshot_in_progress(void);
+
+// Unix time in seconds of the last successful save, 0 if there was none.
+int64_t snapshot_last_save(void);
+
+// Maps `path` and makes its entries the contents of stores[0..n), which must
+// be empty; store_for() picks the store for a key when the file was written
+// with a different number of them. Entries that have expired are left for
+// the stores' expiry to find. Returns the number of entries, 0 if the file
+// does not exist. Dies if the file is corrupt.
+long snapshot_load(const char *path, struct kv_store *const *stores, int n,
+                   struct kv_store *(*store_for)(const char *key, size_t klen));
+
+#endif
@@ -0,0 +1,19 @@
+#include "stats.h"
+
+atomic_llong stats[STAT_COUNT];
+
+static const char *const names[STAT_COUNT] = {
+    [STAT_CONNS_ACCEPTED] = "connections_accepted",
+    [STAT_CONNS_OPEN] = "connections_open",
+    [STAT_CONNS_CPU_LOCAL] = "connections_cpu_local",
+    [STAT_CONNS_CPU_REMOTE] = "connections_cpu_remote",
+    [STAT_DRAIN_HALF_CLOSED] = "drain_half_closed",
+    [STAT_DRAIN_FORCED] = "drain_forced",
+    [STAT_POLL_SPUN] = "busy_poll_spun",
+    [STAT_POLL_BLOCKED] = "busy_poll_blocked",
+    [STAT_UDP_TRUNCATED] = "udp_truncated",
+};
+
+const char *stats_name(enum stat s) {
+    return names[s];
+}
@@ -0,0 +1,36 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+
+// Process-wide counters, cheap enough to bump on every connection. They are
+// updated with relaxed atomics from any thread and reported by /info in the
+// http mode and by the drain progress lines.
+
+enum stat {
+    STAT_CONNS_ACCEPTED,
+    STAT_CONNS_OPEN,
+    STAT_CONNS_CPU_LOCAL,       // pinned workers: received on the worker's own CPU
+    STAT_CONNS_CPU_REMOTE,      // ... or on another one
+    STAT_DRAIN_HALF_CLOSED,     // idle connections shut down for writing
+    STAT_DRAIN_FORCED,          // connections still open at the drain deadline
+    STAT_POLL_SPUN,             // --busy-poll: waits whose events arrived while spinning
+    STAT_POLL_BLOCKED,          // ... and those that had to block
+    STAT_UDP_TRUNCATED,         // datagrams dropped for not fitting a receive slot
+    STAT_COUNT,
+};
+
+extern atomic_llong stats[STAT_COUNT];
+
+static inline void stats_add(enum stat s, long long n) {
+    atomic_fetch_add_explicit(&stats[s], n, memory_order_relaxed);
+}
+
+static inline long long stats_get(enum stat s) {
+    return atomic_load_explicit(&stats[s], memory_order_relaxed);
+}
+
+// The counter's name in reports, e.g. "connections_open".
+const char *stats_name(enum stat s);
+
+#endif
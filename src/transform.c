@@ -0,0 +1,65 @@
+// The toy protocol from Eli Bendersky's concurrent servers series: the server
+// greets every client with '*', then replies to each byte of a message framed
+// by '^' and '$' with that byte plus one. Bytes outside a message are ignored.
+#include <stdlib.h>
+
+#include "protocol.h"
+#include "utils.h"
+
+enum transform_state { WAIT_FOR_MSG, IN_MSG };
+
+static void transform_open(struct session *s) {
+    enum transform_state *state = xmalloc(sizeof(*state));
+    *state = WAIT_FOR_MSG;
+    s->state = state;
+    buf_append(&s->out, "*", 1);
+}
+
+static size_t transform_data(struct session *s, const char *data, size_t len) {
+    enum transform_state *state = s->state;
+    char *out = buf_reserve(&s->out, len);
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (*state == WAIT_FOR_MSG) {
+            if (data[i] == '^') {
+                *state = IN_MSG;
+            }
+        } else if (data[i] == '$') {
+            *state = WAIT_FOR_MSG;
+        } else {
+            out[n++] = data[i] + 1;
+        }
+    }
+    buf_commit(&s->out, n);
+    return len;
+}
+
+// Every datagram starts outside a message, so framing never spans datagrams.
+static size_t transform_datagram(const char *in, size_t len, char *out, size_t outcap) {
+    enum transform_state state = WAIT_FOR_MSG;
+    size_t n = 0;
+    for (size_t i = 0; i < len && n < outcap; i++) {
+        if (state == WAIT_FOR_MSG) {
+            if (in[i] == '^') {
+                state = IN_MSG;
+            }
+        } else if (in[i] == '$') {
+            state = WAIT_FOR_MSG;
+        } else {
+            out[n++] = in[i] + 1;
+        }
+    }
+    return n;
+}
+
+static void transform_close(struct session *s) {
+    free(s->state);
+}
+
+const struct protocol transform_protocol = {
+    .name = "transform",
+    .on_open = transform_open,
+    .on_data = transform_data,
+    .on_close = transform_close,
+    .on_datagram = transform_datagram,
+};
@@ -0,0 +1,184 @@
+#include "upgrade.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "net.h"
+#include "utils.h"
+
+// Connection to the server taken over from, until we are serving.
+static int predecessor = -1;
+
+static int send_fds(int sockfd, char tag, const int *fds, int n) {
+    struct iovec iov = {.iov_base = &tag, .iov_len = 1};
+    union {
+        char buf[CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (n > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(n * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, n * sizeof(int));
+    }
+    return sendmsg(sockfd, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+// Receives one message; returns its tag and appends any sockets to `fds`.
+static char recv_fds(int sockfd, int *fds, int *n, int max) {
+    char tag;
+    struct iovec iov = {.iov_base = &tag, .iov_len = 1};
+    union {
+        char buf[CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t r;
+    do {
+        r = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0) {
+        perror_die("upgrade: recvmsg");
+    }
+    if (r == 0 || (msg.msg_flags & MSG_CTRUNC)) {
+        die("upgrade: the previous server broke off the handover");
+    }
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            if (*n < max) {
+                fds[(*n)++] = fd;
+            } else {
+                close(fd);
+            }
+        }
+    }
+    return tag;
+}
+
+int upgrade_takeover(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        die("Unix socket path too long: %s", path);
+    }
+    strcpy(addr.sun_path, path);
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        perror_die("socket AF_UNIX");
+    }
+    if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        if (errno != ENOENT && errno != ECONNREFUSED) {
+            perror_die(path);
+        }
+        close(sockfd);          // nobody to take over from: a cold start
+        return 0;
+    }
+
+    int *fds = xmalloc(NET_MAX_SOCKETS * sizeof(int));
+    int n = 0;
+    char tag;
+    while ((tag = recv_fds(sockfd, fds, &n, NET_MAX_SOCKETS)) == 'L') {
+    }
+    if (tag != 'E') {
+        die("upgrade: unexpected message from the previous server");
+    }
+    net_inherit(fds, n);
+    free(fds);
+    predecessor = sockfd;
+    return n;
+}
+
+// Sends our sockets to the server on `sockfd` and waits until it is serving.
+// Returns 0 once it is, -1 if it went away.
+static int hand_over(int sockfd) {
+    int *fds = xmalloc(NET_MAX_SOCKETS * sizeof(int));
+    int n = net_listeners(fds, NET_MAX_SOCKETS);
+    int rc = 0;
+    for (int i = 0; i < n && rc == 0; i += UPGRADE_FDS_PER_MSG) {
+        int count = n - i < UPGRADE_FDS_PER_MSG ? n - i : UPGRADE_FDS_PER_MSG;
+        rc = send_fds(sockfd, 'L', fds + i, count);
+    }
+    free(fds);
+    if (rc < 0 || send_fds(sockfd, 'E', NULL, 0) < 0) {
+        perror("upgrade: sendmsg");
+        return -1;
+    }
+
+    // The new server may take a while to load its data; we keep serving.
+    char reply;
+    ssize_t r;
+    do {
+        r = read(sockfd, &reply, 1);
+    } while (r < 0 && errno == EINTR);
+    if (r != 1 || reply != 'R') {
+        fprintf(stderr, "upgrade: the new server went away before serving; carrying on\n");
+        return -1;
+    }
+    printf("Handed %d listening sockets to a new server; draining\n", n);
+    return 0;
+}
+
+static void *control_loop(void *arg) {
+    int control_fd = (int) (intptr_t) arg;
+    for (;;) {
+        int sockfd = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (sockfd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("upgrade: accept");
+            }
+            continue;
+        }
+        int rc = hand_over(sockfd);
+        close(sockfd);
+        if (rc == 0) {
+            // The successor owns the path now; leave the file alone.
+            close(control_fd);
+            engine_drain();
+            return NULL;
+        }
+    }
+}
+
+void upgrade_serve(const char *path) {
+    if (predecessor >= 0) {
+        char ready = 'R';
+        if (write(predecessor, &ready, 1) != 1) {
+            perror("upgrade: notify the previous server");
+        }
+        close(predecessor);
+        predecessor = -1;
+    }
+
+    int control_fd = net_listen_unix(path, SOCK_STREAM, 4, 0);
+    net_forget(control_fd);     // never handed over, nor closed by a drain
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, control_loop, (void *) (intptr_t) control_fd);
+    if (rc != 0) {
+        die("pthread_create: %s", strerror(rc));
+    }
+    pthread_detach(thread);
+}
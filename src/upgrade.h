@@ -0,0 +1,27 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+// Hot upgrade over a Unix control socket (--upgrade-socket PATH). A server
+// starting with PATH first asks the server listening there, if any, for its
+// listening sockets; they arrive with SCM_RIGHTS and are claimed by the
+// net_listen_*() calls instead of binding new ones (see net_inherit()). Once
+// the new server is about to serve it tells the old one, which stops
+// accepting and drains (see engine_drain()), and takes over PATH itself for
+// the next upgrade. Both processes accept from the same sockets in between,
+// so no connection is refused and none queued in a backlog is lost.
+//
+// Protocol: the old server sends 'L' bytes carrying the sockets, at most
+// UPGRADE_FDS_PER_MSG at a time, then a plain 'E'. The new server answers 'R'
+// when it is serving; if it goes away first, the old one carries on.
+
+#define UPGRADE_FDS_PER_MSG 64
+
+// Takes over the listeners of the server at `path`, if one answers. Returns
+// the number of sockets received; dies if the handover breaks off midway.
+int upgrade_takeover(const char *path);
+
+// Releases the server taken over from, if any, and accepts upgrade requests
+// on `path` from a background thread.
+void upgrade_serve(const char *path);
+
+#endif
@@ -0,0 +1,120 @@
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <linux/mempolicy.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+void die(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+void perror_die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+void *xmalloc(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr == NULL && size != 0) {
+        die("out of memory allocating %zu bytes", size);
+    }
+    return ptr;
+}
+
+void *xcalloc(size_t nmemb, size_t size) {
+    void *ptr = calloc(nmemb, size);
+    if (ptr == NULL && nmemb != 0 && size != 0) {
+        die("out of memory allocating %zu x %zu bytes", nmemb, size);
+    }
+    return ptr;
+}
+
+void *xrealloc(void *ptr, size_t size) {
+    void *res = realloc(ptr, size);
+    if (res == NULL && size != 0) {
+        die("out of memory reallocating %zu bytes", size);
+    }
+    return res;
+}
+
+char *xstrdup(const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = xmalloc(len);
+    memcpy(copy, s, len);
+    return copy;
+}
+
+void *xcalloc_node(size_t size, int node) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = (size + page - 1) & ~(page - 1);
+    void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        die("out of memory allocating %zu bytes", size);
+    }
+    unsigned long mask[16] = {0};
+    if (node >= 0 && (size_t) node < 8 * sizeof(mask)) {
+        mask[node / (8 * sizeof(*mask))] |= 1ul << node % (8 * sizeof(*mask));
+        // Preferred rather than bound: a full node falls back to another. On
+        // a kernel without NUMA this fails and first touch decides as usual.
+        syscall(SYS_mbind, ptr, len, MPOL_PREFERRED, mask, 8 * sizeof(mask) + 1, 0);
+    }
+    return ptr;
+}
+
+uint64_t now_ms(void) {
+    return now_ns() / 1000000;
+}
+
+int64_t unix_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int fsync_dir(const char *path) {
+    char *copy = xstrdup(path);
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(copy);
+    if (fd < 0) {
+        return -1;
+    }
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
@@ -0,0 +1,49 @@
+#ifndef UTILS_H
+#define UTILS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Prints a formatted message to stderr and exits the process.
+void die(const char *fmt, ...) __attribute__((format(printf, 1, 2), noreturn));
+
+// Like perror(), but exits the process afterwards.
+void perror_die(const char *msg) __attribute__((noreturn));
+
+// Allocation wrappers that die on out-of-memory.
+void *xmalloc(size_t size);
+void *xcalloc(size_t nmemb, size_t size);
+void *xrealloc(void *ptr, size_t size);
+char *xstrdup(const char *s);
+
+// Zeroed, page-aligned memory placed on NUMA node `node` (-1 for no
+// preference) whichever thread touches it first, so that state set up by the
+// main thread for a pinned worker is local to it. Only for state that lives
+// as long as the process: it cannot be freed.
+void *xcalloc_node(size_t size, int node);
+
+// Monotonic clock in milliseconds / nanoseconds.
+uint64_t now_ms(void);
+uint64_t now_ns(void);
+
+// Wall-clock Unix time in milliseconds, for timestamps that outlive the process.
+int64_t unix_ms(void);
+
+// xorshift64*: a fast generator for sampling, not for anything secret.
+// `state` must not be 0.
+static inline uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dull;
+}
+
+// Writes all `len` bytes, retrying short writes and EINTR. Returns 0 or -1.
+int write_all(int fd, const void *data, size_t len);
+
+// fsyncs the directory containing `path`, making a rename into it durable.
+int fsync_dir(const char *path);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef TEST_H
+#define TEST_H
+
+// A minimal harness: CHECK() reports a failed condition and carries on, and
+// a test binary exits non-zero if any check failed.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int test_failures;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+                    #cond);                                                  \
+            test_failures++;                                                 \
+        }                                                                    \
+    } while (0)
+
+static inline int test_report(const char *name) {
+    printf("%s: %s\n", name, test_failures ? "FAILED" : "ok");
+    return test_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif
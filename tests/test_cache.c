@@ -0,0 +1,155 @@
+// The response cache and the open-file cache: replacement and eviction.
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "src/filecache.h"
+#include "src/httpcache.h"
+#include "src/kv.h"
+#include "src/utils.h"
+#include "tests/test.h"
+
+#define RESPONSE_LEN 1000
+
+static void put(const char *key, char fill) {
+    char body[RESPONSE_LEN];
+    memset(body, fill, sizeof(body));
+    struct rcbuf *rc = rcbuf_new(body, sizeof(body));
+    httpcache_put(key, strlen(key), rc, 10, fill);
+    rcbuf_unref(rc);
+}
+
+// Returns the fill byte of the cached response, or 0 on a miss.
+static char get(const char *key) {
+    struct http_cached c;
+    if (!httpcache_get(key, strlen(key), &c)) {
+        return 0;
+    }
+    char fill = c.data->data[0];
+    CHECK(c.tag == (uint64_t) fill && c.head_len == 10 && c.data->len == RESPONSE_LEN);
+    rcbuf_unref(c.data);
+    return fill;
+}
+
+static void test_httpcache(void) {
+    // Room for three responses and their bookkeeping, not four.
+    httpcache_init(3 * (RESPONSE_LEN + 200), 60000);
+    put("GET /a", 'a');
+    put("GET /b", 'b');
+    CHECK(get("GET /a") == 'a' && get("GET /b") == 'b');
+    put("GET /a", 'A');
+    CHECK(get("GET /a") == 'A' && get("GET /b") == 'b');
+
+    put("GET /c", 'c');
+    CHECK(get("GET /a") == 'A');        // now b is the least recently used
+    put("GET /d", 'd');
+    CHECK(get("GET /b") == 0);
+    CHECK(get("GET /a") == 'A' && get("GET /c") == 'c' && get("GET /d") == 'd');
+}
+
+// Replacing the key at the head of a hash chain must keep the rest of the
+// chain reachable, and evicting it later must find it.
+static void test_httpcache_chain(void) {
+    char head[32], tail[32];
+    snprintf(head, sizeof(head), "GET /head");
+    uint64_t bucket = kv_hash(head, strlen(head)) & 0xffff;   // same for any table size
+    for (int i = 0;; i++) {
+        snprintf(tail, sizeof(tail), "GET /tail%d", i);
+        if ((kv_hash(tail, strlen(tail)) & 0xffff) == bucket) {
+            break;
+        }
+    }
+    put(head, 'h');
+    put(tail, 't');
+    put(head, 'H');
+    CHECK(get(tail) == 't' && get(head) == 'H');
+    // Push both out; evicting the chain's tail must not crash.
+    put("GET /e1", '1');
+    put("GET /e2", '2');
+    put("GET /e3", '3');
+    CHECK(get(head) == 0 && get(tail) == 0);
+    CHECK(get("GET /e3") == '3');
+}
+
+static void write_file(const char *dir, const char *name, const char *text) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0 && write_all(fd, text, strlen(text)) == 0);
+    close(fd);
+}
+
+// Waits for the watch thread to drop `path`.
+static int invalidated(const char *path) {
+    uint64_t deadline = now_ms() + 2000;
+    while (filecache_version(path) != 0) {
+        if (now_ms() > deadline) {
+            return 0;
+        }
+        usleep(1000);
+    }
+    return 1;
+}
+
+static uint64_t open_version(const char *path, uint64_t *size) {
+    struct file_info fi;
+    if (filecache_get(path, &fi) < 0) {
+        return 0;
+    }
+    *size = fi.size;
+    rcfile_unref(fi.file);
+    return fi.version;
+}
+
+static void test_filecache(void) {
+    char dir[] = "/tmp/cs_test_XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    write_file(dir, "one", "1");
+    write_file(dir, "two", "22");
+    write_file(dir, "three", "333");
+    filecache_init(dir, 2);
+
+    uint64_t size;
+    uint64_t v1 = open_version("one", &size);
+    CHECK(v1 != 0 && size == 1);
+    CHECK(open_version("one", &size) == v1);
+
+    // Rewritten in place, then replaced by a rename.
+    write_file(dir, "one", "1111");
+    CHECK(invalidated("one"));
+    uint64_t v2 = open_version("one", &size);
+    CHECK(v2 != 0 && v2 != v1 && size == 4);
+    write_file(dir, "new", "11");
+    char from[256], to[256];
+    snprintf(from, sizeof(from), "%s/new", dir);
+    snprintf(to, sizeof(to), "%s/one", dir);
+    CHECK(rename(from, to) == 0);
+    CHECK(invalidated("one"));
+    CHECK(open_version("one", &size) != 0 && size == 2);
+
+    // Two entries at most: the least recently used goes.
+    CHECK(open_version("two", &size) != 0);
+    CHECK(open_version("three", &size) != 0);
+    CHECK(filecache_version("one") == 0);
+    CHECK(filecache_version("two") != 0 && filecache_version("three") != 0);
+
+    snprintf(from, sizeof(from), "%s/link", dir);
+    CHECK(symlink("two", from) == 0);
+    CHECK(open_version("link", &size) == 0 && errno == ELOOP);
+
+    const char *names[] = {"one", "two", "three", "link"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        snprintf(from, sizeof(from), "%s/%s", dir, names[i]);
+        unlink(from);
+    }
+    rmdir(dir);
+}
+
+int main(void) {
+    test_httpcache();
+    test_httpcache_chain();
+    test_filecache();
+    return test_report("cache");
+}
@@ -0,0 +1,107 @@
+// HTTP request parser: split reads, pipelining and malformed framing.
+#include <string.h>
+
+#include "src/http.h"
+#include "tests/test.h"
+
+static enum http_status parse_all(struct http_parser *p, const char *req) {
+    http_parser_init(p, 1024);
+    return http_parse(p, req, strlen(req));
+}
+
+static void test_split_reads(void) {
+    const char req[] = "GET /a/b?x=1 HTTP/1.1\r\nHost: h\r\nContent-Length: 5\r\n"
+                       "X-Pad:   v  \r\n\r\nhello";
+    size_t len = sizeof(req) - 1;
+    struct http_parser p;
+    http_parser_init(&p, 1024);
+    // Every prefix is incomplete; the same start is passed with more appended.
+    for (size_t n = 0; n < len; n++) {
+        CHECK(http_parse(&p, req, n) == HTTP_INCOMPLETE);
+    }
+    CHECK(http_parse(&p, req, len) == HTTP_REQUEST);
+    CHECK(p.pos == len);
+    CHECK(http_slice_eq(req, p.method, "GET", 3));
+    CHECK(http_slice_eq(req, p.target, "/a/b?x=1", 8));
+    CHECK(http_slice_eq(req, p.path, "/a/b", 4));
+    CHECK(p.minor == 1 && p.keep_alive);
+    CHECK(p.nheaders == 3);
+    const struct http_slice *v = http_find_header(&p, req, "x-pad");
+    CHECK(v && http_slice_eq(req, *v, "v", 1));
+    CHECK(http_slice_eq(req, p.body, "hello", 5));
+}
+
+static void test_pipelined(void) {
+    const char req[] = "GET /one HTTP/1.1\r\n\r\n"
+                       "POST /two HTTP/1.0\r\nContent-Length: 3\r\n\r\nabc"
+                       "GET /three HTTP/1.1\r\nConnection: close\r\n\r\n";
+    size_t len = sizeof(req) - 1, off = 0;
+    struct http_parser p;
+    http_parser_init(&p, 1024);
+
+    CHECK(http_parse(&p, req, len) == HTTP_REQUEST);
+    CHECK(http_slice_eq(req, p.path, "/one", 4) && p.body.len == 0);
+    off += p.pos;
+    http_parser_reset(&p);
+
+    const char *d = req + off;
+    CHECK(http_parse(&p, d, len - off) == HTTP_REQUEST);
+    CHECK(http_slice_eq(d, p.path, "/two", 4) && http_slice_eq(d, p.body, "abc", 3));
+    CHECK(p.minor == 0 && !p.keep_alive);
+    off += p.pos;
+    http_parser_reset(&p);
+
+    d = req + off;
+    CHECK(http_parse(&p, d, len - off) == HTTP_REQUEST);
+    CHECK(http_slice_eq(d, p.path, "/three", 6) && !p.keep_alive);
+    CHECK(off + p.pos == len);
+}
+
+static void test_content_length(void) {
+    struct http_parser p;
+    CHECK(parse_all(&p, "POST / HTTP/1.1\r\nContent-Length: 2\r\nContent-Length: 2\r\n\r\nok") ==
+          HTTP_REQUEST);
+    CHECK(parse_all(&p, "POST / HTTP/1.1\r\nContent-Length: 2\r\nContent-Length: 3\r\n\r\n") ==
+          HTTP_ERROR);
+    CHECK(p.error_status == 400);
+    CHECK(parse_all(&p, "POST / HTTP/1.1\r\nContent-Length: 1025\r\n\r\n") == HTTP_ERROR);
+    CHECK(p.error_status == 413);
+    CHECK(parse_all(&p, "POST / HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n") ==
+          HTTP_ERROR);
+    CHECK(p.error_status == 413);
+    CHECK(parse_all(&p, "POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n") == HTTP_ERROR);
+    CHECK(p.error_status == 400);
+    CHECK(parse_all(&p, "POST / HTTP/1.1\r\nContent-Length:\r\n\r\n") == HTTP_ERROR);
+    CHECK(p.error_status == 400);
+    CHECK(parse_all(&p, "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n") == HTTP_ERROR);
+    CHECK(p.error_status == 501);
+}
+
+static void test_malformed(void) {
+    struct http_parser p;
+    // Obsolete line folding: a continuation line starting with whitespace.
+    CHECK(parse_all(&p, "GET / HTTP/1.1\r\nX-A: one\r\n two\r\n\r\n") == HTTP_ERROR);
+    CHECK(p.error_status == 400);
+    CHECK(parse_all(&p, "GET / HTTP/1.1\r\n\tX-A: one\r\n\r\n") == HTTP_ERROR);
+    CHECK(parse_all(&p, "GET / HTTP/1.1\r\nX A: one\r\n\r\n") == HTTP_ERROR);
+    CHECK(parse_all(&p, "GET / HTTP/2.0\r\n\r\n") == HTTP_ERROR);
+    CHECK(p.error_status == 505);
+    CHECK(parse_all(&p, "GET /\r\n\r\n") == HTTP_ERROR);
+    CHECK(p.error_status == 400);
+    // Leading empty lines are tolerated.
+    CHECK(parse_all(&p, "\r\n\r\nGET / HTTP/1.1\r\n\r\n") == HTTP_REQUEST);
+
+    static char big[HTTP_MAX_HEAD + 64];
+    memset(big, 'a', sizeof(big));
+    memcpy(big, "GET / HTTP/1.1\r\nX: ", 19);
+    http_parser_init(&p, 1024);
+    CHECK(http_parse(&p, big, sizeof(big)) == HTTP_ERROR && p.error_status == 431);
+}
+
+int main(void) {
+    test_split_reads();
+    test_pipelined();
+    test_content_length();
+    test_malformed();
+    return test_report("http");
+}
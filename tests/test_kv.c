@@ -0,0 +1,97 @@
+// The Swiss table: inserts, erases and reinserts while a rehash is under way.
+#include <stdio.h>
+#include <string.h>
+
+#include "src/kv.h"
+#include "tests/test.h"
+
+#define N 20000
+
+static size_t key(char *out, int i) {
+    return snprintf(out, 32, "key:%d", i);
+}
+
+static int has(struct kv_store *st, int i, const char *value) {
+    char k[32];
+    size_t klen = key(k, i);
+    struct kv_entry *e = kv_lookup(st, k, klen);
+    if (e == NULL) {
+        return 0;
+    }
+    return value == NULL || (e->vlen == strlen(value) && !memcmp(kv_value(e), value, e->vlen));
+}
+
+static void test_rehash(void) {
+    struct kv_store st;
+    kv_store_init(&st);
+    char k[32];
+    int saw_rehash = 0, erased_during = 0;
+    for (int i = 0; i < N; i++) {
+        size_t klen = key(k, i);
+        kv_set(&st, k, klen, "v", 1);
+        saw_rehash |= st.rehashing;
+        // Erase every third key, part of them while entries are migrating.
+        if (i % 3 == 0) {
+            CHECK(kv_delete(&st, k, klen) == 1);
+            erased_during += st.rehashing;
+        }
+    }
+    CHECK(saw_rehash && erased_during > 0);
+    CHECK(kv_count(&st) == N - (N + 2) / 3);
+    for (int i = 0; i < N; i++) {
+        CHECK(has(&st, i, NULL) == (i % 3 != 0));
+    }
+
+    // Reinsert the erased keys over their tombstones, with long values.
+    char big[KV_INLINE_VALUE_MAX + 10];
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    for (int i = 0; i < N; i += 3) {
+        size_t klen = key(k, i);
+        CHECK(kv_lookup(&st, k, klen) == NULL);
+        kv_set(&st, k, klen, big, strlen(big));
+    }
+    CHECK(kv_count(&st) == N);
+    while (kv_rehash_for(&st, 1000000)) {
+    }
+    CHECK(!st.rehashing && st.old.count == 0);
+    for (int i = 0; i < N; i++) {
+        CHECK(has(&st, i, i % 3 == 0 ? big : "v"));
+    }
+    CHECK(kv_delete(&st, "missing", 7) == 0);
+
+    size_t pos = 0, seen = 0;
+    while (kv_next(&st, &pos)) {
+        seen++;
+    }
+    CHECK(seen == N);
+    kv_store_free(&st);
+}
+
+// Churn through far more keys than stay live; tombstones must be reclaimed
+// rather than filling the table.
+static void test_tombstones(void) {
+    struct kv_store st;
+    kv_store_init(&st);
+    char k[32];
+    for (int i = 0; i < 200000; i++) {
+        size_t klen = key(k, i);
+        kv_set(&st, k, klen, "v", 1);
+        if (i >= 8) {
+            klen = key(k, i - 8);
+            CHECK(kv_delete(&st, k, klen) == 1);
+        }
+    }
+    CHECK(kv_count(&st) == 8);
+    CHECK(st.cur.capacity <= 1024);
+    for (int i = 200000 - 8; i < 200000; i++) {
+        CHECK(has(&st, i, "v"));
+    }
+    kv_store_free(&st);
+}
+
+int main(void) {
+    test_rehash();
+    test_tombstones();
+    return test_report("kv");
+}
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Serves a small and a large file with the open-file cache on and off, and
+# loads each with tools/http_bench. Run from the repository root:
+#
+#   tools/filecache_bench.sh [PORT] [CONNECTIONS] [SECONDS]
+set -e
+
+PORT=${1:-9090}
+CONNS=${2:-32}
+SECONDS_EACH=${3:-10}
+
+make -s concurrent_server tools/http_bench
+WWW=$(mktemp -d)
+trap 'rm -rf "$WWW"' EXIT
+head -c 600 /dev/urandom > "$WWW/small.bin"
+head -c 1048576 /dev/urandom > "$WWW/large.bin"
+
+for cache in 1024 0; do
+    echo "--http-file-cache $cache"
+    ./concurrent_server --mode http --port "$PORT" --http-root "$WWW" \
+        --http-file-cache "$cache" > /dev/null &
+    server=$!
+    sleep 0.5
+    for file in small.bin large.bin; do
+        tools/http_bench "$PORT" "/$file" "$CONNS" "$SECONDS_EACH"
+    done
+    kill -TERM "$server"
+    wait "$server"
+done
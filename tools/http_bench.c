@@ -0,0 +1,148 @@
+// Keep-alive HTTP load generator: each connection sends a GET, reads the
+// whole response (by its Content-Length) and sends the next one, so there is
+// one request in flight per connection. Reports requests and bytes per
+// second.
+//
+//   tools/http_bench PORT PATH CONNECTIONS SECONDS
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+struct client {
+    int fd;
+    int in_body;                // headers done, counting body bytes
+    size_t body_left;
+    char head[4096];            // response headers gathered so far
+    size_t head_len;
+};
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Consumes up to `len` bytes of a response; returns how many were used and
+// sets *done when the response is complete.
+static size_t consume(struct client *c, const char *data, size_t len, int *done) {
+    *done = 0;
+    if (!c->in_body) {
+        size_t take = sizeof(c->head) - 1 - c->head_len;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(c->head + c->head_len, data, take);
+        c->head[c->head_len + take] = '\0';
+        char *end = strstr(c->head, "\r\n\r\n");
+        if (end == NULL) {
+            if (c->head_len + take == sizeof(c->head) - 1) {
+                fprintf(stderr, "response headers too large\n");
+                exit(EXIT_FAILURE);
+            }
+            c->head_len += take;
+            return take;
+        }
+        const char *cl = strcasestr(c->head, "\r\nContent-Length:");
+        if (cl == NULL) {
+            fprintf(stderr, "response without Content-Length\n");
+            exit(EXIT_FAILURE);
+        }
+        size_t used = end + 4 - c->head - c->head_len;
+        c->body_left = strtoul(cl + 17, NULL, 10);
+        c->in_body = 1;
+        c->head_len = 0;
+        return used;
+    }
+    size_t take = len < c->body_left ? len : c->body_left;
+    c->body_left -= take;
+    if (c->body_left == 0) {
+        c->in_body = 0;
+        *done = 1;
+    }
+    return take;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 5) {
+        fprintf(stderr, "usage: %s PORT PATH CONNECTIONS SECONDS\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int port = atoi(argv[1]);
+    const char *path = argv[2];
+    int nconns = atoi(argv[3]);
+    double seconds = atof(argv[4]);
+
+    char request[512];
+    int rlen = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n",
+                        path);
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct client *clients = calloc(nconns, sizeof(*clients));
+    if (epfd < 0 || clients == NULL) {
+        perror("setup");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < nconns; i++) {
+        struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(port),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        };
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            perror("connect");
+            return EXIT_FAILURE;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        clients[i].fd = fd;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &clients[i]};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0 || write(fd, request, rlen) != rlen) {
+            perror("start");
+            return EXIT_FAILURE;
+        }
+    }
+
+    static char buf[1 << 20];
+    struct epoll_event events[256];
+    long requests = 0;
+    double bytes = 0, start = now_s(), end = start + seconds;
+    while (now_s() < end) {
+        int n = epoll_wait(epfd, events, 256, 100);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return EXIT_FAILURE;
+        }
+        for (int i = 0; i < n; i++) {
+            struct client *c = events[i].data.ptr;
+            ssize_t r = read(c->fd, buf, sizeof(buf));
+            if (r <= 0) {
+                fprintf(stderr, "connection closed by the server\n");
+                return EXIT_FAILURE;
+            }
+            bytes += r;
+            for (size_t off = 0; off < (size_t) r;) {
+                int done;
+                off += consume(c, buf + off, r - off, &done);
+                if (done) {
+                    requests++;
+                    if (write(c->fd, request, rlen) != rlen) {
+                        perror("write");
+                        return EXIT_FAILURE;
+                    }
+                }
+            }
+        }
+    }
+    double elapsed = now_s() - start;
+    printf("%s, %d connections: %.0f req/s, %.1f MB/s\n", path, nconns, requests / elapsed,
+           bytes / elapsed / 1e6);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,158 @@
+// Minimal client for the shared-memory transport (see src/shm.h): creates the
+// sealed segment and the doorbells, hands them to a server started with
+// --shm PATH, writes MESSAGE into the request ring and prints whatever comes
+// back until the server has been quiet for IDLE_MS (default 200).
+//
+//   tools/shm_client /run/cs.shm '^hello$'                 # transform: *ifmmp
+//   tools/shm_client /run/cs.shm $'PING\r\n'               # --mode kv: +PONG
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "src/shm.h"
+
+#define RING_SIZE (64u << 10)
+
+static int server_doorbell, client_doorbell;
+
+static void ring(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0) {
+        perror("write doorbell");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Sleeps until our doorbell rings or `timeout_ms` passes; returns 0 on timeout.
+static int wait_doorbell(int timeout_ms) {
+    struct pollfd pfd = {.fd = client_doorbell, .events = POLLIN};
+    int n = poll(&pfd, 1, timeout_ms);
+    if (n > 0) {
+        uint64_t count;
+        if (read(client_doorbell, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            perror("read doorbell");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return n > 0;
+}
+
+static void send_fds(int sockfd, const int *fds, int n) {
+    char byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(n * sizeof(int)),
+    };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, n * sizeof(int));
+    if (sendmsg(sockfd, &msg, 0) != 1) {
+        perror("sendmsg");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "usage: %s PATH MESSAGE [IDLE_MS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int idle_ms = argc == 4 ? atoi(argv[3]) : 200;
+
+    // The server refuses a segment that could still shrink under its mapping.
+    size_t size = shm_segment_size(RING_SIZE);
+    int memfd = memfd_create("shm_client", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0 || ftruncate(memfd, size) < 0 ||
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0) {
+        perror("memfd");
+        return EXIT_FAILURE;
+    }
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    shm_segment_init(base, RING_SIZE);
+    struct shm_ring tx, rx;
+    shm_ring_attach(&tx, base, RING_SIZE, SHM_RING_C2S);
+    shm_ring_attach(&rx, base, RING_SIZE, SHM_RING_S2C);
+    server_doorbell = eventfd(0, EFD_CLOEXEC);
+    client_doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (server_doorbell < 0 || client_doorbell < 0) {
+        perror("eventfd");
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "path too long: %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, argv[1]);
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0 || connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    int fds[3] = {memfd, server_doorbell, client_doorbell};
+    send_fds(sockfd, fds, 3);
+
+    const char *msg = argv[2];
+    size_t left = strlen(msg);
+    char buf[4096];
+    for (;;) {
+        int progress = 0;
+        if (left > 0) {
+            size_t n = shm_ring_write(&tx, msg, left);
+            msg += n;
+            left -= n;
+            if (n > 0 && shm_ring_should_wake_consumer(&tx)) {
+                ring(server_doorbell);
+            }
+            progress |= n > 0;
+        }
+        size_t n = shm_ring_read(&rx, buf, sizeof(buf));
+        if (n > 0) {
+            fwrite(buf, 1, n, stdout);
+            if (shm_ring_should_wake_producer(&rx)) {
+                ring(server_doorbell);
+            }
+            progress = 1;
+        }
+        if (progress) {
+            continue;
+        }
+        // Announce that we sleep, then re-check: see shm.h on the handshake.
+        // Replies are awaited even while the request is stuck, or a server
+        // blocked on a full reply ring and we would wait for each other.
+        int raced = shm_ring_prepare_wait_data(&rx);
+        if (!raced && left > 0) {
+            raced = shm_ring_prepare_wait_space(&tx);
+        }
+        if (!raced && !wait_doorbell(left > 0 ? -1 : idle_ms)) {
+            break;
+        }
+    }
+    fflush(stdout);
+    // Closing the rendezvous socket tells the server we are gone.
+    close(sockfd);
+    return EXIT_SUCCESS;
+}